@@ -0,0 +1,76 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <stdio.h>
+#include <string.h>
+
+#include "journal.h"
+
+#define JOURNAL_MAGIC	"cortexflash journal 3"
+
+char journal_load(const char *path, journal_t *j) {
+	char magic[32];
+	unsigned int pid;
+	FILE *f;
+	int n;
+
+	f = fopen(path, "r");
+	if (!f)
+		return 0;
+
+	n = fscanf(f, "%31[^\n]\ndevice %255[^\n]\npid %x\naddress %x\nsize %u\ncrc %x\ndone %x\n",
+		magic, j->device, &pid, &j->address, &j->size, &j->crc, &j->done);
+	fclose(f);
+
+	if (n != 7 || strcmp(magic, JOURNAL_MAGIC) != 0)
+		return 0;
+	j->pid = pid;
+	return 1;
+}
+
+/* write a new copy and rename it over the old, so a crash leaves one or the other */
+char journal_save(const char *path, const journal_t *j) {
+	char tmp[FILENAME_MAX];
+	FILE *f;
+	int ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	f = fopen(tmp, "w");
+	if (!f)
+		return 0;
+
+	ok = fprintf(f, "%s\ndevice %s\npid %04x\naddress %08x\nsize %u\ncrc %08x\ndone %08x\n",
+		JOURNAL_MAGIC, j->device, j->pid, j->address, j->size, j->crc, j->done) > 0;
+	ok = fclose(f) == 0 && ok;
+
+#ifdef __WIN32__
+	/* rename does not replace an existing file here */
+	remove(path);
+#endif
+	if (!ok || rename(tmp, path) != 0) {
+		remove(tmp);
+		return 0;
+	}
+	return 1;
+}
+
+void journal_remove(const char *path) {
+	remove(path);
+}
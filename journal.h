@@ -0,0 +1,46 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_JOURNAL
+#define _H_JOURNAL
+
+#include <stdint.h>
+
+/*
+	progress of a flash write, kept on disk next to the image so a run
+	that dies part way can carry on from the last checkpoint.  The first
+	five fields say which write it was, the journal is only used again
+	when they all match.
+*/
+typedef struct {
+	char		device[256];
+	uint16_t	pid;
+	uint32_t	address;	/* where the image starts in flash */
+	uint32_t	size;
+	uint32_t	crc;		/* CRC-32 of the image */
+	uint32_t	done;		/* image bytes the bootloader acked, read back with -v */
+} journal_t;
+
+char journal_load  (const char *path, journal_t *j);
+char journal_save  (const char *path, const journal_t *j);
+void journal_remove(const char *path);
+
+#endif
+
@@ -0,0 +1,503 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "loader.h"
+#include "utils.h"
+#include "lz4.h"
+#include "stm32/loader_proto.h"
+
+#define LOADER_WINDOW	8		/* frames on the wire at most */
+#define LOADER_RING	16384		/* ring asked for, less on devices without the RAM */
+#define LOADER_BANK_END	0x08080000	/* the loader only drives the first flash bank */
+#define LOADER_START	1000000		/* us for the applet to take the USART, or give it back */
+#define LOADER_TIMEOUT	500000		/* us on top of the wire time for an answer */
+#define LOADER_QUIET	250000		/* us of silence that means the loader has caught up */
+#define LOADER_RETRY	4		/* recoveries in a row before giving up */
+
+#define LOADER_SLOT	(LOADER_HEAD + LOADER_FRAME + LOADER_CRC)
+
+/* one frame on the wire */
+typedef struct {
+	uint8_t		op;
+	uint8_t		seq;
+	uint32_t	address;
+	unsigned int	len;		/* data bytes written or read */
+	unsigned int	wire;		/* data bytes in the frame, fewer than len for ZWRITE */
+	uint8_t		*dest;		/* READ, where the wanted bytes go */
+	unsigned int	skip;		/* READ, bytes before the wanted ones */
+	unsigned int	want;
+	unsigned int	size;		/* bytes in frame */
+	uint8_t		frame[LOADER_SLOT];
+} loader_slot_t;
+
+struct loader {
+	const stm32_t	*stm;
+	unsigned int	ring;		/* the frames on the wire stay below this */
+	loader_slot_t	slot[LOADER_WINDOW];
+	loader_slot_t	ask;		/* SYNC and QUIT, sent outside the window */
+	unsigned int	first;		/* oldest frame on the wire */
+	unsigned int	count;
+	unsigned int	inflight;	/* ring bytes they take */
+	uint8_t		seq;		/* for the next frame */
+	unsigned int	retries;	/* recoveries since the last good answer */
+	char		failed;		/* the stream is in an unknown state */
+	char		compress;
+	uint32_t	acked;
+	loader_stats_t	stats;
+
+	/* the WRITE frame being collected */
+	uint32_t	wr_address;
+	unsigned int	wr_len;
+	uint8_t		wr_data[LOADER_FRAME];
+	uint8_t		wr_pack[LOADER_FRAME];	/* and its ZWRITE data */
+};
+
+char loader_reply  (loader_t *ld);
+char loader_recover(loader_t *ld);
+
+static void loader_put_u32(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static uint32_t loader_get_u32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* header and CRC around the data already in s->frame */
+static void loader_encode(loader_slot_t *s) {
+	uint8_t *f = s->frame;
+	unsigned int n = LOADER_HEAD + s->wire;
+	unsigned int i;
+
+	f[0] = LOADER_SYNC;
+	f[1] = s->op;
+	f[2] = s->seq;
+	f[3] = 0;
+	loader_put_u32(f + 4, s->address);
+	loader_put_u32(f + 8, s->op == LOADER_OP_READ ? s->len : s->wire);
+	for(i = 0; i < LOADER_HEAD; ++i)
+		if (i != 3)
+			f[3] ^= f[i];
+
+	loader_put_u32(f + n, crc32_stm32(0xFFFFFFFF, f, n));
+	s->size = n + LOADER_CRC;
+}
+
+/* bytes expected back for the frame */
+static unsigned int loader_answer(const loader_slot_t *s) {
+	return 2 + (s->op == LOADER_OP_READ ? s->len + LOADER_CRC : 0);
+}
+
+/* throw away whatever arrives until the line has been quiet this long */
+static void loader_drain(loader_t *ld, uint32_t quiet) {
+	uint8_t buf[256];
+
+	while(serial_read_avail(ld->stm->serial, buf, sizeof(buf), serial_time_us() + quiet) > 0)
+		;
+}
+
+/*
+	send a SYNC or QUIT frame and wait for its answer, status.  When
+	the stream is not known to be clean the loader is first given time
+	to work through what it has, and later tries lead with fill: a lost
+	byte may have left it waiting for the rest of a frame, which zeros
+	complete without ever looking like a header.
+*/
+static char loader_ask(loader_t *ld, uint8_t op, uint8_t status, uint8_t *seq) {
+	const stm32_t *stm = ld->stm;
+	uint8_t fill[LOADER_SLOT];
+	uint8_t reply[2];
+	loader_slot_t *s = &ld->ask;
+	unsigned int try;
+
+	memset(fill, 0, sizeof(fill));
+	s->op		= op;
+	s->seq		= 0;
+	s->address	= 0;
+	s->len		= 0;
+	s->wire		= 0;
+	loader_encode(s);
+
+	for(try = 0; try < LOADER_RETRY; ++try) {
+		if (try > 0 || ld->failed)
+			loader_drain(ld, LOADER_QUIET);
+		if (try > 0 && serial_write(stm->serial, fill, sizeof(fill)) != SERIAL_ERR_OK)
+			break;
+		if (serial_write(stm->serial, s->frame, s->size) != SERIAL_ERR_OK)
+			break;
+
+		if (serial_read_deadline(stm->serial, reply, sizeof(reply),
+		    serial_time_us() + stm32_wire_time(stm, sizeof(fill) + s->size + sizeof(reply)) + LOADER_TIMEOUT) == SERIAL_ERR_OK &&
+		    reply[0] == status) {
+			*seq = reply[1];
+			return 1;
+		}
+	}
+
+	ld->failed = 1;
+	fprintf(stderr, "Lost sync with the flash loader\n");
+	return 0;
+}
+
+/*
+	upload the loader and hand the USART to it.  NULL when it cannot
+	run here, the bootloader is back in charge and can do the job.
+*/
+loader_t* loader_open(const stm32_t *stm, char compress) {
+	stm32_mailbox_t mb;
+	loader_t *ld;
+	unsigned int ring;
+	uint64_t deadline;
+	uint8_t byte;
+
+	/* the ring goes in the RAM past the applet's stack, the page buffer after it */
+	for(ring = LOADER_RING; ring >= 2 * LOADER_SLOT; ring /= 2)
+		if (stm->dev->ram_end >= APPLET_BUFFER + ring + LOADER_FRAME)
+			break;
+	if (ring < 2 * LOADER_SLOT) {
+		fprintf(stderr, "Not enough RAM for the flash loader on this device\n");
+		return NULL;
+	}
+	if (stm->dev->fl_end > LOADER_BANK_END) {
+		fprintf(stderr, "The flash loader does not drive the second flash bank of this device\n");
+		return NULL;
+	}
+
+	ld = calloc(1, sizeof(loader_t));
+	if (!ld) {
+		perror("calloc");
+		return NULL;
+	}
+	ld->stm		= stm;
+	ld->ring	= ring;
+	ld->compress	= compress;
+
+	memset(&mb, 0, sizeof(mb));
+	mb.arg[0] = APPLET_BUFFER;
+	mb.arg[1] = ring;
+	mb.arg[2] = LOADER_FRAME;
+	mb.arg[3] = APPLET_BUFFER + ring;
+	mb.arg[4] = serial_get_speed(stm->serial);
+	if (!stm32_applet_start(stm, &stm32_applet_loader, &mb)) {
+		free(ld);
+		return NULL;
+	}
+
+	/* the ACK to GO may come first */
+	deadline = serial_time_us() + LOADER_START;
+	while(serial_read_deadline(stm->serial, &byte, 1, deadline) == SERIAL_ERR_OK)
+		if (byte == LOADER_READY &&
+		    serial_read_deadline(stm->serial, &byte, 1, deadline) == SERIAL_ERR_OK && byte == 0)
+			return ld;
+
+	/* it refused the job and went back, or never ran */
+	if (stm32_applet_finish(stm, &stm32_applet_loader, &mb, LOADER_START))
+		fprintf(stderr, "The flash loader did not start, status %u\n", mb.status);
+	else
+		fprintf(stderr, "The flash loader did not start\n");
+	free(ld);
+	return NULL;
+}
+
+/* wait for room for a frame of size bytes, then hand out its slot */
+static loader_slot_t* loader_slot(loader_t *ld, unsigned int size) {
+	while(ld->count == LOADER_WINDOW || ld->inflight + size >= ld->ring)
+		if (!loader_reply(ld))
+			return NULL;
+	return &ld->slot[(ld->first + ld->count) % LOADER_WINDOW];
+}
+
+/* number, encode and send the frame in the next slot */
+static char loader_post(loader_t *ld, loader_slot_t *s) {
+	s->seq = ld->seq++;
+	loader_encode(s);
+	ld->count++;
+	ld->inflight += s->size;
+	if (serial_write(ld->stm->serial, s->frame, s->size) != SERIAL_ERR_OK) {
+		ld->failed = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+	the ZWRITE data for the frame collected so far, its size or 0 when
+	it would not come out shorter than the WRITE data
+*/
+static unsigned int loader_pack(loader_t *ld, unsigned int len) {
+	unsigned int n;
+
+	/* the expanded length and the block padded to a word, inside len - 4 */
+	if (!ld->compress || len <= 8)
+		return 0;
+	n = lz4_compress(ld->wr_data, len, ld->wr_pack + 4, len - 8);
+	if (n == 0)
+		return 0;
+	loader_put_u32(ld->wr_pack, len);
+	for(; n % 4; ++n)
+		ld->wr_pack[4 + n] = 0;
+	return 4 + n;
+}
+
+/* send the WRITE frame collected so far, the last word padded with 0xFF */
+static char loader_push(loader_t *ld) {
+	unsigned int len = (ld->wr_len + 3) & ~3;
+	unsigned int packed;
+	loader_slot_t *s;
+
+	if (ld->wr_len == 0)
+		return 1;
+
+	memset(ld->wr_data + ld->wr_len, 0xFF, len - ld->wr_len);
+	packed = loader_pack(ld, len);
+
+	s = loader_slot(ld, LOADER_HEAD + (packed ? packed : len) + LOADER_CRC);
+	if (!s)
+		return 0;
+	if (packed) {
+		memcpy(s->frame + LOADER_HEAD, ld->wr_pack, packed);
+		s->op	= LOADER_OP_ZWRITE;
+		s->wire	= packed;
+		ld->stats.packed++;
+	} else {
+		memcpy(s->frame + LOADER_HEAD, ld->wr_data, len);
+		s->op	= LOADER_OP_WRITE;
+		s->wire	= len;
+	}
+	s->address	= ld->wr_address;
+	s->len		= len;
+	s->dest		= NULL;
+	ld->wr_len	= 0;
+	if (!loader_post(ld, s))
+		return 0;
+
+	ld->stats.frames++;
+	ld->stats.data += len;
+	ld->stats.wire += s->size;
+	return 1;
+}
+
+/* take the answer to the oldest frame on the wire */
+char loader_reply(loader_t *ld) {
+	const stm32_t *stm = ld->stm;
+	loader_slot_t *s = &ld->slot[ld->first];
+	uint8_t data[LOADER_FRAME + LOADER_CRC];
+	uint8_t reply[2];
+	uint64_t deadline;
+
+	if (ld->failed)
+		return 0;
+
+	deadline = serial_time_us() + stm32_wire_time(stm, ld->inflight + loader_answer(s)) + LOADER_TIMEOUT;
+	if (serial_read_deadline(stm->serial, reply, sizeof(reply), deadline) != SERIAL_ERR_OK ||
+	    reply[1] != s->seq)
+		return loader_recover(ld);
+
+	if (reply[0] == LOADER_EFLASH) {
+		fprintf(stderr, "The flash at 0x%08x does not read back what was written\n", s->address);
+		ld->failed = 1;
+		return 0;
+	}
+	if (reply[0] == LOADER_EDATA) {
+		fprintf(stderr, "The flash loader could not expand the data for 0x%08x\n", s->address);
+		ld->failed = 1;
+		return 0;
+	}
+	if (reply[0] != LOADER_ACK)
+		return loader_recover(ld);
+
+	if (s->op == LOADER_OP_READ) {
+		if (serial_read_deadline(stm->serial, data, s->len + LOADER_CRC, deadline) != SERIAL_ERR_OK ||
+		    crc32_stm32(0xFFFFFFFF, data, s->len) != loader_get_u32(data + s->len))
+			return loader_recover(ld);
+		memcpy(s->dest, data + s->skip, s->want);
+	} else
+		ld->acked = s->address + s->len;
+
+	ld->first = (ld->first + 1) % LOADER_WINDOW;
+	ld->count--;
+	ld->inflight -= s->size;
+	ld->retries = 0;
+	return 1;
+}
+
+/*
+	an answer went missing or came back wrong.  Ask with SYNC which
+	frame the loader expects: the WRITE frames before it are done, the
+	READ frames before it have to be asked again since their answers
+	were thrown away, and those and every frame after are numbered
+	afresh and sent again.
+*/
+char loader_recover(loader_t *ld) {
+	loader_slot_t *s, *d;
+	unsigned int i, k, n;
+	uint8_t expect;
+
+	ld->stats.resent++;
+	if (++ld->retries > LOADER_RETRY) {
+		ld->failed = 1;
+		fprintf(stderr, "Too many errors talking to the flash loader\n");
+		return 0;
+	}
+
+	ld->failed = 1;
+	if (!loader_ask(ld, LOADER_OP_SYNC, LOADER_STATE, &expect))
+		return 0;
+
+	k = (uint8_t)(expect - ld->slot[ld->first].seq);
+	if (k > ld->count) {
+		fprintf(stderr, "The flash loader is out of step, it expects frame %u\n", expect);
+		return 0;
+	}
+
+	/* keep the frames still to be answered, in order */
+	for(i = n = 0; i < ld->count; ++i) {
+		s = &ld->slot[(ld->first + i) % LOADER_WINDOW];
+		if (i < k && s->op != LOADER_OP_READ) {
+			ld->acked = s->address + s->len;
+			continue;
+		}
+		d = &ld->slot[(ld->first + n++) % LOADER_WINDOW];
+		if (d != s)
+			memcpy(d, s, sizeof(loader_slot_t));
+	}
+
+	ld->count	= 0;
+	ld->inflight	= 0;
+	ld->seq		= expect;
+	ld->failed	= 0;
+	for(i = 0; i < n; ++i)
+		if (!loader_post(ld, &ld->slot[(ld->first + i) % LOADER_WINDOW]))
+			return 0;
+	return 1;
+}
+
+/* address must be a multiple of 4 where it does not carry on from the last write */
+char loader_write(loader_t *ld, uint32_t address, const uint8_t data[], unsigned int len) {
+	unsigned int n;
+
+	while(len > 0) {
+		if (ld->wr_len > 0 && (address != ld->wr_address + ld->wr_len || ld->wr_len == LOADER_FRAME))
+			if (!loader_push(ld))
+				return 0;
+		if (ld->wr_len == 0) {
+			assert(address % 4 == 0);
+			ld->wr_address = address;
+		}
+
+		n = LOADER_FRAME - ld->wr_len;
+		if (n > len)
+			n = len;
+		memcpy(ld->wr_data + ld->wr_len, data, n);
+		ld->wr_len	+= n;
+		address		+= n;
+		data		+= n;
+		len		-= n;
+	}
+	return 1;
+}
+
+/* frames cover whole words, the bytes outside the range are dropped */
+char loader_read(loader_t *ld, uint32_t address, uint8_t data[], unsigned int len) {
+	loader_slot_t *s;
+	unsigned int skip, n;
+
+	if (!loader_push(ld))
+		return 0;
+
+	while(len > 0) {
+		skip	= address % 4;
+		n	= LOADER_FRAME - skip;
+		if (n > len)
+			n = len;
+
+		s = loader_slot(ld, LOADER_HEAD + LOADER_CRC);
+		if (!s)
+			return 0;
+		s->op		= LOADER_OP_READ;
+		s->address	= address - skip;
+		s->len		= (skip + n + 3) & ~3;
+		s->wire		= 0;
+		s->dest		= data;
+		s->skip		= skip;
+		s->want		= n;
+		if (!loader_post(ld, s))
+			return 0;
+
+		address	+= n;
+		data	+= n;
+		len	-= n;
+	}
+	return loader_flush(ld);
+}
+
+/* send what is collected and wait for every frame to be answered */
+char loader_flush(loader_t *ld) {
+	if (!loader_push(ld))
+		return 0;
+	while(ld->count > 0)
+		if (!loader_reply(ld))
+			return 0;
+	return 1;
+}
+
+uint32_t loader_acked(const loader_t *ld) {
+	return ld->acked;
+}
+
+const loader_stats_t* loader_get_stats(const loader_t *ld) {
+	return &ld->stats;
+}
+
+/*
+	hand the device back to the bootloader.  Writes not flushed are
+	dropped, so a failed write can be abandoned with this.  True when
+	everything sent was answered and the loader went back cleanly.
+*/
+char loader_close(loader_t *ld) {
+	const stm32_t *stm = ld->stm;
+	stm32_mailbox_t mb;
+	uint8_t seq;
+	char ok;
+
+	ok = !ld->failed && ld->wr_len == 0 && ld->count == 0;
+	if (ld->count > 0)
+		ld->failed = 1;
+
+	memset(&mb, 0, sizeof(mb));
+	if (!loader_ask(ld, LOADER_OP_QUIT, LOADER_ACK, &seq) ||
+	    !stm32_applet_finish(stm, &stm32_applet_loader, &mb, LOADER_START))
+		ok = 0;
+	else if (mb.status != APPLET_OK) {
+		fprintf(stderr, "The flash loader failed, status %u\n", mb.status);
+		ok = 0;
+	}
+
+	free(ld);
+	return ok;
+}
@@ -0,0 +1,58 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_LOADER
+#define _H_LOADER
+
+#include <stdint.h>
+#include "stm32.h"
+
+typedef struct loader loader_t;
+
+/*
+	flash reads and writes through the flash loader applet
+	(stm32/loader.c) instead of the bootloader commands: frames of up
+	to LOADER_FRAME bytes, several of them on the wire at once.  While
+	it is open the bootloader is not listening, loader_close() hands
+	the device back to it.
+
+	Writes go to erased flash and are collected into whole frames, so
+	they are only certain after loader_flush().  loader_acked() is the
+	end of the last write the loader has programmed and read back.
+	With compress each frame goes as an LZ4 block the loader expands,
+	when that is the shorter of the two.
+*/
+typedef struct {
+	unsigned long	frames;		/* WRITE and ZWRITE frames, not counting resends */
+	unsigned long	packed;		/* of them ZWRITE */
+	unsigned long	data;		/* bytes they write */
+	unsigned long	wire;		/* bytes they took on the wire */
+	unsigned long	resent;		/* recoveries */
+} loader_stats_t;
+
+loader_t* loader_open (const stm32_t *stm, char compress);
+char      loader_write(loader_t *ld, uint32_t address, const uint8_t data[], unsigned int len);
+char      loader_read (loader_t *ld, uint32_t address, uint8_t data[], unsigned int len);
+char      loader_flush(loader_t *ld);
+uint32_t  loader_acked(const loader_t *ld);
+const loader_stats_t* loader_get_stats(const loader_t *ld);
+char      loader_close(loader_t *ld);
+
+#endif
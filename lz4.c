@@ -0,0 +1,158 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+
+#include <string.h>
+
+#include "lz4.h"
+
+#define LZ4_MINMATCH		4
+#define LZ4_LASTLITERALS	5	/* the block ends in at least this many literals */
+#define LZ4_MFLIMIT		12	/* and no match starts closer to the end */
+#define LZ4_DISTANCE		65535
+#define LZ4_HASH_BITS		12
+
+static uint32_t lz4_read32(const uint8_t *p) {
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static unsigned int lz4_hash(uint32_t v) {
+	return (v * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+/* the bytes after a nibble of 15 */
+static uint8_t* lz4_put_length(uint8_t *op, unsigned int n) {
+	for(; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	return op;
+}
+
+static uint8_t* lz4_put_literals(uint8_t *op, const uint8_t *src, unsigned int n, unsigned int match) {
+	*op++ = (n < 15 ? n : 15) << 4 | (match < 15 ? match : 15);
+	if (n >= 15)
+		op = lz4_put_length(op, n - 15);
+	memcpy(op, src, n);
+	return op + n;
+}
+
+/* greedy, one candidate per hash: quick and good at the long runs images have */
+unsigned int lz4_compress(const uint8_t *src, unsigned int len, uint8_t *dst, unsigned int room) {
+	const uint8_t *ip	= src;
+	const uint8_t *anchor	= src;
+	const uint8_t *end	= src + len;
+	const uint8_t *ref, *mp, *mi;
+	uint8_t *op		= dst;
+	uint8_t *oend		= dst + room;
+	unsigned int table[1 << LZ4_HASH_BITS];
+	unsigned int h, lit, match;
+	uint32_t seq;
+
+	/* offsets plus one, 0 is no candidate */
+	memset(table, 0, sizeof(table));
+	while(len >= LZ4_MFLIMIT && ip <= end - LZ4_MFLIMIT) {
+		seq = lz4_read32(ip);
+		h = lz4_hash(seq);
+		ref = table[h] ? src + table[h] - 1 : NULL;
+		table[h] = ip - src + 1;
+		if (!ref || ip - ref > LZ4_DISTANCE || lz4_read32(ref) != seq) {
+			++ip;
+			continue;
+		}
+
+		mp = ref + LZ4_MINMATCH;
+		mi = ip  + LZ4_MINMATCH;
+		while(mi < end - LZ4_LASTLITERALS && *mi == *mp) {
+			++mi;
+			++mp;
+		}
+
+		/* token, lengths, literals and offset at their longest */
+		lit   = ip - anchor;
+		match = mi - ip - LZ4_MINMATCH;
+		if (oend - op < 1 + lit / 255 + 1 + lit + 2 + match / 255 + 1)
+			return 0;
+
+		op = lz4_put_literals(op, anchor, lit, match);
+		*op++ = (ip - ref) & 0xFF;
+		*op++ = (ip - ref) >> 8;
+		if (match >= 15)
+			op = lz4_put_length(op, match - 15);
+		ip = anchor = mi;
+	}
+
+	lit = end - anchor;
+	if (oend - op < 1 + lit / 255 + 1 + lit)
+		return 0;
+	op = lz4_put_literals(op, anchor, lit, 0);
+	return op - dst;
+}
+
+/* the length bytes after a nibble of 15, the offset past the end when they run off it */
+static unsigned int lz4_get_length(const uint8_t *src, unsigned int *in, unsigned int len) {
+	unsigned int n = 0;
+	uint8_t b;
+
+	do {
+		if (*in >= len) {
+			*in = len + 1;
+			return 0;
+		}
+		b = src[(*in)++];
+		n += b;
+	} while(b == 255);
+	return n;
+}
+
+/* the same checks as the loader applet makes (stm32/loader.c) */
+unsigned int lz4_decompress(const uint8_t *src, unsigned int len, uint8_t *dst, unsigned int raw) {
+	unsigned int in = 0, out = 0, n, offset;
+	uint8_t token;
+
+	while(in < len) {
+		token = src[in++];
+
+		n = token >> 4;
+		if (n == 15)
+			n += lz4_get_length(src, &in, len);
+		if (in > len || n > raw - out || n > len - in)
+			return 0;
+		memcpy(dst + out, src + in, n);
+		in  += n;
+		out += n;
+		if (out == raw)
+			break;
+
+		if (len - in < 2)
+			return 0;
+		offset = src[in] | src[in + 1] << 8;
+		in += 2;
+		n = token & 15;
+		if (n == 15)
+			n += lz4_get_length(src, &in, len);
+		n += LZ4_MINMATCH;
+		if (in > len || offset == 0 || offset > out || n > raw - out)
+			return 0;
+		/* byte by byte, the match may overlap what it copies */
+		for(; n; --n, ++out)
+			dst[out] = dst[out - offset];
+	}
+	return out == raw ? raw : 0;
+}
@@ -0,0 +1,41 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_LZ4
+#define _H_LZ4
+
+#include <stdint.h>
+
+/*
+	the LZ4 block format, no frame around it: sequences of a token
+	(literal count and match length - 4, a nibble each, 15 meaning
+	more bytes follow), the literals, a 16 bit little endian offset back
+	and the rest of the match length.  The last sequence is literals
+	only and covers at least the last 5 bytes.
+
+	lz4_compress() returns the block size, 0 when it does not fit in
+	room.  lz4_decompress() returns raw, 0 when the block does not come
+	out at exactly raw bytes; it stops at raw, so the block may be
+	padded.
+*/
+unsigned int lz4_compress  (const uint8_t *src, unsigned int len, uint8_t *dst, unsigned int room);
+unsigned int lz4_decompress(const uint8_t *src, unsigned int len, uint8_t *dst, unsigned int raw);
+
+#endif
@@ -65,17 +65,36 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#ifdef __linux__
+#define _GNU_SOURCE     // CPU affinity for the real time thread
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include <assert.h>
 #include <sys/time.h>
+#include <errno.h>
+#include <time.h>
+
+// SCHED_FIFO I/O thread, see -R
+#ifdef __linux__
+#define VEX_REALTIME
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
 
 #include "utils.h"
+#include "journal.h"
+#include "loader.h"
+#include "plan.h"
+#include "script.h"
 #include "serial.h"
 #include "stm32.h"
 #include "parser.h"
@@ -83,8 +102,91 @@
 #include "parsers/binary.h"
 #include "parsers/hex.h"
 
+/* automatic baud rate search, fastest first */
+#define BAUD_AUTO_PROBES    64          // GET and GID exchanges per rate
+#define BAUD_AUTO_MAX_ERROR 5           // percent of probes allowed to fail
+#define BAUD_AUTO_SETTLE    50000       // uS
+
+unsigned int    baud_candidates[] = { 921600, 460800, 230400, 115200, 57600, 0 };
+
+/* resume journal, kept as image name plus suffix, rewritten every so many frames */
+#define JOURNAL_SUFFIX      ".resume"
+#define JOURNAL_FRAMES      32
+
+/* bytes read per step through the flash loader, a window of its frames */
+#define LOADER_CHUNK        32768
+
+/* bounds for -n, frame retries and the first backoff in uS */
+#define RETRY_MAX           100
+#define RETRY_BACKOFF_MAX   500000
+
+/* reply deadline for the VEX system status request, uS */
+#define VEX_STATUS_TIMEOUT  500000
+
+/* bootloader sync probes, uS */
+#define VEX_SYNC_TRIES      5
+#define VEX_SYNC_POLL       1000        // look for bytes already queued
+#define VEX_SYNC_WAIT       50000       // for the first byte of a reply
+#define VEX_SYNC_QUIET      3000        // gap that ends a reply
+#define VEX_SYNC_LISTEN     20000       // then stop listening to a chatty line
+
+typedef enum {
+    LINE_SILENT,                        // nothing came back
+    LINE_BOOT_ACK,                      // bootloader took the 0x7F, autobaud done
+    LINE_BOOT_NACK,                     // bootloader synced before, refuses another
+    LINE_MASTER,                        // VEX master reply, AA 55 ...
+    LINE_USER                           // user program output
+    } line_state_t;
+
+const char      *line_state_str[] = {
+    "silent", "bootloader ACK", "bootloader NACK", "VEX master", "user program"
+    };
+
+/* after the handshake the bootloader is given this many probes to come up */
+#define VEX_SYNC_BOOT_TRIES 10
+
+/* where the handshake time went, each phase runs from the end of the last */
+#define VEX_PHASES_MAX      8
+
+typedef struct {
+    const char      *name;
+    uint64_t        us;
+    } vex_phase_t;
+
+vex_phase_t     vex_phases[VEX_PHASES_MAX];
+int             vex_phase_count;
+uint64_t        vex_phase_base;
+
+/* timed handshake steps, each keeps how late its wakeups were */
+#define VEX_STEPS_MAX       16
+
+typedef struct {
+    const char      *name;
+    unsigned int    us;             // asked for
+    unsigned int    count;
+    uint64_t        late_total;     // uS
+    uint64_t        late_worst;     // uS
+    } vex_step_t;
+
+vex_step_t      vex_steps[VEX_STEPS_MAX];
+uint64_t        vex_step_base;
+
+/* a write step of a -s script, its image is loaded before connecting */
+typedef struct {
+    parser_t        *parser;
+    void            *p_st;
+    uint8_t         *image;
+    unsigned int    size;
+    uint32_t        base;
+    const parser_seg_t *segs;
+    unsigned int    nsegs;
+    parser_seg_t    whole;
+    char            written;
+    } batch_write_t;
+
 /* device globals */
 serial_t        *serial         = NULL;
+const serial_profile_t *adapter = NULL;
 stm32_t         *stm            = NULL;
 
 void            *p_st           = NULL;
@@ -92,24 +194,59 @@ parser_t        *parser         = NULL;
 
 /* settings */
 char            *device         = NULL;
-serial_baud_t   baudRate        = SERIAL_BAUD_115200;
+unsigned int    baudRate        = 115200;
+char            baud_auto       = 0;
+char            reset_lines     = 0;    // --reset-lines, DTR resets and RTS selects the bootloader
 int             rd              = 0;
 int             wr              = 0;
 int             wu              = 0;
-int             npages          = 0xFF;
+unsigned int    npages          = 0;    // 0 erases the pages the image covers
+char            mass_erase      = 0;
+char            sparse          = 1;    // skip 0xFF blocks on freshly erased pages
+uint32_t        erased_end      = 0;    // flash from fl_start up to here reads 0xFF
 char            verify          = 0;
+char            crc_verify      = 0;    // -v compares page CRCs, not every frame
 int             retry           = 10;
+uint32_t        retry_backoff   = 10000;    // uS quiet time before a resync, doubles per retry
 char            exec_flag       = 0;
 uint32_t        execute         = 0;
 char            init_flag       = 1;
 char            force_binary    = 0;
 char            reset_flag      = 1;
 char            *filename;
+uint32_t        start_addr      = 0;    // -S, 0 is the start of flash
+uint32_t        start_len       = 0;    // -S, 0 is up to the end of flash
+char            trim            = 0;    // reads stop after the last used page
+char            *script_file    = NULL; // -s, run the operations listed here
+script_t        script;
+batch_write_t   *batch          = NULL; // one per script step
+char            resume          = 0;
+char            diff            = 0;    // only write the pages whose CRC differs
+parser_seg_t    *diff_segs      = NULL; // the image segments on those pages
+char            use_loader      = 0;    // --loader, stream through the RAM applet
+char            compress        = 0;    // --compress, the loader gets LZ4 blocks
+loader_t        *loader         = NULL; // open for the read or write under way
+loader_stats_t  loader_stats;           // summed over the loader sessions
+char            journal[FILENAME_MAX];
+journal_t       journal_info;
 
 int             vex_user_program = 1;  // now default to yes
 char            quietmode        = 0;
+char            verbose          = 0;
+char            conservative     = 0;   // fixed handshake delays, not readiness
+int             rt_priority      = 0;   // SCHED_FIFO priority, 0 is off
+int             rt_cpu           = -1;  // CPU for the I/O thread, -1 is any
 
 /* functions */
+int     run_session( void );
+int     rt_run( void );
+int     vex_connect( void );
+int     baud_negotiate( void );
+int     baud_reset( stm32_t *part );
+int     line_listen( uint8_t *buf, int size, uint64_t first, uint64_t deadline );
+line_state_t line_classify( const uint8_t *buf, int len );
+line_state_t line_probe( int attempt );
+int     line_sync( int tries, int patient );
 int     vex_detect_mode( void );
 int     vex_initialize( void );
 
@@ -118,9 +255,41 @@ int     vex_reset_slave_cmd( void );
 int     vex_enter_user_program_cmd( void );
 int     vex_enter_user_program_rts( void );
 
+void    vex_step_start( void );
+void    vex_step( const char *name, unsigned int us );
+void    vex_delay( const char *name, unsigned int us );
+void    vex_wait( const char *name, unsigned int us );
+void    vex_phase( const char *name );
+void    vex_phase_report( void );
+void    vex_step_report( void );
+void    print_commands( void );
+
+int     flash_range( uint32_t want, uint32_t want_len, uint32_t *addr, uint32_t *len );
+uint32_t used_end( uint32_t addr, uint32_t end );
 int     read_flash( void );
+void    loader_begin( void );
+int     loader_end( void );
+int     read_range( parser_t *out, void *st, uint32_t start, uint32_t end );
 int     write_unprotect_flash( void );
+uint8_t *read_image( unsigned int size );
+unsigned int resume_point( const uint8_t *image, unsigned int size );
+void    checkpoint( uint32_t done );
+int     erase_flash( unsigned int spage, unsigned int size );
+int     diff_flash( const uint8_t *image, uint32_t base, unsigned int size,
+                    const parser_seg_t **segs, unsigned int *nsegs );
+void    page_image( uint8_t *buffer, const uint8_t *image, unsigned int size, unsigned int page );
+int     page_compare( const uint8_t *image, uint32_t base, unsigned int size, unsigned int page );
+int     crc_check( const uint8_t *image, uint32_t base, unsigned int size, unsigned int from );
+int     block_erased( const uint8_t *buffer, uint32_t addr, unsigned int len );
 int     write_flash( void );
+parser_err_t script_open( void );
+int     run_script( void );
+int     script_erase_writes( void );
+int     script_verify( unsigned int upto );
+int     script_read( const script_step_t *step );
+int     script_erase( const script_step_t *step );
+int     write_image( const uint8_t *image, uint32_t base, unsigned int size,
+                     const parser_seg_t *segs, unsigned int nsegs, uint32_t resumed );
 void    cleanup( void );
 parser_err_t    open_parser(void);
 
@@ -132,7 +301,6 @@ void show_help(char *name);
 
 int main(int argc, char* argv[])
 {
-        int ret = 1;
         parser_err_t perr;
         
         if (parse_options(argc, argv) != 0)
@@ -144,12 +312,32 @@ int main(int argc, char* argv[])
             printf("Working directory %s\n\n", getcwd(NULL, 0));
             }    
 
-        // Open file parser
-        perr = open_parser();
+        // Open file parser, a script opens one for each file it writes
+        if( script_file )
+            perr = script_open();
+        else
+            perr = open_parser();
 
         if( perr != PARSER_ERR_OK )
             return(perr);
 
+        // everything that touches the port can run on its own real time thread
+        if( rt_priority )
+            return( rt_run() );
+
+        return( run_session() );
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Connect, transfer and clean up, on whichever thread does the I/O         */
+/*---------------------------------------------------------------------------*/
+
+int
+run_session()
+{
+        int ret = 1;
+        int status;
+
         // Open serial device            
         serial = serial_open(device);
         if (!serial) {
@@ -158,52 +346,43 @@ int main(int argc, char* argv[])
             return(-1);
             }
 
-        // Setup serial port for bootloader
-        if (serial_setup( serial, baudRate, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK) {
-            perror(device);
-            cleanup();
-            return(-1);
-            }
+        // USB adapters differ in buffering and in how they drop bytes
+        {
+        uint16_t vid, pid;
 
-		// user may have pressed program button so test if we are
-        // already in boot load mode waiting for INIT or if we already
-        // have sent auto baud
-        if( vex_detect_mode() ) {
-	        if( vex_initialize() != 1 ) {
-                cleanup();
-                return(-1);
-                }
-            }
-            
-        // We may have change parity if not in bootloader mode
-        // Setup serial port for bootloader
-        if (serial_setup( serial, baudRate, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK) {
-            perror(device);
-            cleanup();
-            return(-1);
+        adapter = serial_get_profile( serial, &vid, &pid );
+        if(verbose) {
+            if( vid )
+                printf("Adapter      : %s (%04x:%04x)\n", adapter->name, vid, pid);
+            else
+                printf("Adapter      : %s\n", adapter->name);
+            if( adapter->latency_timer )
+                printf("               latency timer %u ms\n", adapter->latency_timer);
             }
+        }
 
-        // 1/10 sec delay before comms start
-        usleep(100000);
-
-        // RTS needs to be low for user program to be reset - no idea why
-        // May need to do something with the DTR line for the USB, not sure yet
-        //
-        serial_set_rts( serial, 0 );
+        // Generic STM32 parts can go faster than the cortex, so look for
+        // the fastest rate the adapter and cable manage
+        if( baud_auto )
+            status = baud_negotiate();
+        else
+            status = vex_connect();
 
-        // 1/10 sec delay before comms start
-        usleep(100000);
-                
-        // Init the STM32 communicationst
-        // we may already be in bootload mode
-        if (!(stm = stm32_init(serial, init_flag))) {
+        if( status < 0 ) {
             cleanup();
             return(-1);
             }
 
+        // connected, from here a bad frame is resent rather than fatal
+        stm32_set_retry( stm, retry, retry_backoff );
+
+        if( verbose || rt_priority )
+            vex_step_report();
+
         if(!quietmode) {
             // Print some info about the cortex
             printf("Version      : 0x%02x\n", stm->bl_version);
+            print_commands();
             printf("Option 1     : 0x%02x\n", stm->option1);
             printf("Option 2     : 0x%02x\n", stm->option2);
             printf("Device ID    : 0x%04x (%s)\n", stm->pid, stm->dev->name);
@@ -212,9 +391,19 @@ int main(int argc, char* argv[])
             printf("Option RAM   : %db\n", stm->dev->opt_end - stm->dev->opt_start);
             printf("System RAM   : %dKiB\n", (stm->dev->mem_end - stm->dev->mem_start) / 1024);
             }
+
+        // bootloader turnaround measured over the GET, GV and GID exchanges
+        if(verbose)
+            printf("Round trip   : %u us\n", stm32_get_turnaround( stm, STM32_OP_GET ));
             
-        // Read flash if necessary
-        if( rd ) {
+        // Run the script, or read flash if necessary
+        if( script_file ) {
+            if( run_script() < 0 ) {
+                cleanup();
+                return(-1);
+                }
+            }
+        else if( rd ) {
             if( read_flash() < 0 ) {
                 cleanup();
                 return(-1);
@@ -259,6 +448,347 @@ int main(int argc, char* argv[])
         return ret;
 }
 
+/*---------------------------------------------------------------------------*/
+/*  Bring the cortex into the bootloader and open the STM32 session          */
+/*---------------------------------------------------------------------------*/
+
+int
+vex_connect()
+{
+    int     booted = 0;
+
+    vex_phase_count = 0;
+    vex_phase_base  = serial_time_us();
+
+    // Setup serial port for bootloader
+    if (serial_setup( serial, baudRate, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK) {
+        perror(device);
+        return(-1);
+        }
+
+    // user may have pressed program button so test if we are
+    // already in boot load mode waiting for INIT or if we already
+    // have sent auto baud
+    booted = vex_detect_mode();
+    vex_phase( "detect" );
+    if( booted ) {
+        if( vex_initialize() != 1 )
+            return(-1);
+        }
+
+    // We may have change parity if not in bootloader mode
+    // Setup serial port for bootloader
+    if (serial_setup( serial, baudRate, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK) {
+        perror(device);
+        return(-1);
+        }
+
+    if(!quietmode) {
+        printf("Serial setup : %s\n", serial_get_setup_str( serial ));
+        if( serial_get_speed( serial ) != baudRate )
+            printf("               (%u requested, adapter chose the nearest rate)\n", baudRate);
+        }
+
+    // let the adapter settle before comms start
+    vex_wait( "connect settle", adapter->settle );
+
+    // RTS needs to be low for user program to be reset - no idea why
+    // May need to do something with the DTR line for the USB, not sure yet
+    //
+    serial_set_rts( serial, 0 );
+
+    // let the adapter settle before comms start
+    vex_wait( "rts low settle", adapter->settle );
+
+    // Init the STM32 communicationst
+    // we may already be in bootload mode, if the probes get no
+    // answer stm32_init still sends its own INIT.  Whatever the user
+    // program said before the bootloader started is of no interest
+    if( init_flag ) {
+        serial_flush( serial );
+        if( line_sync( conservative ? VEX_SYNC_TRIES : VEX_SYNC_BOOT_TRIES, booted ) )
+            init_flag = 0;
+        vex_phase( "sync" );
+        }
+
+    if (!(stm = stm32_init(serial, init_flag)))
+        return(-1);
+    vex_phase( "init" );
+
+    if(!quietmode)
+        vex_phase_report();
+
+    return(1);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Reset the part back into its bootloader, so it autobauds again.  With    */
+/*  a session the RAM reset program does it, which a read protected part     */
+/*  refuses, with --reset-lines the DTR and RTS lines do.                    */
+/*  @returns 1 when the part was reset, 0 when there was no way to           */
+/*---------------------------------------------------------------------------*/
+
+int
+baud_reset( stm32_t *part )
+{
+    if( part && stm32_reset_device( part ) )
+        return(1);
+
+    if( !reset_lines )
+        return(0);
+
+    // BOOT0 up, NRST pulsed, BOOT0 down once the ROM has started
+    if( serial_set_rts( serial, 1 ) != SERIAL_ERR_OK || serial_set_dtr( serial, 1 ) != SERIAL_ERR_OK )
+        return(0);
+    usleep(BAUD_AUTO_SETTLE);
+    if( serial_set_dtr( serial, 0 ) != SERIAL_ERR_OK )
+        return(0);
+    usleep(BAUD_AUTO_SETTLE);
+    serial_set_rts( serial, 0 );
+    serial_flush( serial );
+    return(1);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Find the fastest rate a generic STM32 bootloader runs at reliably.       */
+/*  The ROM bootloader only autobauds once after reset, so a rate that       */
+/*  fails is followed by a reset.  A rate that never synced may not have     */
+/*  set the autobaud at all, so the search goes on without one; one that     */
+/*  synced and then failed has, and without a reset the search stops.        */
+/*  The test only asks GET and GID, which a read protected part still        */
+/*  answers.                                                                 */
+/*---------------------------------------------------------------------------*/
+
+int
+baud_negotiate()
+{
+    const serial_stats_t *stats;
+    struct timeval  t0, t1;
+    double          secs;
+    unsigned long   bytes;
+    unsigned int    rate;
+    int             i, probe, errors;
+
+    for(i=0; baud_candidates[i] != 0; i++)
+        {
+        rate = baud_candidates[i];
+
+        if (serial_setup( serial, rate, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK)
+            {
+            if(!quietmode)
+                printf("Baud %7u : not supported by the adapter\n", rate);
+            continue;
+            }
+        serial_flush( serial );
+
+        if( !(stm = stm32_init(serial, 1)) )
+            {
+            // the INIT may have set the autobaud even though its ACK was
+            // lost, then a session is still there to reset it with
+            usleep(BAUD_AUTO_SETTLE);
+            serial_flush( serial );
+            stm = stm32_init(serial, 0);
+            }
+
+        if( !stm )
+            {
+            if(!quietmode)
+                printf("Baud %7u : no sync%s\n", rate, baud_reset( NULL ) ? ", reset" : "");
+            usleep(BAUD_AUTO_SETTLE);
+            continue;
+            }
+
+        // ask the same questions over and over, a failed exchange or
+        // a different answer counts as an error
+        errors = 0;
+        stats  = serial_get_stats( serial );
+        bytes  = stats->tx_bytes + stats->rx_bytes;
+        gettimeofday( &t0, NULL );
+        for(probe=0;probe<BAUD_AUTO_PROBES;probe++)
+            {
+            if( !stm32_probe( stm ) )
+                {
+                errors++;
+                // let any tail of the bad reply arrive, then drop it
+                usleep(BAUD_AUTO_SETTLE);
+                serial_flush( serial );
+                }
+            }
+        gettimeofday( &t1, NULL );
+        secs  = (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1000000.0;
+        stats = serial_get_stats( serial );
+        bytes = stats->tx_bytes + stats->rx_bytes - bytes;
+
+        if(!quietmode)
+            printf("Baud %7u : %5.0f bytes/sec, %d errors in %d probes\n", rate, bytes / secs, errors, BAUD_AUTO_PROBES);
+
+        if( errors * 100 <= BAUD_AUTO_MAX_ERROR * BAUD_AUTO_PROBES )
+            {
+            baudRate = rate;
+            if(!quietmode)
+                printf("Serial setup : %s\n", serial_get_setup_str( serial ));
+            return(1);
+            }
+
+        // reset so the bootloader autobauds again at the next rate
+        if( baud_candidates[i + 1] != 0 && !baud_reset( stm ) )
+            {
+            fprintf(stderr, "Baud %7u : too many errors, and the part can't be reset to try a lower rate\n", rate);
+            fprintf(stderr, "Power cycle the part into the bootloader and give a lower rate with -b,\n"
+                            "or use --reset-lines when DTR and RTS are wired to NRST and BOOT0\n");
+            stm32_close( stm );
+            stm = NULL;
+            return(-1);
+            }
+        stm32_close( stm );
+        stm = NULL;
+        usleep(BAUD_AUTO_SETTLE);
+        }
+
+    fprintf(stderr, "No usable baud rate found\n");
+    if( !reset_lines )
+        fprintf(stderr, "A part that locked on to a rate it couldn't sync at needs a power cycle,\n"
+                        "or --reset-lines when DTR and RTS are wired to NRST and BOOT0\n");
+    return(-1);
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Read what is on the line until it goes quiet for VEX_SYNC_QUIET, buf     */
+/*  is full or the deadline passes.  Nothing by first is silence, anything   */
+/*  left unread is dropped by the next flush.                                */
+/*  @returns bytes read into buf                                             */
+/*---------------------------------------------------------------------------*/
+
+int
+line_listen( uint8_t *buf, int size, uint64_t first, uint64_t deadline )
+{
+    int         have;
+    int         r;
+
+    have = serial_read_avail( serial, buf, size, first );
+    if( have <= 0 )
+        return( 0 );
+
+    // a full buffer is already more than the bootloader ever says
+    while( have < size && serial_time_us() < deadline )
+        {
+        r = serial_read_avail( serial, buf + have, size - have, serial_time_us() + VEX_SYNC_QUIET );
+        if( r <= 0 )
+            break;
+        have += r;
+        }
+
+    return( have );
+}
+
+/*---------------------------------------------------------------------------*/
+/*  What is talking, from the bytes that came back                           */
+/*---------------------------------------------------------------------------*/
+
+line_state_t
+line_classify( const uint8_t *buf, int len )
+{
+    if( len == 0 )
+        return( LINE_SILENT );
+
+    // the bootloader answers 0x7F with exactly one byte
+    if( len == 1 && buf[0] == 0x79 )
+        return( LINE_BOOT_ACK );
+    if( len == 1 && buf[0] == 0x1F )
+        return( LINE_BOOT_NACK );
+
+    // replies from the VEX master all start AA 55
+    if( len >= 2 && buf[0] == 0xAA && buf[1] == 0x55 )
+        return( LINE_MASTER );
+
+    // anything else is the user program, at 8N1 even parity mangles it
+    return( LINE_USER );
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Send the autobaud 0x7F and see what answers, the line is drained and     */
+/*  classified first so a talking user program is spotted without waiting    */
+/*  for a reply                                                              */
+/*---------------------------------------------------------------------------*/
+
+line_state_t
+line_probe( int attempt )
+{
+    uint8_t         sync = 0x7F;
+    uint8_t         buf[16];
+    int             len;
+    uint64_t        start = serial_time_us();
+    line_state_t    state;
+
+    // anything already queued was sent before we asked
+    len   = line_listen( buf, sizeof(buf), start + VEX_SYNC_POLL, start + VEX_SYNC_LISTEN );
+    state = line_classify( buf, len );
+
+    if( state == LINE_SILENT )
+        {
+        start = serial_time_us();
+        if( serial_write( serial, &sync, 1 ) != SERIAL_ERR_OK )
+            return( LINE_SILENT );
+
+        len   = line_listen( buf, sizeof(buf), start + VEX_SYNC_WAIT, start + VEX_SYNC_LISTEN );
+        state = line_classify( buf, len );
+        }
+
+    if(!quietmode)
+        printf("Line probe %d : %s after %u us\n", attempt, line_state_str[state], (unsigned int)(serial_time_us() - start));
+
+    return( state );
+}
+
+/*---------------------------------------------------------------------------*/
+/*  Probe until the line says whether the bootloader is there, patient       */
+/*  keeps probing through user program output while the bootloader starts    */
+/*  @returns 1 synced with the bootloader, 0 not there or not answering      */
+/*---------------------------------------------------------------------------*/
+
+int
+line_sync( int tries, int patient )
+{
+    uint8_t         get[2] = {0x00, 0xFF};
+    uint8_t         rep[15];
+    line_state_t    state;
+    int             attempt;
+
+    for(attempt=1; attempt<=tries; attempt++)
+        {
+        state = line_probe( attempt );
+
+        switch( state )
+            {
+            case LINE_BOOT_ACK:
+                // autobaud done just now
+                return(1);
+
+            case LINE_BOOT_NACK:
+                // synced before, GET confirms it is really the bootloader
+                if( serial_write( serial, get, 2 ) == SERIAL_ERR_OK &&
+                    serial_read_deadline( serial, rep, sizeof(rep), serial_time_us() + VEX_STATUS_TIMEOUT ) == SERIAL_ERR_OK &&
+                    rep[0] == 0x79 )
+                    return(1);
+                break;
+
+            case LINE_MASTER:
+            case LINE_USER:
+                // the cortex is running, no point asking again, unless
+                // it has been told to start the bootloader
+                if( !patient )
+                    return(0);
+                break;
+
+            case LINE_SILENT:
+                // the first byte can go missing, PL2303 among others
+                break;
+            }
+        }
+
+    return(0);
+}
+
 /*---------------------------------------------------------------------------*/
 /*  Try and detect the cortex in flash load mode, either waiting for the     */
 /*  initial autobaud sequence or waiting for bootload commands               */
@@ -268,13 +798,6 @@ int main(int argc, char* argv[])
 int
 vex_detect_mode()
 {
-    char buf[2]  = {0x7F};
-    char rep[16] = {0x00};
-    int  retry;
-    
-	// sleep a while
-    usleep(100000);
-    
     if( serial )
         {
         // Setup serial port for bootloader
@@ -286,39 +809,14 @@ vex_detect_mode()
             }
 
 		// sleep a while
-    	usleep(100000);
-        
-        // Try sending auto baud a few times and see what we get
-        for(retry=0;retry<5;retry++)
-            {
-            serial_write( serial, buf, 1 );
-            if( serial_read( serial, rep, 1) == SERIAL_ERR_OK )
-                {
-                // Lets ssee what we got
-                if( rep[0] == 0x79 )
-                    {
-                    // we are done, user must have pushed prog button
-                    init_flag = 0;
-                    return( init_flag );
-                    }
-                else
-                if( rep[0] == 0x1F )
-                    {
-                    // we are also done, see if we can get status
-                    buf[0] = 0x00;
-                    buf[1] = 0xFF;
-                    serial_write( serial, buf, 2 );
-                    // check status is good
-                    if( (serial_read( serial, rep, 15) == SERIAL_ERR_OK) && rep[0] == 0x79 )
-                        init_flag = 0;
-                    // OK, we are already in bootload mode for some reason                    
-                    return( init_flag );
-                    }
-                }
-            }
+    	vex_wait( "detect settle", adapter->settle );
+
+        // user may have pushed the prog button, or a previous run
+        // left the bootloader synced
+        if( line_sync( VEX_SYNC_TRIES, 0 ) )
+            init_flag = 0;
         }
         
-    // no luck if we are here, not in bootloader mode.
     return( init_flag );
 }
 
@@ -332,7 +830,7 @@ vex_initialize()
     char    zero[4] = {0x00, 0x00, 0x00, 0x00};
 
 	// sleep a while
-    usleep(100000);
+    vex_wait( "init wait", 100000 );
     
     if(serial)
         {        
@@ -345,18 +843,20 @@ vex_initialize()
             }
         
         //sleep a while
-        usleep(100000);
+        vex_wait( "init settle", adapter->settle );
         
         // send some zeros, there are bugs in serial driver
-        serial_write( serial, zero, 4 );
+        if( adapter->dummy_byte ) {
+            serial_write( serial, zero, 4 );
 
-        //sleep a while
-        usleep(100000);
+            //sleep a while
+            vex_wait( "dummy settle", adapter->settle );
+            }
 
         // Check system status
         if( !vex_sys_status_cmd() ) {      
             // sleep a while
-            usleep(100000);
+            vex_wait( "status retry", 100000 );
             
             // Try again
             if( !vex_sys_status_cmd() ) {
@@ -364,6 +864,7 @@ vex_initialize()
                 return(-1);
                 }
             }
+        vex_phase( "status" );
             
         // Put cortex into boot load mode
         if(vex_user_program == 2)
@@ -371,6 +872,7 @@ vex_initialize()
         else
         if(vex_user_program != 0)
             vex_enter_user_program_cmd();
+        vex_phase( "enter bootloader" );
         return(1);
         }
     return(0);
@@ -396,8 +898,9 @@ vex_sys_status_cmd()
 		
 		// try and get status
         if( serial_write( serial, buf, 5 ) == SERIAL_ERR_OK ) {
-            // read reply - should be 14 bytes
-            if( serial_read( serial, rep, 14 ) == SERIAL_ERR_OK ) {
+            // read reply - should be 14 bytes, returns as soon as the
+            // whole packet is in
+            if( serial_read_deadline( serial, rep, 14, serial_time_us() + VEX_STATUS_TIMEOUT ) == SERIAL_ERR_OK ) {
                 if(!quietmode) {
                     int i;
                     
@@ -470,7 +973,7 @@ vex_enter_user_program_cmd()
         serial_write( serial, buf, 5 );
         serial_write( serial, buf, 5 );
     
-        usleep(250000);
+        vex_wait( "enter user program", 250000 );
         }
 
     return(1);
@@ -496,7 +999,7 @@ vex_reset_slave_cmd()
         serial_write( serial, buf, 5 );
         serial_write( serial, buf, 5 );
     
-        usleep(250000);
+        vex_wait( "reset slave", 250000 );
         }
 
     return(1);
@@ -513,7 +1016,7 @@ vex_enter_user_program_rts()
          
 	if(serial)
 	    {
-    	if (serial_setup( serial, SERIAL_BAUD_9600,	SERIAL_BITS_8, SERIAL_PARITY_NONE, SERIAL_STOPBIT_1	) != SERIAL_ERR_OK)
+    	if (serial_setup( serial, 9600,	SERIAL_BITS_8, SERIAL_PARITY_NONE, SERIAL_STOPBIT_1	) != SERIAL_ERR_OK)
 	    	{
 		    perror(device);
 		    return(0);
@@ -523,31 +1026,216 @@ vex_enter_user_program_rts()
             printf("Send bootloader start command (RTS)\n");
 
         // send 1 char as driver has a bug
-        buf[0] = 0x00;
-        serial_write( serial, buf, 1 );
+        if( adapter->dummy_byte ) {
+            buf[0] = 0x00;
+            serial_write( serial, buf, 1 );
+            }
     
+        // the pulse widths are timed from each other, not from when
+        // each set_rts returned, so late wakeups don't add up
         serial_set_rts( serial, 1 );
-        usleep(5000);
+        vex_step_start();
+        vex_step( "rts pulse 1 high", 5000 );
     
         serial_set_rts( serial, 0 );
-        usleep(15000);
+        vex_step( "rts pulse 2 low", 15000 );
 
         serial_set_rts( serial, 1 );
-        usleep(10000);
+        vex_step( "rts pulse 3 high", 10000 );
         // tx
         buf[0] = 0xF0;
         serial_write( serial, buf, 1 );
     
-        usleep(20000);
+        vex_step( "rts tx hold", 20000 );
     
         serial_set_rts( serial, 0 );
 
-        usleep(250000);
+        vex_wait( "rts release", 250000 );
         }
 
     return(1);
 }
 
+/*-----------------------------------------------------------------------------*/
+/*  Handshake timing.  Steps sleep to an absolute time on the monotonic clock  */
+/*  so a late wakeup shortens the next step instead of pushing the rest out,   */
+/*  and every step keeps how late it woke up for the jitter report.            */
+/*-----------------------------------------------------------------------------*/
+
+void
+vex_step_start()
+{
+    vex_step_base = serial_time_us();
+}
+
+void
+vex_step( const char *name, unsigned int us )
+{
+    uint64_t    target = vex_step_base + us;
+    uint64_t    now, late;
+    vex_step_t  *step;
+#ifdef __linux__
+    struct timespec ts;
+
+    ts.tv_sec  = target / 1000000;
+    ts.tv_nsec = (target % 1000000) * 1000;
+    while( clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR )
+        ;
+#else
+    now = serial_time_us();
+    if( now < target )
+        usleep( target - now );
+#endif
+
+    now  = serial_time_us();
+    late = now > target ? now - target : 0;
+    vex_step_base = target;
+
+    // find the record for this step, or the first free one
+    for( step = vex_steps; step < vex_steps + VEX_STEPS_MAX; step++ )
+        if( !step->name || (step->name == name && step->us == us) )
+            break;
+    if( step == vex_steps + VEX_STEPS_MAX )
+        return;
+
+    step->name        = name;
+    step->us          = us;
+    step->count      += 1;
+    step->late_total += late;
+    if( late > step->late_worst )
+        step->late_worst = late;
+}
+
+void
+vex_delay( const char *name, unsigned int us )
+{
+    vex_step_start();
+    vex_step( name, us );
+}
+
+/*---------------------------------------------------------------------------*/
+/*  A handshake wait.  The fixed delay with --conservative, otherwise only   */
+/*  until what was written has left the host, with the delay as the bound.  */
+/*  Whatever the far end does next is picked up by the read that follows.    */
+/*---------------------------------------------------------------------------*/
+
+void
+vex_wait( const char *name, unsigned int us )
+{
+    if( conservative )
+        vex_delay( name, us );
+    else
+        serial_drain( serial, serial_time_us() + us );
+}
+
+/*---------------------------------------------------------------------------*/
+/*  End the handshake phase running since the last mark                      */
+/*---------------------------------------------------------------------------*/
+
+void
+vex_phase( const char *name )
+{
+    uint64_t    now = serial_time_us();
+
+    if( vex_phase_count < VEX_PHASES_MAX ) {
+        vex_phases[vex_phase_count].name = name;
+        vex_phases[vex_phase_count].us   = now - vex_phase_base;
+        vex_phase_count++;
+        }
+    vex_phase_base = now;
+}
+
+void
+vex_phase_report()
+{
+    uint64_t    total = 0;
+    int         i;
+
+    for( i = 0; i < vex_phase_count; i++ )
+        total += vex_phases[i].us;
+
+    printf("Handshake    : %.1f ms%s", total / 1000.0, conservative ? " (conservative)" : "");
+    for( i = 0; i < vex_phase_count; i++ )
+        printf(", %s %.1f", vex_phases[i].name, vex_phases[i].us / 1000.0);
+    printf("\n");
+}
+
+void
+vex_step_report()
+{
+    vex_step_t  *step;
+
+    for( step = vex_steps; step < vex_steps + VEX_STEPS_MAX && step->name; step++ )
+        printf("%s %-18s %6u us x%u, late avg %4lu max %4lu us\n",
+                step == vex_steps ? "Step timing  :" : "              ",
+                step->name, step->us, step->count,
+                (unsigned long)(step->late_total / step->count),
+                (unsigned long)step->late_worst );
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Run the session on a SCHED_FIFO thread, optionally pinned to one CPU.      */
+/*  Falls back to the calling thread if the scheduler says no.                 */
+/*-----------------------------------------------------------------------------*/
+
+#ifdef VEX_REALTIME
+void *
+rt_session( void *arg )
+{
+    struct sched_param  param;
+    int                 policy;
+
+    // report what the thread actually got, from the thread itself
+    if( !quietmode && pthread_getschedparam( pthread_self(), &policy, &param ) == 0 )
+        printf("I/O thread   : %s priority %d%s\n", policy == SCHED_FIFO ? "SCHED_FIFO" : "other",
+                param.sched_priority, rt_cpu >= 0 ? ", pinned" : "");
+
+    *(int *)arg = run_session();
+    return( NULL );
+}
+#endif
+
+int
+rt_run()
+{
+#ifdef VEX_REALTIME
+    pthread_attr_t      attr;
+    struct sched_param  param;
+    pthread_t           thread;
+    cpu_set_t           cpus;
+    int                 ret = -1;
+    int                 err;
+
+    // page faults in the timed steps are jitter too
+    mlockall( MCL_CURRENT );
+
+    pthread_attr_init( &attr );
+    pthread_attr_setinheritsched( &attr, PTHREAD_EXPLICIT_SCHED );
+    pthread_attr_setschedpolicy( &attr, SCHED_FIFO );
+    param.sched_priority = rt_priority;
+    pthread_attr_setschedparam( &attr, &param );
+
+    if( rt_cpu >= 0 ) {
+        CPU_ZERO( &cpus );
+        CPU_SET( rt_cpu, &cpus );
+        pthread_attr_setaffinity_np( &attr, sizeof(cpus), &cpus );
+        }
+
+    err = pthread_create( &thread, &attr, rt_session, &ret );
+    pthread_attr_destroy( &attr );
+
+    if( err == 0 ) {
+        pthread_join( thread, NULL );
+        return( ret );
+        }
+
+    fprintf(stderr, "Real time I/O thread not available (%s), continuing without\n", strerror(err));
+#else
+    fprintf(stderr, "Real time I/O thread not supported on this platform, continuing without\n");
+#endif
+    return( run_session() );
+}
+
 /*-----------------------------------------------------------------------------*/
 /*    Simple progress display that plays well with eclipse                     */
 /*-----------------------------------------------------------------------------*/
@@ -582,6 +1270,24 @@ show_progress( int done, int size )
     }
 }
 
+/*-----------------------------------------------------------------------------*/
+/*  Show the bootloader command picked for each operation                      */
+/*-----------------------------------------------------------------------------*/
+
+void
+print_commands()
+{
+    static const char *ops[STM32_CAP_COUNT] = {"read", "write", "erase", "go", "unprotect"};
+    const stm32_impl_t *impl;
+    int     cap;
+
+    for( cap = 0; cap < STM32_CAP_COUNT; cap++ )
+        {
+        impl = stm32_get_impl( stm, cap );
+        printf("%-13s: %-9s 0x%02x %s\n", cap ? "" : "Commands", ops[cap], impl->opcode, impl->name );
+        }
+}
+
 /*-----------------------------------------------------------------------------*/
 /*  Transfer timing                                                            */
 /*-----------------------------------------------------------------------------*/
@@ -590,10 +1296,23 @@ void
 transfer_timer( int action, int size )
 {
     static  struct timeval timestart, timeend;
+    static  serial_stats_t statstart;
+    static  unsigned long  framestart, retriedstart, resyncstart;
+    static  loader_stats_t loaderstart;
+    const   serial_stats_t *stats;
+    unsigned long  frames, data, wire;
     double  tmp1, tmp2, time_secs;
 
-    if( !action )
+    stats = serial_get_stats( serial );
+
+    if( !action ) {
          gettimeofday( &timestart, NULL );
+         statstart  = *stats;
+         framestart = stm32_get_frames( stm );
+         retriedstart = stm32_get_retried( stm );
+         resyncstart  = stm32_get_resyncs( stm );
+         loaderstart  = loader_stats;
+         }
     else
         {
         gettimeofday( &timeend, NULL );
@@ -603,203 +1322,1233 @@ transfer_timer( int action, int size )
 
         time_secs = tmp2 - tmp1;
 
-        if(!quietmode)
+        if(!quietmode) {
             printf("Transfer time %6.2f seconds, data rate %5.0f bytes/sec\n", time_secs, size/time_secs );
+
+            // frames are built whole, so ideally there is one write per frame
+            frames = stm32_get_frames( stm ) - framestart;
+            if( frames )
+                printf("Frames sent %lu, write calls %lu (%.2f per frame), read calls %lu\n", frames,
+                        stats->writes - statstart.writes,
+                        (double)(stats->writes - statstart.writes) / frames,
+                        stats->reads - statstart.reads );
+            if( frames && stats->syscalls != statstart.syscalls )
+                printf("System calls %lu (%.2f per frame)\n",
+                        stats->syscalls - statstart.syscalls,
+                        (double)(stats->syscalls - statstart.syscalls) / frames );
+            if( stm32_get_retried( stm ) != retriedstart )
+                printf("Frames retried %lu, resyncs %lu\n",
+                        stm32_get_retried( stm ) - retriedstart,
+                        stm32_get_resyncs( stm ) - resyncstart );
+
+            // what the image cost on the wire against what it wrote
+            frames = loader_stats.frames - loaderstart.frames;
+            data   = loader_stats.data   - loaderstart.data;
+            wire   = loader_stats.wire   - loaderstart.wire;
+            if( frames )
+                {
+                printf("Loader frames %lu, %lu compressed, %lu bytes sent for %lu written (ratio %.2f)\n", frames,
+                        loader_stats.packed - loaderstart.packed, wire, data, (double)data / wire );
+                printf("Effective rate %5.0f bytes/sec, %5.0f bytes/sec on the wire\n",
+                        data / time_secs, wire / time_secs );
+                }
+            if( loader_stats.resent != loaderstart.resent )
+                printf("Flash loader recoveries %lu\n", loader_stats.resent - loaderstart.resent );
+            }
+        }
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  --loader: hand the line to the flash loader for a read or write, or stay   */
+/*  with the bootloader commands when it can't run                             */
+/*-----------------------------------------------------------------------------*/
+
+void
+loader_begin()
+{
+    if( !use_loader || loader )
+        return;
+
+    loader = loader_open( stm, compress );
+    if( !loader )
+        {
+        fprintf(stderr, "Flash loader not available, using the bootloader commands\n");
+        use_loader = 0;
+        }
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Wait for the frames still on the wire and give the line back to the        */
+/*  bootloader                                                                 */
+/*-----------------------------------------------------------------------------*/
+
+int
+loader_end()
+{
+    const loader_stats_t *ls;
+    int             ok;
+
+    if( !loader )
+        return(0);
+
+    ok = loader_flush( loader );
+
+    // for transfer_timer, the session is gone by the time it reports
+    ls = loader_get_stats( loader );
+    loader_stats.frames += ls->frames;
+    loader_stats.packed += ls->packed;
+    loader_stats.data   += ls->data;
+    loader_stats.wire   += ls->wire;
+    loader_stats.resent += ls->resent;
+
+    ok = loader_close( loader ) && ok;
+    loader = NULL;
+
+    return( ok ? 0 : -1 );
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  The flash a read or write covers, want for want_len bytes or all of it,    */
+/*  checked against the device                                                 */
+/*-----------------------------------------------------------------------------*/
+
+int
+flash_range( uint32_t want, uint32_t want_len, uint32_t *addr, uint32_t *len )
+{
+    *addr = want ? want : stm->dev->fl_start;
+
+    if( *addr < stm->dev->fl_start || *addr >= stm->dev->fl_end )
+        {
+        fprintf(stderr, "Address 0x%08x is outside the flash, 0x%08x to 0x%08x\n", *addr, stm->dev->fl_start, stm->dev->fl_end - 1);
+        return(-1);
+        }
+    if( *addr % 4 != 0 )
+        {
+        fprintf(stderr, "Address 0x%08x is not a multiple of 4\n", *addr);
+        return(-1);
+        }
+
+    *len = want_len ? want_len : stm->dev->fl_end - *addr;
+    if( *len > stm->dev->fl_end - *addr )
+        {
+        fprintf(stderr, "0x%x bytes from 0x%08x runs past the end of the flash at 0x%08x\n", *len, *addr, stm->dev->fl_end);
+        return(-1);
+        }
+
+    return(0);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Find the end of the used flash from the top down.  A page is used when     */
+/*  any byte of it is not erased: its CRC from the crc applet differs from     */
+/*  an erased page's, or without the applet a full read finds one.            */
+/*  @returns the end of the last used page in addr to end, or addr            */
+/*-----------------------------------------------------------------------------*/
+
+uint32_t
+used_end( uint32_t addr, uint32_t end )
+{
+    unsigned int    ps = stm->dev->fl_ps;
+    uint32_t        base, page, from, to, erased;
+    unsigned int    pages, i, n, len;
+    uint32_t        *crcs;
+    uint8_t         buf[256];
+    uint8_t         blank[ps];
+
+    if( end <= addr )
+        return(addr);
+
+    // whole pages, from the one holding addr to the one holding end - 1
+    base  = addr - (addr - stm->dev->fl_start) % ps;
+    pages = (end - base + ps - 1) / ps;
+
+    crcs = malloc( pages * sizeof(uint32_t) );
+    if( crcs && stm32_crc_pages( stm, base, ps, pages, crcs ) )
+        {
+        memset( blank, 0xFF, ps );
+        erased = crc32_stm32( 0xFFFFFFFF, blank, ps );
+        for( i = pages; i > 0; i-- )
+            if( crcs[i - 1] != erased )
+                break;
+        free( crcs );
+
+        to = base + i * ps;
+        return( i == 0 ? addr : to < end ? to : end );
+        }
+    free( crcs );
+    fprintf(stderr, "Page CRCs not available, reading the pages in full to find the used flash\n");
+
+    for( i = pages; i > 0; i-- )
+        {
+        page = base + (i - 1) * ps;
+        from = page > addr ? page : addr;
+        to   = page + ps < end ? page + ps : end;
+
+        for( ; from < to; from += len )
+            {
+            len = to - from < sizeof(buf) ? to - from : sizeof(buf);
+            if( !stm32_read_memory(stm, from, buf, len) )
+                return(end);
+
+            for( n = 0; n < len; n++ )
+                if( buf[n] != 0xFF )
+                    return(to);
+            }
+        }
+
+    return(addr);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Read flash contents to binary file                                         */
+/*-----------------------------------------------------------------------------*/
+
+int
+read_flash()
+{
+    parser_err_t perr;
+    uint32_t        start, end, size;
+    
+    if (rd)
+        {
+        printf("\n");
+
+        if( flash_range( start_addr, start_len, &start, &size ) < 0 )
+            return(-1);
+        end = start + size;
+
+        // erased pages past the program are not worth the time
+        if( trim )
+            {
+            end = used_end( start, end );
+            if(!quietmode)
+                printf("Used flash ends at 0x%08x, reading %u of %u bytes\n", end, end - start, size);
+            }
+
+        if ((perr = parser->open(p_st, filename, 1)) != PARSER_ERR_OK)
+            {
+            fprintf(stderr, "%s ERROR: %s\n", parser->name, parser_errstr(perr));
+        
+            if (perr == PARSER_ERR_SYSTEM) perror(filename);
+            return(-1);
+            }
+
+        if( read_range( parser, p_st, start, end ) < 0 )
+            return(-1);
+        
+        return(1);
+        }
+        
+    return(0);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Read flash from start up to end into an open parser                        */
+/*-----------------------------------------------------------------------------*/
+
+int
+read_range( parser_t *out, void *st, uint32_t start, uint32_t end )
+{
+    uint8_t         buffer[LOADER_CHUNK];
+    uint32_t        addr = start;
+    unsigned int    len, step;
+
+    show_progress( 0, end - start );
+    transfer_timer(0, 0);
+    loader_begin();
+
+    while(addr < end)
+        {
+        uint32_t left   = end - addr;
+        step            = loader ? sizeof(buffer) : 256;
+        len             = step > left ? left : step;
+        if (!(loader ? loader_read( loader, addr, buffer, len ) : stm32_read_memory(stm, addr, buffer, len)))
+            {
+            fprintf(stderr, "Failed to read memory at address 0x%08x, target write-protected?\n", addr);
+            loader_end();
+            return(-1);
+            }
+    
+        assert(out->write(st, buffer, len) == PARSER_ERR_OK);
+        addr += len;
+
+        if(!quietmode) {
+            show_progress( addr - start, end - start );
+            //fprintf(stdout, "Read address 0x%08x (%.2f%%) \r",addr,
+            //                (100.0f / (float)(stm->dev->fl_end - stm->dev->fl_start)) * (float)(addr - stm->dev->fl_start) );
+            //fflush(stdout);
+            }
+        }
+        
+    if( loader_end() < 0 )
+        return(-1);
+
+    if(!quietmode)
+        fprintf(stdout, "\nDone.\n");
+
+    // show transfer time
+    transfer_timer(1, end - start);
+
+    return(0);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Unprotect flash to allow writing                                           */
+/*-----------------------------------------------------------------------------*/
+
+int
+write_unprotect_flash()
+{
+    if (wu)
+        {
+        if(!quietmode)
+            fprintf(stdout, "Write-unprotecting flash\n");
+        
+        /* the device automatically performs a reset after the sending the ACK */
+        reset_flag = 0;
+        
+        stm32_wunprot_memory(stm);
+        
+        if(!quietmode)
+            fprintf(stdout, "Done.\n");
+        
+        return(1);
+        }
+        
+    return(0);
+}
+
+
+
+/*-----------------------------------------------------------------------------*/
+/*  Erase the flash pages about to be written, from page spage on up to size   */
+/*  bytes into the flash                                                       */
+/*-----------------------------------------------------------------------------*/
+
+int
+erase_flash( unsigned int spage, unsigned int size )
+{
+    unsigned int    fl_pages = (stm->dev->fl_end - stm->dev->fl_start) / stm->dev->fl_ps;
+    unsigned int    pages;
+    uint64_t        start = serial_time_us();
+
+    if( mass_erase && spage == 0 )
+        {
+        if(!quietmode)
+            fprintf(stdout, "Mass erasing flash\n");
+
+        if( !stm32_erase_memory(stm, 0, STM32_MASS_ERASE) )
+            {
+            fprintf(stderr, "Failed to mass erase flash\n");
+            return(-1);
+            }
+        erased_end = stm->dev->fl_end;
+        }
+    else
+        {
+        // only the pages the image lands on, unless told otherwise
+        pages = npages ? npages : (size + stm->dev->fl_ps - 1) / stm->dev->fl_ps;
+        if( pages > fl_pages )
+            {
+            fprintf(stderr, "Can't erase %u pages, the flash only has %u\n", pages, fl_pages);
+            return(-1);
+            }
+
+        if( mass_erase )
+            pages = fl_pages;
+        if( spage > pages )
+            spage = pages;
+
+        if(!quietmode)
+            fprintf(stdout, "Erasing %u of %u pages (%u bytes)\n", pages - spage, fl_pages, (pages - spage) * stm->dev->fl_ps);
+
+        if( pages > spage && !stm32_erase_memory(stm, spage, pages - spage) )
+            {
+            fprintf(stderr, "Failed to erase flash pages %u to %u\n", spage, pages - 1);
+            return(-1);
+            }
+        erased_end = stm->dev->fl_start + pages * stm->dev->fl_ps;
+        }
+
+    if(!quietmode)
+        fprintf(stdout, "Erase time %.2f seconds\n", (serial_time_us() - start) / 1000000.0);
+
+    return(0);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  --diff: compare page CRCs worked out on the target with the image's, erase */
+/*  the pages that differ and cut the segments down to them                   */
+/*  @returns 1 when done, 0 if the CRCs can't be had and every page is to be   */
+/*  written, -1 on error                                                       */
+/*-----------------------------------------------------------------------------*/
+
+int
+diff_flash( const uint8_t *image, uint32_t base, unsigned int size,
+            const parser_seg_t **segs, unsigned int *nsegs )
+{
+    unsigned int    ps     = stm->dev->fl_ps;
+    unsigned int    pages  = (size + ps - 1) / ps;
+    unsigned int    first  = (base - stm->dev->fl_start) / ps;
+    unsigned int    changed = 0, runs = 0, count = 0;
+    unsigned int    page, end, i;
+    uint32_t        *crcs;
+    uint8_t         *map;
+    uint8_t         padded[ps];
+    uint32_t        from, to;
+    uint64_t        start = serial_time_us();
+
+    crcs   = malloc( pages * sizeof(uint32_t) + 1 );
+    map    = calloc( pages + 1, 1 );
+    diff_segs = malloc( (*nsegs + pages) * sizeof(parser_seg_t) );
+    if( !crcs || !map || !diff_segs )
+        {
+        perror("diff");
+        free( crcs );
+        free( map );
+        return(-1);
+        }
+
+    if( !stm32_crc_pages( stm, base, ps, pages, crcs ) )
+        {
+        fprintf(stderr, "Page CRCs not available, writing every page\n");
+        free( crcs );
+        free( map );
+        return(0);
+        }
+
+    for( page = 0; page < pages; page++ )
+        {
+        page_image( padded, image, size, page );
+        map[page] = crc32_stm32( 0xFFFFFFFF, padded, ps ) != crcs[page];
+        changed  += map[page];
+        runs     += map[page] && (page == 0 || !map[page - 1]);
+        }
+
+    if(!quietmode)
+        printf("Pages changed %u, %u unchanged skipped (%u runs, CRC time %.2f seconds)\n",
+            changed, pages - changed, runs, (serial_time_us() - start) / 1000000.0);
+
+    for( page = 0; page < pages; page = end )
+        {
+        for( end = page; end < pages && map[end] == map[page]; end++ )
+            ;
+        if( !map[page] )
+            continue;
+
+        if( !stm32_erase_memory( stm, first + page, end - page ) )
+            {
+            fprintf(stderr, "Failed to erase flash pages %u to %u\n", first + page, first + end - 1);
+            free( crcs );
+            free( map );
+            return(-1);
+            }
+
+        // the writes only land on these pages, so the sparse skip holds
+        erased_end = base + end * ps;
+
+        // the image data on the run
+        for( i = 0; i < *nsegs; i++ )
+            {
+            from = (*segs)[i].offset > page * ps ? (*segs)[i].offset : page * ps;
+            to   = (*segs)[i].offset + (*segs)[i].len < end * ps ? (*segs)[i].offset + (*segs)[i].len : end * ps;
+            if( from >= to )
+                continue;
+            diff_segs[count].offset = from;
+            diff_segs[count].len    = to - from;
+            count++;
+            }
+        }
+
+    *segs  = diff_segs;
+    *nsegs = count;
+
+    free( crcs );
+    free( map );
+    return(1);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  What page number page of the image holds once written, erased past the end */
+/*-----------------------------------------------------------------------------*/
+
+void
+page_image( uint8_t *buffer, const uint8_t *image, unsigned int size, unsigned int page )
+{
+    unsigned int    ps  = stm->dev->fl_ps;
+    unsigned int    off = page * ps;
+
+    memset( buffer, 0xFF, ps );
+    if( off < size )
+        memcpy( buffer, image + off, size - off < ps ? size - off : ps );
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Read a page back and report where it differs from the image                */
+/*  @returns 0 if it matches, -1 if not                                        */
+/*-----------------------------------------------------------------------------*/
+
+int
+page_compare( const uint8_t *image, uint32_t base, unsigned int size, unsigned int page )
+{
+    unsigned int    ps = stm->dev->fl_ps;
+    uint8_t         expect[ps], compare[ps];
+    unsigned int    off, len, bad = 0, first = 0;
+    uint32_t        addr = base + page * ps;
+
+    page_image( expect, image, size, page );
+    for( off = 0; off < ps; off += len )
+        {
+        len = ps - off > 256 ? 256 : ps - off;
+        if( !stm32_read_memory( stm, addr + off, compare + off, len ) )
+            {
+            fprintf(stderr, "\nFailed to read memory at address 0x%08x\n", addr + off);
+            return(-1);
+            }
+        }
+
+    for( off = 0; off < ps; off++ )
+        if( compare[off] != expect[off] && bad++ == 0 )
+            first = off;
+
+    if( bad == 0 )
+        return(0);
+
+    fprintf(stderr, "\nFailed to verify at address 0x%08x, expected 0x%02x and found 0x%02x (%u bad bytes in the page)\n",
+        addr + first, expect[first], compare[first], bad);
+    return(-1);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  --crc-verify: check the pages written from offset from on against CRCs     */
+/*  worked out on the target, and read back only the pages that differ         */
+/*-----------------------------------------------------------------------------*/
+
+int
+crc_check( const uint8_t *image, uint32_t base, unsigned int size, unsigned int from )
+{
+    unsigned int    ps    = stm->dev->fl_ps;
+    unsigned int    first = from / ps;
+    unsigned int    pages = (size + ps - 1) / ps;
+    unsigned int    page, read = 0, bad = 0;
+    uint8_t         padded[ps];
+    uint32_t        *crcs;
+    char            have;
+    uint64_t        start = serial_time_us();
+
+    if( first >= pages )
+        return(0);
+
+    crcs = malloc( (pages - first) * sizeof(uint32_t) );
+    if( !crcs )
+        {
+        perror("verify");
+        return(-1);
+        }
+
+    have = stm32_crc_pages( stm, base + first * ps, ps, pages - first, crcs );
+    if( !have )
+        fprintf(stderr, "Page CRCs not available, reading every page back\n");
+
+    for( page = first; page < pages; page++ )
+        {
+        page_image( padded, image, size, page );
+        if( have && crc32_stm32( 0xFFFFFFFF, padded, ps ) == crcs[page - first] )
+            continue;
+
+        read++;
+        if( page_compare( image, base, size, page ) < 0 )
+            bad++;
+        }
+    free( crcs );
+
+    if(!quietmode)
+        printf("Verify pages %u, %u read back (%.2f seconds)\n", pages - first, read, (serial_time_us() - start) / 1000000.0);
+
+    return( bad ? -1 : 0 );
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  True if the block is all 0xFF and lands on pages erased for this write     */
+/*-----------------------------------------------------------------------------*/
+
+int
+block_erased( const uint8_t *buffer, uint32_t addr, unsigned int len )
+{
+    unsigned int    i;
+
+    if( !sparse || addr + len > erased_end )
+        return(0);
+
+    for( i = 0; i < len; i++ )
+        if( buffer[i] != 0xFF )
+            return(0);
+
+    return(1);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Read the whole image, the journal needs its CRC before anything is sent    */
+/*-----------------------------------------------------------------------------*/
+
+uint8_t *
+read_image( unsigned int size )
+{
+    uint8_t         *image = malloc( size ? size : 1 );
+    unsigned int    offset = 0;
+    unsigned int    len;
+
+    if( !image )
+        {
+        perror("image");
+        return(NULL);
+        }
+
+    while( offset < size )
+        {
+        len = size - offset;
+        if( parser->read(p_st, image + offset, &len) != PARSER_ERR_OK || len == 0 )
+            {
+            fprintf(stderr, "Failed to read %s\n", filename);
+            free( image );
+            return(NULL);
+            }
+        offset += len;
+        }
+
+    return(image);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  With --resume, find where an interrupted write of this image got to        */
+/*  @returns offset into the image to carry on from, 0 to start over          */
+/*-----------------------------------------------------------------------------*/
+
+unsigned int
+resume_point( const uint8_t *image, unsigned int size )
+{
+    journal_t       j;
+    uint8_t         compare[256];
+    unsigned int    len;
+
+    if( !resume || !journal_load( journal, &j ) )
+        return(0);
+
+    if( strcmp( j.device, device ) != 0 || j.pid != stm->pid || j.address != journal_info.address ||
+        j.size != size || j.crc != journal_info.crc || j.done > size || j.done % stm->dev->fl_ps != 0 )
+        {
+        if(!quietmode)
+            printf("Journal %s is for another image or device, starting over\n", journal);
+        return(0);
+        }
+
+    // the last block before the checkpoint has to read back as written
+    if( j.done > 0 )
+        {
+        len = j.done < sizeof(compare) ? j.done : sizeof(compare);
+        if( !stm32_read_memory(stm, j.address + j.done - len, compare, len) ||
+            memcmp( compare, image + j.done - len, len ) != 0 )
+            {
+            if(!quietmode)
+                printf("Flash below the checkpoint does not match, starting over\n");
+            return(0);
+            }
+        }
+
+    if(!quietmode)
+        printf("Resuming at 0x%08x, %u of %u bytes already written\n", j.address + j.done, j.done, size);
+
+    return(j.done);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Record progress, failing to only costs the ability to resume               */
+/*-----------------------------------------------------------------------------*/
+
+void
+checkpoint( uint32_t done )
+{
+    static char warned = 0;
+
+    journal_info.done = done;
+    if( !journal[0] )
+        return;
+    if( !journal_save( journal, &journal_info ) && !warned )
+        {
+        fprintf(stderr, "\nCan't write journal %s, this write can't be resumed\n", journal);
+        warned = 1;
+        }
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Write file to flash                                                        */
+/*-----------------------------------------------------------------------------*/
+
+int
+write_flash()
+{
+    uint8_t         *image;
+    uint32_t        base, room;
+    unsigned int    resumed;
+    unsigned int    nsegs;
+    const parser_seg_t *segs;
+    parser_seg_t    whole;
+    int             r;
+
+    if (wr)
+        {
+        printf("\n");
+
+        off_t   offset = 0;
+        unsigned int size = parser->size(p_st);
+
+        if( flash_range( start_addr, start_len, &base, &room ) < 0 )
+            return(-1);
+
+        // pages are erased whole, so the image has to start one
+        if( (base - stm->dev->fl_start) % stm->dev->fl_ps != 0 )
+            {
+            fprintf(stderr, "Address 0x%08x is not on a %u byte page boundary\n", base, stm->dev->fl_ps);
+            return(-1);
+            }
+
+        if (size > room)
+            {
+            fprintf(stderr, "File provided larger then available flash space.\n");
+            return(-1);
+            }
+
+        if( !(image = read_image( size )) )
+            return(-1);
+
+        // the journal is keyed on the port, the part and the image
+        snprintf( journal, sizeof(journal), "%s%s", filename, JOURNAL_SUFFIX );
+        memset( &journal_info, 0, sizeof(journal_info) );
+        snprintf( journal_info.device, sizeof(journal_info.device), "%s", device );
+        journal_info.pid     = stm->pid;
+        journal_info.address = base;
+        journal_info.size    = size;
+        journal_info.crc     = crc32( 0, image, size );
+
+        if( parser->segments )
+            nsegs = parser->segments( p_st, &segs );
+        else
+            {
+            whole.offset = 0;
+            whole.len    = size;
+            segs         = &whole;
+            nsegs        = 1;
+            }
+
+        // pages from the checkpoint on may hold a partly written block,
+        // so they are erased again
+        resumed = offset = resume_point( image, size );
+        r = diff ? diff_flash( image, base, size, &segs, &nsegs ) : 0;
+        if( r == 0 )
+            r = erase_flash( (base - stm->dev->fl_start + offset) / stm->dev->fl_ps, base - stm->dev->fl_start + size );
+        if( r < 0 )
+            {
+            free( image );
+            free( diff_segs );
+            diff_segs = NULL;
+            return(-1);
+            }
+        checkpoint( offset );
+
+        r = write_image( image, base, size, segs, nsegs, resumed );
+        free( image );
+        free( diff_segs );
+        diff_segs = NULL;
+        if( r < 0 )
+            return(-1);
+
+        // nothing left to resume
+        journal_remove( journal );
+        
+        return(1);
+        }
+        
+    return(0);
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Write an image at base onto erased flash, from offset resumed on           */
+/*-----------------------------------------------------------------------------*/
+
+int
+write_image( const uint8_t *image, uint32_t base, unsigned int size,
+             const parser_seg_t *segs, unsigned int nsegs, uint32_t resumed )
+{
+    const uint8_t   *buffer;
+    uint32_t        offset, addr, done;
+    unsigned int    len;
+    unsigned int    sent    = 0;
+    unsigned int    skipped = 0;
+    unsigned int    frames  = 0;
+    unsigned int    f, join;
+    plan_t          plan;
+    int             failed = 0;
+    int             skip;
+    ssize_t         r;
+
+    // frames follow the data the file holds, a gap that costs less
+    // than a frame of its own is sent as fill.  Never a whole page,
+    // that may be one --diff left as it was
+    join = stm32_frame_cost( stm );
+    if( join >= stm->dev->fl_ps )
+        join = stm->dev->fl_ps - 1;
+    if( !plan_build( &plan, segs, nsegs, resumed, join ) )
+        {
+        perror("plan");
+        return(-1);
+        }
+
+    show_progress( 0, size - resumed );
+    transfer_timer(0, 0);
+    loader_begin();
+
+    for( f = 0; f < plan.count; f++ )
+        {
+        offset  = plan.frames[f].offset;
+        len     = plan.frames[f].len;
+        addr    = base + offset;
+        buffer  = image + offset;
+
+        failed = 0;
+
+        // erased flash already reads 0xFF, verify still reads it back
+        skip = block_erased( buffer, addr, len );
+        if( skip )
+            skipped += len;
+        else
+            sent += len;
+
+        // written once, programmed flash can't take the block again
+        // without an erase, so a retry only reads it back again
+        do
+            {
+            if (!skip && failed == 0 && !(loader ? loader_write( loader, addr, buffer, len ) :
+                                    stm32_write_memory(stm, addr, (uint8_t *)buffer, len)))
+                {
+                fprintf(stderr, "\nFailed to write memory at address 0x%08x\n", addr);
+                loader_end();
+                plan_free( &plan );
+                return(-1);
+                }
+
+            // the loader gets the data with a CRC and reads back
+            // every halfword it programs, there is nothing to add
+            if (verify && !crc_verify && !loader)
+                {
+                uint8_t compare[len];
+            
+                if (!stm32_read_memory(stm, addr, compare, len))
+                    {
+                    fprintf(stderr, "\nFailed to read memory at address 0x%08x\n", addr);
+                    plan_free( &plan );
+                    return(-1);
+                    }
+
+                for(r = 0; r < len && buffer[r] == compare[r]; ++r)
+                    ;
+
+                // read the block again, the read has no checksum so the
+                // difference may have been on the wire.  Only one that
+                // stays through every retry is in the flash
+                if (r < len)
+                    {
+                    if (failed == retry)
+                        {
+                        fprintf(stderr, "\nFailed to verify at address 0x%08x, expected 0x%02x and found 0x%02x\n", (uint32_t)(addr + r), buffer [r], compare[r] );
+                        plan_free( &plan );
+                        return(-1);
+                        }
+                    ++failed;
+                    continue;
+                    }
+                }
+
+            failed = 0;
+            }while( failed > 0 );
+        
+        offset  += len;
+
+        // checkpoint on the last page boundary passed, everything
+        // below it is acked, and read back too with -v, and a resume
+        // erases from there.  The loader only vouches for the frames
+        // it has answered
+        done = offset;
+        if( loader )
+            done = loader_acked( loader ) > base ? loader_acked( loader ) - base : 0;
+        done -= done % stm->dev->fl_ps;
+        if( ++frames >= JOURNAL_FRAMES && done > journal_info.done )
+            {
+            checkpoint( done );
+            frames = 0;
+            }
+
+        if(!quietmode) {
+            show_progress( offset - resumed, size - resumed );
+            }
         }
+        
+    plan_free( &plan );
+
+    // the last frames are still on the wire
+    if( loader_end() < 0 )
+        return(-1);
+
+    // show transfer time
+    transfer_timer(1, size - resumed);
+
+    if(!quietmode)
+        printf("Write frames %u, minimum %u (%u data bytes, %u gap bytes sent as fill)\n",
+            plan.count, plan.minimum, plan.data, plan.fill);
+    if(!quietmode && sparse)
+        printf("Bytes sent %u, skipped %u already erased\n", sent, skipped);
+
+    if( verify && crc_verify && crc_check( image, base, size, resumed ) < 0 )
+        return(-1);
+
+    if(!quietmode)
+        if( verify )
+            fprintf(stdout,"Verify OK\n");
+
+    return(0);
 }
 
+
 /*-----------------------------------------------------------------------------*/
-/*  Read flash contents to binary file                                         */
+/*  Load a -s script and the image of each write in it                         */
+/*-----------------------------------------------------------------------------*/
+
+parser_err_t
+script_open()
+{
+    parser_err_t    perr;
+    batch_write_t   *b;
+    unsigned int    i;
+
+    if( !script_load( script_file, &script ) )
+        return(PARSER_ERR_INVALID_FILE);
+
+    batch = calloc( script.count, sizeof(batch_write_t) );
+    if( !batch )
+        return(PARSER_ERR_SYSTEM);
+
+    // open_parser and read_image work on the globals, borrow them
+    wr = 1;
+    for( i = 0; i < script.count; i++ )
+        {
+        if( script.steps[i].op != SCRIPT_WRITE )
+            continue;
+
+        b = &batch[i];
+        filename = script.steps[i].file;
+        if( (perr = open_parser()) != PARSER_ERR_OK )
+            break;
+
+        b->parser = parser;
+        b->p_st   = p_st;
+        b->size   = b->parser->size( b->p_st );
+        b->image  = read_image( b->size );
+        p_st      = NULL;
+        if( !b->image )
+            {
+            perr = PARSER_ERR_SYSTEM;
+            break;
+            }
+
+        if( b->parser->segments )
+            b->nsegs = b->parser->segments( b->p_st, &b->segs );
+        else
+            {
+            b->whole.len = b->size;
+            b->segs      = &b->whole;
+            b->nsegs     = 1;
+            }
+        }
+    wr = 0;
+    filename = script_file;
+
+    return( i < script.count ? perr : PARSER_ERR_OK );
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Run the script steps in order, all in this one bootloader session          */
 /*-----------------------------------------------------------------------------*/
 
 int
-read_flash()
+run_script()
 {
-    parser_err_t perr;
-    uint8_t         buffer[256];
-    uint32_t        addr;
-    unsigned int    len;
-    
-    if (rd)
+    script_step_t   *step;
+    batch_write_t   *b;
+    uint32_t        room;
+    uint64_t        start, begin = serial_time_us();
+    unsigned int    i, j;
+    char            erased = 0;
+    int             status = 0;
+
+    // every write is placed and checked before anything is touched
+    for( i = 0; i < script.count; i++ )
         {
-        printf("\n");
+        step = &script.steps[i];
+        if( step->op != SCRIPT_WRITE )
+            continue;
 
-        if ((perr = parser->open(p_st, filename, 1)) != PARSER_ERR_OK)
+        b = &batch[i];
+        if( flash_range( step->address, 0, &b->base, &room ) < 0 )
+            return(-1);
+        if( (b->base - stm->dev->fl_start) % stm->dev->fl_ps != 0 )
             {
-            fprintf(stderr, "%s ERROR: %s\n", parser->name, parser_errstr(perr));
-        
-            if (perr == PARSER_ERR_SYSTEM) perror(filename);
+            fprintf(stderr, "%s:%u: address 0x%08x is not on a %u byte page boundary\n", script_file, step->line, b->base, stm->dev->fl_ps);
+            return(-1);
+            }
+        if( b->size > room )
+            {
+            fprintf(stderr, "%s:%u: %s does not fit in the flash above 0x%08x\n", script_file, step->line, step->file, b->base);
             return(-1);
             }
 
-        addr = stm->dev->fl_start;
-        
-        show_progress( 0, stm->dev->fl_end - stm->dev->fl_start );
-        transfer_timer(0, 0);
-
-        while(addr < stm->dev->fl_end)
+        // the pages are erased once up front, a later write can't replace an earlier one
+        for( j = 0; j < i; j++ )
             {
-            uint32_t left   = stm->dev->fl_end - addr;
-            len             = sizeof(buffer) > left ? left : sizeof(buffer);
-            if (!stm32_read_memory(stm, addr, buffer, len))
+            if( script.steps[j].op != SCRIPT_WRITE || batch[j].size == 0 || b->size == 0 )
+                continue;
+            if( b->base < batch[j].base + batch[j].size && batch[j].base < b->base + b->size )
                 {
-                fprintf(stderr, "Failed to read memory at address 0x%08x, target write-protected?\n", addr);
+                fprintf(stderr, "%s:%u: %s at 0x%08x-0x%08x overlaps the write at %s:%u\n", script_file, step->line, step->file,
+                        b->base, b->base + b->size - 1, script_file, script.steps[j].line);
                 return(-1);
                 }
-        
-            assert(parser->write(p_st, buffer, len) == PARSER_ERR_OK);
-            addr += len;
-
-            if(!quietmode) {
-                show_progress( addr - stm->dev->fl_start, stm->dev->fl_end - stm->dev->fl_start );
-                //fprintf(stdout, "Read address 0x%08x (%.2f%%) \r",addr,
-                //                (100.0f / (float)(stm->dev->fl_end - stm->dev->fl_start)) * (float)(addr - stm->dev->fl_start) );
-                //fflush(stdout);
-                }
             }
-            
+        }
+
+    for( i = 0; i < script.count && status >= 0; i++ )
+        {
+        step  = &script.steps[i];
+        start = serial_time_us();
+
         if(!quietmode)
-            fprintf(stdout, "\nDone.\n");
+            printf("\nStep %-7u : %s%s%s (line %u)\n", i + 1, script_op_name( step->op ),
+                step->file ? " " : "", step->file ? step->file : "", step->line );
 
-        // show transfer time
-        transfer_timer(1, stm->dev->fl_end - stm->dev->fl_start);
-        
-        return(1);
-        }
-        
-    return(0);
-}
+        switch( step->op )
+            {
+            case SCRIPT_WRITE:
+                // the first write erases the pages of all of them at once
+                if( !erased )
+                    {
+                    erased = 1;
+                    if( (status = script_erase_writes()) < 0 )
+                        break;
+                    }
+                b = &batch[i];
+                status = write_image( b->image, b->base, b->size, b->segs, b->nsegs, 0 );
+                b->written = status >= 0;
+                break;
 
-/*-----------------------------------------------------------------------------*/
-/*  Unprotect flash to allow writing                                           */
-/*-----------------------------------------------------------------------------*/
+            case SCRIPT_VERIFY:
+                status = script_verify( i );
+                break;
 
-int
-write_unprotect_flash()
-{
-    if (wu)
+            case SCRIPT_READ:
+                status = script_read( step );
+                break;
+
+            case SCRIPT_ERASE:
+                status = script_erase( step );
+                break;
+
+            case SCRIPT_GO:
+                if( !stm32_go( stm, step->address ? step->address : stm->dev->fl_start ) )
+                    {
+                    fprintf(stderr, "Failed to start execution\n");
+                    status = -1;
+                    break;
+                    }
+                reset_flag = 0;
+                break;
+            }
+
+        if(!quietmode && status >= 0)
+            printf("Step time    : %.2f seconds\n", (serial_time_us() - start) / 1000000.0);
+        }
+
+    if( status < 0 )
         {
-        if(!quietmode)
-            fprintf(stdout, "Write-unprotecting flash\n");
-        
-        /* the device automatically performs a reset after the sending the ACK */
-        reset_flag = 0;
-        
-        stm32_wunprot_memory(stm);
-        
-        if(!quietmode)
-            fprintf(stdout, "Done.\n");
-        
-        return(1);
+        fprintf(stderr, "%s:%u: %s failed\n", script_file, step->line, script_op_name( step->op ));
+        return(-1);
         }
-        
-    return(0);
-}
 
+    if(!quietmode)
+        printf("\nScript time  : %.2f seconds for %u steps\n", (serial_time_us() - begin) / 1000000.0, script.count);
 
+    return(1);
+}
 
 /*-----------------------------------------------------------------------------*/
-/*  Write file to flash                                                        */
+/*  Erase the pages under every write in the script, joined into runs          */
 /*-----------------------------------------------------------------------------*/
 
 int
-write_flash()
+script_erase_writes()
 {
-    uint8_t         buffer[256];
-    uint32_t        addr;
-    unsigned int    len;
-    int             failed = 0;
+    unsigned int    fl_pages = (stm->dev->fl_end - stm->dev->fl_start) / stm->dev->fl_ps;
+    unsigned int    page, pages = 0, runs = 0, writes = 0;
+    unsigned int    i;
+    char            *map;
+    uint32_t        first, end;
 
-    if (wr)
+    map = calloc( fl_pages, 1 );
+    if( !map )
+        return(-1);
+
+    for( i = 0; i < script.count; i++ )
         {
-        printf("\n");
+        if( script.steps[i].op != SCRIPT_WRITE || batch[i].size == 0 )
+            continue;
 
-        off_t   offset = 0;
-        ssize_t r;
-        unsigned int size = parser->size(p_st);
+        first = (batch[i].base - stm->dev->fl_start) / stm->dev->fl_ps;
+        end   = (batch[i].base - stm->dev->fl_start + batch[i].size + stm->dev->fl_ps - 1) / stm->dev->fl_ps;
+        memset( map + first, 1, end - first );
+        writes++;
+        }
+
+    for( page = 0; page < fl_pages; page++ )
+        {
+        pages += map[page];
+        runs  += map[page] && (page == 0 || !map[page - 1]);
+        }
 
-        if (size > stm->dev->fl_end - stm->dev->fl_start)
+    if(!quietmode)
+        printf("Erasing %u of %u pages in %u runs for %u writes\n", pages, fl_pages, runs, writes);
+
+    for( page = 0; page < fl_pages; page = end )
+        {
+        for( end = page; end < fl_pages && map[end] == map[page]; end++ )
+            ;
+        if( map[page] && !stm32_erase_memory( stm, page, end - page ) )
             {
-            fprintf(stderr, "File provided larger then available flash space.\n");
+            fprintf(stderr, "Failed to erase flash pages %u to %u\n", page, end - 1);
+            free( map );
             return(-1);
             }
 
-        stm32_erase_memory(stm, npages);
+        // every write lands on erased pages, so the sparse skip holds
+        if( map[page] )
+            erased_end = stm->dev->fl_start + end * stm->dev->fl_ps;
+        }
 
-        addr = stm->dev->fl_start;
+    free( map );
+    return(0);
+}
 
-        show_progress( 0, size );
-        transfer_timer(0, 0);
+/*-----------------------------------------------------------------------------*/
+/*  Read back what the writes before step upto put in flash                    */
+/*-----------------------------------------------------------------------------*/
 
-        while(addr < stm->dev->fl_end && offset < size)
-            {
-            uint32_t left   = stm->dev->fl_end - addr;
-            len             = sizeof(buffer) > left ? left : sizeof(buffer);
-            len             = len > size - offset ? size - offset : len;
+int
+script_verify( unsigned int upto )
+{
+    uint8_t         compare[256];
+    batch_write_t   *b;
+    uint32_t        offset, end, len;
+    unsigned int    i, s, r;
+    unsigned int    bytes = 0, writes = 0;
 
-            if (parser->read(p_st, buffer, &len) != PARSER_ERR_OK)
-                return(-1);
-        
-            failed = 0;
-            
-            do
+    for( i = 0; i < upto; i++ )
+        {
+        b = &batch[i];
+        if( !b->written )
+            continue;
+        writes++;
+
+        for( s = 0; s < b->nsegs; s++ )
+            {
+            end = b->segs[s].offset + b->segs[s].len;
+            for( offset = b->segs[s].offset & ~3; offset < end; offset += len )
                 {
-                if (!stm32_write_memory(stm, addr, buffer, len))
+                len = end - offset > sizeof(compare) ? sizeof(compare) : end - offset;
+                if( !stm32_read_memory( stm, b->base + offset, compare, len ) )
                     {
-                    fprintf(stderr, "\nFailed to write memory at address 0x%08x\n", addr);
+                    fprintf(stderr, "Failed to read memory at address 0x%08x\n", b->base + offset);
                     return(-1);
                     }
 
-                if (verify)
+                for( r = 0; r < len && b->image[offset + r] == compare[r]; r++ )
+                    ;
+                if( r < len )
                     {
-                    uint8_t compare[len];
-                
-                    if (!stm32_read_memory(stm, addr, compare, len))
-                        {
-                        fprintf(stderr, "\nFailed to read memory at address 0x%08x\n", addr);
-                        return(-1);
-                        }
-
-                    for(r = 0; r < len; ++r)
-                        {
-                        if (buffer[r] != compare[r])
-                            {
-                            if (failed == retry)
-                                {
-                                fprintf(stderr, "\nFailed to verify at address 0x%08x, expected 0x%02x and found 0x%02x\n", (uint32_t)(addr + r), buffer [r], compare[r] );
-                                return(-1);
-                                }
-                            ++failed;
-                            }
-
-                        failed = 0;
-                        }
-                    } 
-                }while( failed > 0 );
-            
-            addr    += len;
-            offset  += len;
-
-            if(!quietmode) {
-                show_progress( offset, size );
-//                fprintf(stdout, "Wrote %saddress 0x%08x (%.2f%%) \r", verify ? "and verified " : "", addr, (100.0f / size) * offset );
-//                fflush(stdout);
+                    fprintf(stderr, "Failed to verify at address 0x%08x, expected 0x%02x and found 0x%02x\n",
+                        b->base + offset + r, b->image[offset + r], compare[r] );
+                    return(-1);
+                    }
+                bytes += len;
                 }
             }
-            
-        // show transfer time
-        transfer_timer(1, size);
-        
-        if(!quietmode)
-            if( verify )
-                fprintf(stdout,"Verify OK\n");
-        
-        return(1);
         }
-        
+
+    if(!quietmode)
+        printf("Verify OK, %u bytes of %u writes\n", bytes, writes);
+
     return(0);
 }
 
+/*-----------------------------------------------------------------------------*/
+/*  Read a range of flash to a binary file                                     */
+/*-----------------------------------------------------------------------------*/
+
+int
+script_read( const script_step_t *step )
+{
+    parser_err_t    perr;
+    void            *st;
+    uint32_t        start, len;
+    int             status;
+
+    if( flash_range( step->address, step->len, &start, &len ) < 0 )
+        return(-1);
+
+    st = PARSER_BINARY.init();
+    if( !st )
+        return(-1);
+    if( (perr = PARSER_BINARY.open( st, step->file, 1 )) != PARSER_ERR_OK )
+        {
+        fprintf(stderr, "%s ERROR: %s\n", PARSER_BINARY.name, parser_errstr(perr));
+        if (perr == PARSER_ERR_SYSTEM) perror(step->file);
+        PARSER_BINARY.close( st );
+        return(-1);
+        }
+
+    status = read_range( &PARSER_BINARY, st, start, start + len );
+    PARSER_BINARY.close( st );
+    return( status );
+}
+
+/*-----------------------------------------------------------------------------*/
+/*  Erase pages, or the whole flash                                            */
+/*-----------------------------------------------------------------------------*/
+
+int
+script_erase( const script_step_t *step )
+{
+    unsigned int    fl_pages = (stm->dev->fl_end - stm->dev->fl_start) / stm->dev->fl_ps;
+
+    if( step->mass )
+        return( stm32_erase_memory( stm, 0, STM32_MASS_ERASE ) ? 0 : -1 );
+
+    if( step->address >= fl_pages || step->len > fl_pages - step->address )
+        {
+        fprintf(stderr, "Pages %u to %u are past the %u the flash has\n", step->address, step->address + step->len - 1, fl_pages);
+        return(-1);
+        }
+
+    if(!quietmode)
+        printf("Erasing pages %u to %u\n", step->address, step->address + step->len - 1);
+
+    return( stm32_erase_memory( stm, step->address, step->len ) ? 0 : -1 );
+}
 
 /*-----------------------------------------------------------------------------*/
 /*  close devices                                                              */
@@ -808,10 +2557,28 @@ write_flash()
 void
 cleanup()
 {
-    usleep(20000);
+    // let the last bytes out before the port is closed
+    if( conservative || !serial )
+        usleep(20000);
+    else
+        serial_drain( serial, serial_time_us() + 20000 );
     
     if (p_st  )
         parser->close(p_st);
+
+    if (batch )
+        {
+        unsigned int i;
+
+        for( i = 0; i < script.count; i++ )
+            {
+            free( batch[i].image );
+            if( batch[i].p_st )
+                batch[i].parser->close( batch[i].p_st );
+            }
+        free( batch );
+        script_free( &script );
+        }
         
     if (stm   )
         stm32_close  (stm);
@@ -900,10 +2667,70 @@ open_parser()
 /*                                                                             */
 /*-----------------------------------------------------------------------------*/
 
+/* long options have no short form, their values start past any character */
+enum {
+        OPT_RESUME = 0x100,
+        OPT_CONSERVATIVE,
+        OPT_TRIM,
+        OPT_DIFF,
+        OPT_CRC_VERIFY,
+        OPT_LOADER,
+        OPT_COMPRESS,
+        OPT_RESET_LINES
+};
+
+const struct option long_options[] = {
+        {"resume"      , no_argument, NULL, OPT_RESUME      },
+        {"conservative", no_argument, NULL, OPT_CONSERVATIVE},
+        {"trim"        , no_argument, NULL, OPT_TRIM        },
+        {"diff"        , no_argument, NULL, OPT_DIFF        },
+        {"crc-verify"  , no_argument, NULL, OPT_CRC_VERIFY  },
+        {"reset-lines" , no_argument, NULL, OPT_RESET_LINES },
+#ifdef FLASH_LOADER
+        {"loader"      , no_argument, NULL, OPT_LOADER      },
+        {"compress"    , no_argument, NULL, OPT_COMPRESS    },
+#endif
+        {NULL          , 0          , NULL, 0               }
+};
+
 int parse_options(int argc, char *argv[]) {
         int c;
-        while((c = getopt(argc, argv, "b:r:w:e:vn:g:GfchuXq012")) != -1) {
+        while((c = getopt_long(argc, argv, "b:r:w:e:vn:g:GfchuXqVWR:S:s:012", long_options, NULL)) != -1) {
                 switch(c) {
+                        case OPT_RESUME:
+                                resume = 1;
+                                break;
+
+                        case OPT_CONSERVATIVE:
+                                conservative = 1;
+                                break;
+
+                        case OPT_TRIM:
+                                trim = 1;
+                                break;
+
+                        case OPT_DIFF:
+                                diff = 1;
+                                break;
+
+                        case OPT_CRC_VERIFY:
+                                verify     = 1;
+                                crc_verify = 1;
+                                break;
+
+                        case OPT_RESET_LINES:
+                                reset_lines = 1;
+                                break;
+
+                        case OPT_LOADER:
+                                use_loader = 1;
+                                break;
+
+                        case OPT_COMPRESS:
+                                use_loader = 1;
+                                compress   = 1;
+                                break;
+
                         case 'X':
                                 if( vex_user_program == 0 )
                                     vex_user_program = 1;
@@ -922,16 +2749,47 @@ int parse_options(int argc, char *argv[]) {
                         case 'q':
                                 quietmode = 1;
                                 break;
+
+                        case 'V':
+                                verbose = 1;
+                                break;
+
+                        case 'W':
+                                sparse = 0;
+                                break;
+
+                        case 'R': {
+                                char *end;
+
+                                rt_priority = strtol(optarg, &end, 0);
+                                if (*end == ':')
+                                        rt_cpu = strtol(end + 1, &end, 0);
+                                if (*end || rt_priority < 1 || rt_priority > 99 || rt_cpu < -1) {
+                                        fprintf(stderr, "ERROR: -R needs a priority 1-99 and an optional :cpu\n");
+                                        return 1;
+                                }
+                                break;
+                        }
                                 
-                        case 'b':
-                                baudRate = serial_get_baud(strtoul(optarg, NULL, 0));
-                                if (baudRate == SERIAL_BAUD_INVALID) {
-                                        fprintf(stderr, "Invalid baud rate, valid options are:\n");
-                                        for(baudRate = SERIAL_BAUD_1200; baudRate != SERIAL_BAUD_INVALID; ++baudRate)
-                                                fprintf(stderr, " %d\n", serial_get_baud_int(baudRate));
+                        case 'b': {
+                                serial_baud_t b;
+                                char *end;
+
+                                if (strcmp(optarg, "auto") == 0) {
+                                        baud_auto = 1;
+                                        break;
+                                }
+
+                                baudRate = strtoul(optarg, &end, 0);
+                                if (baudRate == 0 || *end != '\0') {
+                                        fprintf(stderr, "Invalid baud rate, standard options are:\n");
+                                        for(b = SERIAL_BAUD_1200; b != SERIAL_BAUD_INVALID; ++b)
+                                                fprintf(stderr, " %d\n", serial_get_baud_int(b));
+                                        fprintf(stderr, "or any other rate the serial adapter supports\n");
                                         return 1;
                                 }
                                 break;
+                                }
 
                         case 'r':
                         case 'w':
@@ -944,9 +2802,13 @@ int parse_options(int argc, char *argv[]) {
                                 filename = optarg;
                                 break;
                         case 'e':
+                                if (strcmp(optarg, "mass") == 0) {
+                                        mass_erase = 1;
+                                        break;
+                                }
                                 npages = strtoul(optarg, NULL, 0);
-                                if (npages > 0xFF || npages < 0) {
-                                        fprintf(stderr, "ERROR: You need to specify a page count between 0 and 255");
+                                if (npages == 0 || npages > 0xFFFF) {
+                                        fprintf(stderr, "ERROR: You need to specify a page count between 1 and 65535, or mass\n");
                                         return 1;
                                 }
                                 break;
@@ -961,9 +2823,35 @@ int parse_options(int argc, char *argv[]) {
                                 verify = 1;
                                 break;
 
-                        case 'n':
-                                retry = strtoul(optarg, NULL, 0);
+                        case 'n': {
+                                char *pos;
+
+                                retry = strtoul(optarg, &pos, 0);
+                                if (*pos == ':')
+                                        retry_backoff = strtoul(pos + 1, &pos, 0) * 1000;
+                                if (*pos != '\0' || retry < 0 || retry > RETRY_MAX || retry_backoff > RETRY_BACKOFF_MAX) {
+                                        fprintf(stderr, "ERROR: Retry count is 0-%d, backoff 0-%d ms\n", RETRY_MAX, RETRY_BACKOFF_MAX / 1000);
+                                        return 1;
+                                }
+                                break;
+                                }
+
+                        case 's':
+                                script_file = optarg;
+                                break;
+
+                        case 'S': {
+                                char *pos;
+
+                                start_addr = strtoul(optarg, &pos, 0);
+                                if (*pos == ':')
+                                        start_len = strtoul(pos + 1, &pos, 0);
+                                if (*pos != '\0' || start_addr == 0 || (pos[-1] == ':')) {
+                                        fprintf(stderr, "ERROR: -S needs an address and an optional :length\n");
+                                        return 1;
+                                }
                                 break;
+                                }
 
                         case 'g':
                                 exec_flag = 1;
@@ -1004,8 +2892,38 @@ int parse_options(int argc, char *argv[]) {
                 return 1;
         }
 
-        if (!wr && verify) {
-                fprintf(stderr, "ERROR: Invalid usage, -v is only valid when writing\n");
+        if (script_file && (rd || wr || wu || start_addr || resume || trim || diff || npages || mass_erase)) {
+                fprintf(stderr, "ERROR: Invalid usage, -s takes its reads, writes and erases from the script\n");
+                show_help(argv[0]);
+                return 1;
+        }
+
+        if (!wr && resume) {
+                fprintf(stderr, "ERROR: Invalid usage, --resume is only valid when writing\n");
+                show_help(argv[0]);
+                return 1;
+        }
+
+        if (diff && (!wr || resume || npages || mass_erase)) {
+                fprintf(stderr, "ERROR: Invalid usage, --diff is only valid when writing, without --resume or -e\n");
+                show_help(argv[0]);
+                return 1;
+        }
+
+        if (!baud_auto && reset_lines) {
+                fprintf(stderr, "ERROR: Invalid usage, --reset-lines is only valid with -b auto\n");
+                show_help(argv[0]);
+                return 1;
+        }
+
+        if (!rd && trim) {
+                fprintf(stderr, "ERROR: Invalid usage, --trim is only valid when reading\n");
+                show_help(argv[0]);
+                return 1;
+        }
+
+        if (!wr && !script_file && verify) {
+                fprintf(stderr, "ERROR: Invalid usage, -v and --crc-verify are only valid when writing\n");
                 show_help(argv[0]);
                 return 1;
         }
@@ -1021,29 +2939,99 @@ int parse_options(int argc, char *argv[]) {
 void show_help(char *name) {
         fprintf(stderr,
 #ifdef __WIN32__
-                "Usage: %s [-bvngfhc] [-[rw] filename] COM1\n"
+                "Usage: %s [-bvngfhcVWS] [-[rw] filename | -s script] COM1\n"
 #else
-                "Usage: %s [-bvngfhc] [-[rw] filename] /dev/tty.usbserial\n"
+                "Usage: %s [-bvngfhcVWS] [-[rw] filename | -s script] /dev/tty.usbserial\n"
 #endif
-                "       -b rate         Baud rate (default 115200)\n"
+                "       -b rate         Baud rate (default 115200), the VEX cortex only\n"
+                "                       works at 115200, other STM32 parts take any rate\n"
+                "                       the adapter supports\n"
+                "       -b auto         Probe for the fastest reliable rate, for generic\n"
+                "                       STM32 targets already in the bootloader (no VEX\n"
+                "                       handshake)\n"
+                "       --reset-lines   With -b auto, reset the part between rates by\n"
+                "                       DTR, which holds it in reset, and RTS, which\n"
+                "                       selects the bootloader\n"
                 "       -X              Enter VEX user program mode\n" 
                 "       -X1             Enter VEX user program mode using C9 commands\n" 
                 "       -X2             Enter VEX user program mode using old style RTS control\n" 
                 "       -r filename     Read flash to file\n"
                 "       -w filename     Write flash to file\n"
                 "       -u              Disable the flash write-protection\n"
-                "       -e n            Only erase n pages before writing the flash\n"
+                "       -s script       Run the operations listed in script, one per line,\n"
+                "                       in one bootloader session:\n"
+                "                           write file[@address]\n"
+                "                           verify\n"
+                "                           read address:length > file\n"
+                "                           erase page[:count] | erase mass\n"
+                "                           go [address]\n"
+                "                       the first write erases the pages of all of them,\n"
+                "                       verify reads back every write so far\n"
+                "       -S address[:length]\n"
+                "                       Read or write from address on, and no more than\n"
+                "                       length bytes, rather than the whole flash; writes\n"
+                "                       start on a page boundary\n"
+                "       -e n            Erase the first n pages before writing the flash,\n"
+                "                       rather than only the pages the image covers\n"
+                "       -e mass         Erase the whole flash before writing\n"
                 "       -v              Verify writes\n"
-                "       -n count        Retry failed writes up to count times (default 10)\n"
+                "       -W              Write every block, even all 0xFF blocks on\n"
+                "                       pages that were just erased\n"
+                "       -n count[:ms]   Retry a failed frame or verify up to count times\n"
+                "                       (default 10), waiting ms for the line to go\n"
+                "                       quiet before the first resync (default 10),\n"
+                "                       doubling for each retry\n"
                 "       -g address      Start execution at specified address (0 = flash start)\n"
                 "       -G              Start execution at flash start address\n"
                 "       -f              Force binary parser\n"
                 "       -h              Show this help\n"
                 "       -q              quietmode, no status messages\n"
+                "       -V              Verbose, show the USB adapter profile, the\n"
+                "                       measured bootloader round trip and the timing\n"
+                "                       of each handshake step\n"
+                "       -R prio[:cpu]   Do the serial I/O on a SCHED_FIFO thread at\n"
+                "                       priority 1-99, pinned to cpu if given (Linux)\n"
+                "       --resume        Carry on with a write that was interrupted, from\n"
+                "                       the checkpoint in filename.resume, if the port,\n"
+                "                       device and image are the same.  The checkpoint\n"
+                "                       covers what the bootloader acked, and is only\n"
+                "                       read back first with -v\n"
+                "       --conservative  Use the original fixed handshake delays instead\n"
+                "                       of waiting for the port and the cortex\n"
+                "       --diff          Have the device CRC the pages the image covers,\n"
+                "                       and erase and write only the ones that differ\n"
+                "       --crc-verify    Verify with -v after the whole write, by page\n"
+                "                       CRCs worked out on the device, reading back only\n"
+                "                       the pages that differ\n"
+#ifdef FLASH_LOADER
+                "       --loader        Read and write through a flash loader run from\n"
+                "                       RAM, in 4K frames several at a time, falling\n"
+                "                       back to the bootloader commands if it can't\n"
+                "                       run; writes are checked on the device\n"
+                "       --compress      --loader, sending each 4K of the image as an\n"
+                "                       LZ4 block the loader expands when that is\n"
+                "                       shorter\n"
+#endif
+                "       --trim          Stop a read after the last used page, leaving\n"
+                "                       out the erased pages above the program\n"
                 "       -c              Resume the connection (don't send initial INIT)\n"
                 "                       *Baud rate must be kept the same as the first init*\n"
                 "                       This is useful if the reset fails\n"
                 "\n"
+                "Devices:\n"
+#ifndef __WIN32__
+                "       tcp:host:port   Serial port exported raw over TCP (ser2net)\n"
+                "       rfc2217:host:port\n"
+                "                       Serial port over telnet with RFC 2217 port\n"
+                "                       control, for the VEX handshake\n"
+#endif
+#ifdef SERIAL_IOURING
+                "       uring:/dev/tty  Local serial port driven through io_uring\n"
+#endif
+                "       mem:            Built-in bootloader model, no hardware needed\n"
+                "       mem:ext         The same, with extended erase (0x44)\n"
+                "       mem:ns          The same, with only the no-stretch write and erase\n"
+                "\n"
                 "Examples:\n"
                 "       Get device information:\n"
 #ifdef __WIN32__
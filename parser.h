@@ -21,9 +21,18 @@
 #ifndef _H_PARSER
 #define _H_PARSER
 
+#include <stdint.h>
+
 typedef struct parser     parser_t;
+typedef struct parser_seg parser_seg_t;
 typedef enum   parser_err parser_err_t;
 
+/* a run of bytes the file gives, the rest of the image is only fill */
+struct parser_seg {
+	uint32_t	offset;		/* into the image */
+	unsigned int	len;
+};
+
 struct parser {
 	const char *name;
 	void*        (*init )();							/* initialise the parser */
@@ -32,6 +41,7 @@ struct parser {
 	unsigned int (*size )(void *storage);						/* get the total data size */
 	parser_err_t (*read )(void *storage, void *data, unsigned int *len);		/* read a block of data */
 	parser_err_t (*write)(void *storage, void *data, unsigned int len);		/* write a block of data */
+	unsigned int (*segments)(void *storage, const parser_seg_t **segs);		/* data runs in offset order, apart, NULL if there are no gaps */
 };
 
 enum parser_err {
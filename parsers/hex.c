@@ -27,18 +27,45 @@
 #include <string.h>
 
 #include "hex.h"
-#include "utils.h"
 
 typedef struct {
 	size_t		data_len, offset;
 	uint8_t		*data;
-	uint8_t		base;
+	uint32_t	base;		/* address of data[0] */
+	parser_seg_t	*segs;		/* where the records put data */
+	unsigned int	seg_count;
+	char		sorted;
 } hex_t;
 
 void* hex_init() {
 	return calloc(sizeof(hex_t), 1);
 }
 
+/* note a record, records that follow on just grow the last segment */
+static char hex_add_seg(hex_t *st, uint32_t offset, unsigned int len) {
+	parser_seg_t *seg = st->seg_count ? &st->segs[st->seg_count - 1] : NULL;
+
+	if (seg && seg->offset + seg->len == offset) {
+		seg->len += len;
+		return 1;
+	}
+
+	seg = realloc(st->segs, (st->seg_count + 1) * sizeof(parser_seg_t));
+	if (!seg)
+		return 0;
+	st->segs = seg;
+	st->segs[st->seg_count].offset = offset;
+	st->segs[st->seg_count].len    = len;
+	st->seg_count++;
+	st->sorted = 0;
+	return 1;
+}
+
+static int hex_seg_cmp(const void *a, const void *b) {
+	const parser_seg_t *x = a, *y = b;
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
 parser_err_t hex_open(void *storage, const char *filename, const char write) {
 	hex_t *st = storage;
 	if (write) {
@@ -48,8 +75,7 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 		int i, fd;
 		uint8_t checksum;
 		unsigned int c;
-		uint32_t base = 0;
-		unsigned int last_address = 0x0;
+		uint32_t base = 0, offset;
 
 		fd = open(filename, O_RDONLY);
 		if (fd < 0)
@@ -84,18 +110,29 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 			switch(type) {
 				/* data record */
 				case 0:
-					c = address - last_address;
-					st->data = realloc(st->data, st->data_len + c + reclen);
+					/* the image starts at the first base the file gives */
+					if (st->seg_count == 0)
+						st->base = base;
 
-					/* if there is a gap, set it to 0xff and increment the length */
-					if (c > 0) {
-						memset(&st->data[st->data_len], 0xff, c);
-						st->data_len += c;
+					/* we cant cope with data below that */
+					if (base + address < st->base) {
+						close(fd);
+						return PARSER_ERR_INVALID_FILE;
+					}
+					offset = base + address - st->base;
+
+					/* if there is a gap, set it to 0xff and grow the image */
+					if (offset + reclen > st->data_len) {
+						st->data = realloc(st->data, offset + reclen);
+						memset(&st->data[st->data_len], 0xff, offset + reclen - st->data_len);
+						st->data_len = offset + reclen;
 					}
 
-					last_address = address + reclen;
-					record = &st->data[st->data_len];
-					st->data_len += reclen;
+					record = &st->data[offset];
+					if (!hex_add_seg(st, offset, reclen)) {
+						close(fd);
+						return PARSER_ERR_SYSTEM;
+					}
 					break;
 
 				/* extended segment address record */
@@ -147,31 +184,9 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 					close(fd);
 					return PARSER_ERR_OK;
 
-				/* address record */
-				case 2: base = base << 4;
-				case 4:	base = be_u32(base);
-					/* Reset last_address since our base changed */
-					last_address = 0;
-
-					if (st->base == 0) {
-						st->base = base;
-						break;
-					}
-
-					/* we cant cope with files out of order */
-					if (base < st->base) {
-						close(fd);
-						return PARSER_ERR_INVALID_FILE;
-					}
-
-					/* if there is a gap, enlarge and fill with zeros */
-					unsigned int len = base - st->base;
-					if (len > st->data_len) {
-						st->data = realloc(st->data, len);
-						memset(&st->data[st->data_len], 0, len - st->data_len);
-						st->data_len = len;
-					}
-					break;
+				/* address record, the data bytes are the top of the address */
+				case 2: base = base <<  4; break;
+				case 4:	base = base << 16; break;
 			}
 		}
 
@@ -183,6 +198,7 @@ parser_err_t hex_open(void *storage, const char *filename, const char write) {
 parser_err_t hex_close(void *storage) {
 	hex_t *st = storage;
 	if (st) free(st->data);
+	if (st) free(st->segs);
 	free(st);
 	return PARSER_ERR_OK;
 }
@@ -208,6 +224,31 @@ parser_err_t hex_write(void *storage, void *data, unsigned int len) {
 	return PARSER_ERR_RDONLY;
 }
 
+/* records may come in any order and overlap, sort and join them once */
+unsigned int hex_segments(void *storage, const parser_seg_t **segs) {
+	hex_t *st = storage;
+	unsigned int i, n = 0;
+	uint32_t end;
+
+	if (!st->sorted && st->seg_count > 0) {
+		qsort(st->segs, st->seg_count, sizeof(parser_seg_t), hex_seg_cmp);
+		for(i = 1; i < st->seg_count; ++i) {
+			end = st->segs[n].offset + st->segs[n].len;
+			if (st->segs[i].offset > end) {
+				st->segs[++n] = st->segs[i];
+				continue;
+			}
+			if (st->segs[i].offset + st->segs[i].len > end)
+				st->segs[n].len = st->segs[i].offset + st->segs[i].len - st->segs[n].offset;
+		}
+		st->seg_count = n + 1;
+		st->sorted    = 1;
+	}
+
+	*segs = st->segs;
+	return st->seg_count;
+}
+
 parser_t PARSER_HEX = {
 	"Intel HEX",
 	hex_init,
@@ -215,6 +256,7 @@ parser_t PARSER_HEX = {
 	hex_close,
 	hex_size,
 	hex_read,
-	hex_write
+	hex_write,
+	hex_segments
 };
 
@@ -0,0 +1,84 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "plan.h"
+
+static char plan_add(plan_t *plan, uint32_t offset, unsigned int len) {
+	plan_frame_t *f;
+
+	f = realloc(plan->frames, (plan->count + 1) * sizeof(plan_frame_t));
+	if (!f)
+		return 0;
+	plan->frames = f;
+	plan->frames[plan->count].offset = offset;
+	plan->frames[plan->count].len    = len;
+	plan->count++;
+	return 1;
+}
+
+/*
+	cut the segments, in offset order and apart, clipped to from on,
+	into frames.  A gap of up to join bytes is sent as fill, a longer
+	one starts a new run of frames.  Segments that share a word always
+	share a frame, a word can only be programmed once.
+*/
+char plan_build(plan_t *plan, const parser_seg_t *segs, unsigned int count, uint32_t from, unsigned int join) {
+	uint32_t start, end, next, o;
+	unsigned int i;
+
+	memset(plan, 0, sizeof(plan_t));
+	for(i = 0; i < count; ++i) {
+		if (segs[i].offset + segs[i].len <= from)
+			continue;
+
+		/* an unaligned start is padded from the word boundary */
+		start = segs[i].offset > from ? segs[i].offset : from;
+		end   = segs[i].offset + segs[i].len;
+		plan->data += end - start;
+		start &= ~3;
+
+		while(i + 1 < count) {
+			next = segs[i + 1].offset;
+			if (next > end + join && (next & ~3) >= ((end + 3) & ~3))
+				break;
+			++i;
+			plan->fill += next - end;
+			plan->data += segs[i].len;
+			end = next + segs[i].len;
+		}
+
+		for(o = start; o < end; o += PLAN_FRAME_MAX)
+			if (!plan_add(plan, o, end - o > PLAN_FRAME_MAX ? PLAN_FRAME_MAX : end - o)) {
+				plan_free(plan);
+				return 0;
+			}
+	}
+
+	plan->minimum = (plan->data + PLAN_FRAME_MAX - 1) / PLAN_FRAME_MAX;
+	return 1;
+}
+
+void plan_free(plan_t *plan) {
+	free(plan->frames);
+	plan->frames = NULL;
+}
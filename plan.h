@@ -0,0 +1,52 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_PLAN
+#define _H_PLAN
+
+#include <stdint.h>
+#include "parser.h"
+
+/* the write memory command takes at most this many bytes */
+#define PLAN_FRAME_MAX	256
+
+/* one write memory frame, the image bytes from offset on */
+typedef struct {
+	uint32_t	offset;		/* a multiple of 4 */
+	unsigned int	len;		/* the write pads the last word */
+} plan_frame_t;
+
+/*
+	how an image goes out.  Frames are laid over the address space, not
+	the file: neighbouring segments share a frame when the gap between
+	them costs less to send as fill than a frame of its own.
+*/
+typedef struct {
+	plan_frame_t	*frames;
+	unsigned int	count;
+	unsigned int	minimum;	/* frames if every one were full */
+	unsigned int	data;		/* bytes the segments hold */
+	unsigned int	fill;		/* gap bytes sent to save a frame */
+} plan_t;
+
+char plan_build(plan_t *plan, const parser_seg_t *segs, unsigned int count, uint32_t from, unsigned int join);
+void plan_free (plan_t *plan);
+
+#endif
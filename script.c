@@ -0,0 +1,195 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "script.h"
+
+#define SCRIPT_LINE_MAX	1024
+
+static const char *script_ops[] = {"write", "verify", "read", "erase", "go"};
+
+const char* script_op_name(script_op_t op) {
+	return script_ops[op];
+}
+
+static char* script_skip(char *pos) {
+	while(isspace((unsigned char)*pos))
+		++pos;
+	return pos;
+}
+
+/* trailing blanks off a file name, which runs to the end of the line */
+static char* script_name(char *pos) {
+	char *end = pos + strlen(pos);
+	while(end > pos && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return *pos ? strdup(pos) : NULL;
+}
+
+/* fill in step from the text after the op, 0 if it does not parse */
+static char script_args(script_step_t *step, char *args) {
+	char *pos, *at;
+
+	switch(step->op) {
+		case SCRIPT_WRITE:
+			/* the last @ splits off the address, file names may hold one */
+			at = strrchr(args, '@');
+			if (at) {
+				*at = '\0';
+				step->address = strtoul(at + 1, &pos, 0);
+				if (pos == at + 1 || *script_skip(pos))
+					return 0;
+			}
+			step->file = script_name(args);
+			return step->file != NULL;
+
+		case SCRIPT_READ:
+			step->address = strtoul(args, &pos, 0);
+			if (pos == args || *pos != ':')
+				return 0;
+			args = pos + 1;
+			step->len = strtoul(args, &pos, 0);
+			if (pos == args || step->len == 0)
+				return 0;
+			pos = script_skip(pos);
+			if (*pos != '>')
+				return 0;
+			step->file = script_name(script_skip(pos + 1));
+			return step->file != NULL;
+
+		case SCRIPT_ERASE:
+			if (strncmp(args, "mass", 4) == 0 && !*script_skip(args + 4)) {
+				step->mass = 1;
+				return 1;
+			}
+			step->address = strtoul(args, &pos, 0);
+			if (pos == args)
+				return 0;
+			step->len = 1;
+			if (*pos == ':') {
+				args = pos + 1;
+				step->len = strtoul(args, &pos, 0);
+				if (pos == args || step->len == 0)
+					return 0;
+			}
+			return !*script_skip(pos);
+
+		case SCRIPT_GO:
+			if (!*args)
+				return 1;
+			step->address = strtoul(args, &pos, 0);
+			return pos != args && !*script_skip(pos);
+
+		case SCRIPT_VERIFY:
+			return !*args;
+	}
+	return 0;
+}
+
+/* one line of the script, 0 if it is wrong */
+static char script_line(script_t *script, const char *path, unsigned int n, char *line) {
+	script_step_t step, *steps;
+	char *pos, *word;
+	unsigned int op;
+
+	if ((pos = strchr(line, '#')))
+		*pos = '\0';
+	pos = script_skip(line);
+	if (!*pos)
+		return 1;
+
+	word = pos;
+	while(*pos && !isspace((unsigned char)*pos))
+		++pos;
+	if (*pos)
+		*pos++ = '\0';
+
+	memset(&step, 0, sizeof(step));
+	step.line = n;
+	for(op = 0; op < sizeof(script_ops) / sizeof(script_ops[0]); ++op)
+		if (strcmp(word, script_ops[op]) == 0)
+			break;
+	if (op == sizeof(script_ops) / sizeof(script_ops[0])) {
+		fprintf(stderr, "%s:%u: unknown operation %s\n", path, n, word);
+		return 0;
+	}
+	step.op = op;
+
+	/* go hands the part to the program, nothing can follow it */
+	if (script->count > 0 && script->steps[script->count - 1].op == SCRIPT_GO) {
+		fprintf(stderr, "%s:%u: nothing can follow go\n", path, n);
+		return 0;
+	}
+
+	if (!script_args(&step, script_skip(pos))) {
+		fprintf(stderr, "%s:%u: bad arguments for %s\n", path, n, word);
+		free(step.file);
+		return 0;
+	}
+
+	steps = realloc(script->steps, (script->count + 1) * sizeof(script_step_t));
+	if (!steps) {
+		free(step.file);
+		return 0;
+	}
+	script->steps = steps;
+	script->steps[script->count++] = step;
+	return 1;
+}
+
+char script_load(const char *path, script_t *script) {
+	char line[SCRIPT_LINE_MAX];
+	unsigned int n = 0;
+	char ok = 1;
+	FILE *f;
+
+	memset(script, 0, sizeof(script_t));
+	f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return 0;
+	}
+
+	while(ok && fgets(line, sizeof(line), f))
+		ok = script_line(script, path, ++n, line);
+	fclose(f);
+
+	if (ok && script->count == 0) {
+		fprintf(stderr, "%s: no operations\n", path);
+		ok = 0;
+	}
+	if (!ok)
+		script_free(script);
+	return ok;
+}
+
+void script_free(script_t *script) {
+	unsigned int i;
+
+	for(i = 0; i < script->count; ++i)
+		free(script->steps[i].file);
+	free(script->steps);
+	script->steps = NULL;
+	script->count = 0;
+}
@@ -0,0 +1,64 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_SCRIPT
+#define _H_SCRIPT
+
+#include <stdint.h>
+
+/*
+	a batch of operations for one bootloader session, one per line:
+
+		write file[@address]
+		verify
+		read address:length > file
+		erase page[:count]
+		erase mass
+		go [address]
+
+	addresses default to the start of flash, # starts a comment
+*/
+typedef enum {
+	SCRIPT_WRITE,
+	SCRIPT_VERIFY,		/* read back everything written so far */
+	SCRIPT_READ,
+	SCRIPT_ERASE,
+	SCRIPT_GO
+} script_op_t;
+
+typedef struct {
+	script_op_t	op;
+	unsigned int	line;
+	char		*file;
+	uint32_t	address;	/* 0 is the start of flash, the first page for erase */
+	uint32_t	len;		/* read bytes, erase pages */
+	char		mass;		/* erase the whole flash */
+} script_step_t;
+
+typedef struct {
+	script_step_t	*steps;
+	unsigned int	count;
+} script_t;
+
+char script_load(const char *path, script_t *script);
+void script_free(script_t *script);
+const char* script_op_name(script_op_t op);
+
+#endif
@@ -25,6 +25,9 @@
 
 typedef struct serial serial_t;
 
+/* reply wait used by serial_read, callers can set their own deadline */
+#define SERIAL_TIMEOUT	500000	/* us */
+
 typedef enum {
 	SERIAL_PARITY_NONE,
 	SERIAL_PARITY_EVEN,
@@ -48,6 +51,9 @@ typedef enum {
 	SERIAL_BAUD_38400,
 	SERIAL_BAUD_57600,
 	SERIAL_BAUD_115200,
+	SERIAL_BAUD_230400,
+	SERIAL_BAUD_460800,
+	SERIAL_BAUD_921600,
 
 	SERIAL_BAUD_INVALID
 } serial_baud_t;
@@ -69,14 +75,82 @@ typedef enum {
 	SERIAL_ERR_NODATA
 } serial_err_t;
 
+typedef struct {
+	unsigned long	writes;		/* transport write calls */
+	unsigned long	reads;		/* transport read calls */
+	unsigned long	tx_bytes;
+	unsigned long	rx_bytes;
+	unsigned long	syscalls;	/* system calls made by the transports */
+} serial_stats_t;
+
+/*
+	what a USB serial adapter needs to behave, chosen from its VID:PID
+	where the transport can find it
+*/
+typedef struct {
+	const char	*name;
+	uint16_t	vid, pid;	/* 0:0 is the fallback for anything else */
+	unsigned int	latency_timer;	/* ms, 0 leaves the driver default */
+	char		low_latency;	/* set ASYNC_LOW_LATENCY on the tty */
+	char		dummy_byte;	/* first byte after opening or a rate change can be lost */
+	unsigned int	settle;		/* us to wait after setting up the line */
+} serial_profile_t;
+
+/* modem control lines for set_modem */
+#define SERIAL_MODEM_RTS	0x01
+#define SERIAL_MODEM_DTR	0x02
+
+/*
+	a transport moves bytes for serial_t, which adds the receive
+	buffering, line state and statistics on top.  The device name
+	picks the transport by prefix, anything unprefixed is a tty.
+*/
+typedef struct serial_ops serial_ops_t;
+
+struct serial_ops {
+	const char *name;
+	const char *prefix;										/* device name prefix, NULL for the default */
+	void*        (*open     )(const char *device);						/* open, returns the port state */
+	void         (*close    )(void *port);
+	void         (*flush    )(void *port);								/* drop pending input */
+	serial_err_t (*set_line )(void *port, unsigned int baud, serial_bits_t bits, serial_parity_t parity, serial_stopbit_t stopbit, unsigned int *speed);
+	serial_err_t (*write    )(void *port, const void *buffer, unsigned int len);		/* send all of buffer */
+	int          (*read     )(void *port, void *buffer, unsigned int len, uint64_t deadline);	/* bytes read, 0 at the deadline, -1 on error */
+	serial_err_t (*set_modem)(void *port, int lines, int level);
+	serial_err_t (*queue    )(void *port, const void *buffer, unsigned int len);		/* optional, send with the next read */
+	char         (*usb_id   )(void *port, uint16_t *vid, uint16_t *pid);			/* optional, the adapter behind the port */
+	serial_err_t (*tune     )(void *port, const serial_profile_t *profile);			/* optional, apply latency settings */
+	serial_err_t (*drain    )(void *port, uint64_t deadline);				/* optional, wait for the output queue to empty */
+};
+
+extern serial_ops_t SERIAL_TTY;
+extern serial_ops_t SERIAL_TCP;
+extern serial_ops_t SERIAL_RFC2217;
+extern serial_ops_t SERIAL_MEM;
+#ifdef SERIAL_IOURING
+extern serial_ops_t SERIAL_URING;
+#endif
+
+/* bumped by the transports for every system call on the data path */
+extern unsigned long serial_syscalls;
+
 serial_t*    serial_open (const char *device);
 void         serial_close(serial_t *h);
-void         serial_flush(const serial_t *h);
-serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit);
-serial_err_t serial_write(const serial_t *h, const void *buffer, unsigned int len);
-serial_err_t serial_read (const serial_t *h, const void *buffer, unsigned int len);
+void         serial_flush(serial_t *h);
+serial_err_t serial_setup(serial_t *h, const unsigned int baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit);
+serial_err_t serial_write(serial_t *h, const void *buffer, unsigned int len);
+serial_err_t serial_queue(serial_t *h, const void *buffer, unsigned int len);
+serial_err_t serial_read (serial_t *h, const void *buffer, unsigned int len);
+serial_err_t serial_read_deadline(serial_t *h, const void *buffer, unsigned int len, uint64_t deadline);
+int          serial_read_avail(serial_t *h, void *buffer, unsigned int len, uint64_t deadline);
+serial_err_t serial_drain(serial_t *h, uint64_t deadline);
+uint64_t     serial_time_us(void);
 const char*  serial_get_setup_str(const serial_t *h);
+unsigned int serial_get_speed(const serial_t *h);
 int          serial_set_rts(serial_t *h, int level);
+int          serial_set_dtr(serial_t *h, int level);
+const serial_stats_t* serial_get_stats(serial_t *h);
+const serial_profile_t* serial_get_profile(const serial_t *h, uint16_t *vid, uint16_t *pid);
 
 /* common helper functions */
 serial_baud_t serial_get_baud            (const unsigned int baud);
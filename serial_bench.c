@@ -0,0 +1,195 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	serial transport benchmark, "make bench".
+
+	A child process on the master side of a pty plays the bootloader:
+	it answers each 258 byte write frame with an ACK, and each 2 byte
+	read request with an ACK and 256 bytes.  The parent drives the
+	slave side through serial_t the way stm32.c does and reports wall
+	time and system calls per block for every transport that can open
+	a pty.  The child also plays the flash loader, answering each 4K
+	frame with two bytes, and those frames go out a window at a time
+	as loader.c sends them.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <sys/wait.h>
+
+#include "serial.h"
+
+#define BENCH_BLOCKS	2000
+#define BENCH_WM_FRAME	258	/* N, 256 data bytes, checksum */
+#define BENCH_RM_FRAME	2	/* N and its complement */
+#define BENCH_RM_REPLY	257	/* ACK and 256 data bytes */
+#define BENCH_LD_FRAME	4112	/* header, 4096 data bytes, CRC */
+#define BENCH_LD_REPLY	2	/* status and sequence number */
+#define BENCH_LD_SYNC	0x5A
+
+typedef struct {
+	const char	*name;
+	unsigned int	frame, reply;
+	unsigned int	data;		/* bytes moved per block */
+	unsigned int	window;		/* blocks sent before the first answer is read */
+} bench_op_t;
+
+static const bench_op_t bench_ops[] = {
+	{"write 256", BENCH_WM_FRAME, 1             , 256 , 1},
+	{"read 256" , BENCH_RM_FRAME, BENCH_RM_REPLY, 256 , 1},
+	{"loader w1", BENCH_LD_FRAME, BENCH_LD_REPLY, 4096, 1},
+	{"loader w4", BENCH_LD_FRAME, BENCH_LD_REPLY, 4096, 4},
+	{NULL}
+};
+
+/* label and device prefix */
+static const char *bench_transports[][2] = {
+	{"tty"  , ""      },
+#ifdef SERIAL_IOURING
+	{"uring", "uring:"},
+#endif
+	{NULL}
+};
+
+/* the bootloader side, runs until the pty goes away */
+static void bench_target(int fd) {
+	uint8_t buf[2 * BENCH_LD_FRAME], reply[BENCH_RM_REPLY];
+	unsigned int have = 0, need;
+	ssize_t r;
+
+	memset(reply, 0x79, sizeof(reply));
+	for(;;) {
+		r = read(fd, buf + have, sizeof(buf) - have);
+		if (r <= 0)
+			_exit(0);
+		have += r;
+
+		/* the first byte tells the frame kinds apart */
+		while(have > 0) {
+			need = buf[0] == 0xFF ? BENCH_WM_FRAME : buf[0] == BENCH_LD_SYNC ? BENCH_LD_FRAME : BENCH_RM_FRAME;
+			if (have < need)
+				break;
+			if (write(fd, reply, need == BENCH_WM_FRAME ? 1 : need == BENCH_LD_FRAME ? BENCH_LD_REPLY : BENCH_RM_REPLY) < 0)
+				_exit(1);
+			memmove(buf, buf + need, have - need);
+			have -= need;
+		}
+	}
+}
+
+static int bench_run(const char *label, const char *device, const bench_op_t *op, unsigned int blocks) {
+	uint8_t frame[BENCH_LD_FRAME], reply[BENCH_RM_REPLY];
+	const serial_stats_t *stats;
+	unsigned long syscalls;
+	serial_t *serial;
+	uint64_t start, elapsed;
+	unsigned int i, sent;
+	serial_err_t err;
+
+	serial = serial_open(device);
+	if (!serial) {
+		perror(device);
+		return 0;
+	}
+	if (serial_setup(serial, 115200, SERIAL_BITS_8, SERIAL_PARITY_EVEN, SERIAL_STOPBIT_1) != SERIAL_ERR_OK) {
+		fprintf(stderr, "%s: setup failed\n", device);
+		serial_close(serial);
+		return 0;
+	}
+
+	memset(frame, 0xFF, sizeof(frame));
+	frame[0] = op->frame == BENCH_WM_FRAME ? 0xFF : op->frame == BENCH_LD_FRAME ? BENCH_LD_SYNC : 0x00;
+
+	syscalls = serial_get_stats(serial)->syscalls;
+	start    = serial_time_us();
+	for(i = sent = 0; i < blocks; ++i) {
+		/* a lone frame goes out with the read for its answer */
+		for(err = SERIAL_ERR_OK; err == SERIAL_ERR_OK && sent < blocks && sent - i < op->window; ++sent)
+			err = op->window == 1 ? serial_queue(serial, frame, op->frame) :
+			                        serial_write(serial, frame, op->frame);
+		if (err != SERIAL_ERR_OK ||
+		    serial_read(serial, reply, op->reply) != SERIAL_ERR_OK) {
+			fprintf(stderr, "%s: %s failed at block %u\n", device, op->name, i);
+			serial_close(serial);
+			return 0;
+		}
+	}
+	elapsed = serial_time_us() - start;
+	stats   = serial_get_stats(serial);
+
+	printf("%-8s %-10s %8.1f us/block %6.2f syscalls/block %10.0f bytes/sec\n",
+		label, op->name,
+		(double)elapsed / blocks,
+		(double)(stats->syscalls - syscalls) / blocks,
+		(double)op->data * blocks * 1000000 / elapsed);
+
+	serial_close(serial);
+	return 1;
+}
+
+int main(int argc, char *argv[]) {
+	const char *(*transport)[2];
+	const bench_op_t *op;
+	unsigned int blocks = argc > 1 ? strtoul(argv[1], NULL, 0) : BENCH_BLOCKS;
+	char device[128];
+	struct termios tio;
+	int master, hold, ok = 1;
+	pid_t child;
+
+	if (blocks == 0) {
+		fprintf(stderr, "Usage: %s [blocks]\n", argv[0]);
+		return 1;
+	}
+
+	master = posix_openpt(O_RDWR | O_NOCTTY);
+	if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+		perror("pty");
+		return 1;
+	}
+	tcgetattr(master, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(master, TCSANOW, &tio);
+
+	/* keep the slave open between runs, or the target sees a hangup */
+	hold = open(ptsname(master), O_RDWR | O_NOCTTY);
+
+	child = fork();
+	if (child == 0)
+		bench_target(master);
+
+	printf("%u blocks over %s\n", blocks, ptsname(master));
+	for(transport = bench_transports; (*transport)[0]; ++transport)
+		for(op = bench_ops; op->name; ++op) {
+			snprintf(device, sizeof(device), "%s%s", (*transport)[1], ptsname(master));
+			ok &= bench_run((*transport)[0], device, op, blocks);
+		}
+
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+	close(hold);
+	return ok ? 0 : 1;
+}
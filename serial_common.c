@@ -17,8 +17,312 @@
   Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+
 #include "serial.h"
 
+/* must be a power of two */
+#define SERIAL_RX_SIZE	4096
+
+struct serial {
+	const serial_ops_t	*ops;
+	void			*port;
+
+	char			configured;
+	unsigned int		baud;		/* rate asked for */
+	unsigned int		speed;		/* rate the transport reports */
+	serial_bits_t		bits;
+	serial_parity_t		parity;
+	serial_stopbit_t	stopbit;
+
+	serial_stats_t		stats;
+
+	const serial_profile_t	*profile;
+	uint16_t		vid, pid;	/* 0 if the transport can't tell */
+
+	/* receive ring, filled with whatever the transport has queued */
+	uint8_t			rx[SERIAL_RX_SIZE];
+	unsigned int		rx_head, rx_tail;
+};
+
+unsigned long serial_syscalls;
+
+/*
+	known USB serial adapters.  FTDI parts buffer for 16ms by default,
+	which caps a stop-and-wait protocol at about 60 round trips a
+	second, so the latency timer comes down to 1ms.  Anything not
+	listed keeps the dummy byte and settle delays the VEX cables
+	were tuned with.
+*/
+static const serial_profile_t serial_profiles[] = {
+	/* name                 , vid   , pid   , latency, low, dummy, settle */
+	{"FTDI FT232R"          , 0x0403, 0x6001, 1      , 1  , 0    ,  10000},
+	{"FTDI FT2232"          , 0x0403, 0x6010, 1      , 1  , 0    ,  10000},
+	{"FTDI FT4232"          , 0x0403, 0x6011, 1      , 1  , 0    ,  10000},
+	{"FTDI FT232H"          , 0x0403, 0x6014, 1      , 1  , 0    ,  10000},
+	{"FTDI FT-X"            , 0x0403, 0x6015, 1      , 1  , 0    ,  10000},
+	{"Prolific PL2303"      , 0x067B, 0x2303, 0      , 1  , 1    , 100000},
+	{"Silicon Labs CP210x"  , 0x10C4, 0xEA60, 0      , 1  , 0    ,  20000},
+	{"WCH CH340"            , 0x1A86, 0x7523, 0      , 1  , 0    ,  20000},
+	{"generic"              , 0     , 0     , 0      , 0  , 1    , 100000}
+};
+
+static const serial_profile_t* serial_find_profile(uint16_t vid, uint16_t pid) {
+	const serial_profile_t *p;
+
+	for(p = serial_profiles; p->vid != 0; ++p)
+		if (p->vid == vid && p->pid == pid)
+			break;
+	return p;
+}
+
+/* transports tried in order, the tty takes anything without a prefix */
+static serial_ops_t *serial_transports[] = {
+#ifdef SERIAL_IOURING
+	&SERIAL_URING,
+#endif
+#ifndef __WIN32__
+	&SERIAL_TCP,
+	&SERIAL_RFC2217,
+#endif
+	&SERIAL_MEM,
+	&SERIAL_TTY,
+	NULL
+};
+
+serial_t* serial_open(const char *device) {
+	serial_ops_t **ops;
+	serial_t *h;
+
+	for(ops = serial_transports; *ops; ++ops)
+		if (!(*ops)->prefix || strncmp(device, (*ops)->prefix, strlen((*ops)->prefix)) == 0)
+			break;
+	if (!*ops)
+		return NULL;
+
+	h = calloc(sizeof(serial_t), 1);
+	h->ops  = *ops;
+	h->port = h->ops->open(device);
+	if (!h->port) {
+		free(h);
+		return NULL;
+	}
+
+	/* a failed tune just leaves the driver defaults, not worth failing for */
+	h->profile = serial_find_profile(0, 0);
+	if (h->ops->usb_id && h->ops->usb_id(h->port, &h->vid, &h->pid))
+		h->profile = serial_find_profile(h->vid, h->pid);
+	if (h->ops->tune)
+		h->ops->tune(h->port, h->profile);
+
+	return h;
+}
+
+void serial_close(serial_t *h) {
+	assert(h && h->port);
+
+	serial_flush(h);
+	h->ops->close(h->port);
+	free(h);
+}
+
+void serial_flush(serial_t *h) {
+	assert(h && h->port);
+	h->ops->flush(h->port);
+	h->rx_head = h->rx_tail = 0;
+}
+
+serial_err_t serial_setup(serial_t *h, const unsigned int baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit) {
+	assert(h && h->port);
+
+	serial_err_t err;
+	unsigned int speed;
+
+	/* if the port is already configured, no need to do anything */
+	if (
+		h->configured        &&
+		h->baud	   == baud   &&
+		h->bits	   == bits   &&
+		h->parity  == parity &&
+		h->stopbit == stopbit
+	) return SERIAL_ERR_OK;
+
+	serial_flush(h);
+	err = h->ops->set_line(h->port, baud, bits, parity, stopbit, &speed);
+	if (err != SERIAL_ERR_OK)
+		return err;
+
+	h->configured = 1;
+	h->baud	      = baud;
+	h->speed      = speed;
+	h->bits	      = bits;
+	h->parity     = parity;
+	h->stopbit    = stopbit;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t serial_write(serial_t *h, const void *buffer, unsigned int len) {
+	assert(h && h->port && h->configured);
+
+	serial_err_t err;
+
+	h->stats.writes++;
+	err = h->ops->write(h->port, buffer, len);
+	if (err == SERIAL_ERR_OK)
+		h->stats.tx_bytes += len;
+	return err;
+}
+
+/*
+	a write the caller will wait on a reply for.  Transports that can
+	send it together with that read get the chance to, the rest just
+	write it now.
+*/
+serial_err_t serial_queue(serial_t *h, const void *buffer, unsigned int len) {
+	assert(h && h->port && h->configured);
+
+	serial_err_t err;
+
+	if (!h->ops->queue)
+		return serial_write(h, buffer, len);
+
+	h->stats.writes++;
+	err = h->ops->queue(h->port, buffer, len);
+	if (err == SERIAL_ERR_OK)
+		h->stats.tx_bytes += len;
+	return err;
+}
+
+/*
+	wait for everything written to leave the host, or the deadline.
+	Transports that can't tell are taken to be drained already.
+*/
+serial_err_t serial_drain(serial_t *h, uint64_t deadline) {
+	assert(h && h->port);
+
+	if (!h->ops->drain)
+		return SERIAL_ERR_OK;
+	return h->ops->drain(h->port, deadline);
+}
+
+/* move whatever the transport has queued into the ring with one read */
+static int serial_fill(serial_t *h, uint64_t deadline) {
+	unsigned int used, pos, room;
+	int r;
+
+	/* rewind an empty ring so the read is not split at the wrap */
+	if (h->rx_head == h->rx_tail)
+		h->rx_head = h->rx_tail = 0;
+
+	used = h->rx_head - h->rx_tail;
+	pos  = h->rx_head & (SERIAL_RX_SIZE - 1);
+	room = SERIAL_RX_SIZE - used;
+
+	/* only read up to the end of the ring, the next fill wraps */
+	if (room > SERIAL_RX_SIZE - pos)
+		room = SERIAL_RX_SIZE - pos;
+
+	r = h->ops->read(h->port, &h->rx[pos], room, deadline);
+	h->stats.reads++;
+	if (r > 0) {
+		h->rx_head        += r;
+		h->stats.rx_bytes += r;
+	}
+	return r;
+}
+
+serial_err_t serial_read_deadline(serial_t *h, const void *buffer, unsigned int len, uint64_t deadline) {
+	assert(h && h->port && h->configured);
+
+	uint8_t *pos = (uint8_t*)buffer;
+	int r;
+
+	while(len > 0) {
+		/* serve from the ring first */
+		while(len > 0 && h->rx_tail != h->rx_head) {
+			*pos++ = h->rx[h->rx_tail++ & (SERIAL_RX_SIZE - 1)];
+			--len;
+		}
+		if (len == 0)
+			break;
+
+		r = serial_fill(h, deadline);
+		      if (r == 0) return SERIAL_ERR_NODATA;
+		else  if (r <  0) return SERIAL_ERR_SYSTEM;
+	}
+
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t serial_read(serial_t *h, const void *buffer, unsigned int len) {
+	return serial_read_deadline(h, buffer, len, serial_time_us() + SERIAL_TIMEOUT);
+}
+
+/*
+	whatever has arrived, up to len bytes, waiting until the deadline
+	only if nothing has.  Returns the byte count, 0 at the deadline or
+	-1 on error.  One read takes everything the transport has queued.
+*/
+int serial_read_avail(serial_t *h, void *buffer, unsigned int len, uint64_t deadline) {
+	assert(h && h->port && h->configured);
+
+	uint8_t *pos = buffer;
+	int r;
+
+	if (h->rx_tail == h->rx_head) {
+		r = serial_fill(h, deadline);
+		if (r <= 0)
+			return r;
+	}
+
+	while(len > 0 && h->rx_tail != h->rx_head) {
+		*pos++ = h->rx[h->rx_tail++ & (SERIAL_RX_SIZE - 1)];
+		--len;
+	}
+	return pos - (uint8_t*)buffer;
+}
+
+const char* serial_get_setup_str(const serial_t *h) {
+	static char str[20];
+	if (!h->configured)
+		snprintf(str, sizeof(str), "INVALID");
+	else
+		snprintf(str, sizeof(str), "%u %d%c%d",
+			h->speed,
+			serial_get_bits_int   (h->bits   ),
+			serial_get_parity_str (h->parity ),
+			serial_get_stopbit_int(h->stopbit)
+		);
+
+	return str;
+}
+
+unsigned int serial_get_speed(const serial_t *h) {
+	return h->configured ? h->speed : 0;
+}
+
+const serial_stats_t* serial_get_stats(serial_t *h) {
+	h->stats.syscalls = serial_syscalls;
+	return &h->stats;
+}
+
+const serial_profile_t* serial_get_profile(const serial_t *h, uint16_t *vid, uint16_t *pid) {
+	if (vid) *vid = h->vid;
+	if (pid) *pid = h->pid;
+	return h->profile;
+}
+
+int serial_set_rts(serial_t *h, int level) {
+	return h->ops->set_modem(h->port, SERIAL_MODEM_RTS, level);
+}
+
+int serial_set_dtr(serial_t *h, int level) {
+	return h->ops->set_modem(h->port, SERIAL_MODEM_DTR, level);
+}
+
 serial_baud_t serial_get_baud(const unsigned int baud) {
 	switch(baud) {
 		case   1200: return SERIAL_BAUD_1200  ;
@@ -30,6 +334,9 @@ serial_baud_t serial_get_baud(const unsigned int baud) {
 		case  38400: return SERIAL_BAUD_38400 ;
 		case  57600: return SERIAL_BAUD_57600 ;
 		case 115200: return SERIAL_BAUD_115200;
+		case 230400: return SERIAL_BAUD_230400;
+		case 460800: return SERIAL_BAUD_460800;
+		case 921600: return SERIAL_BAUD_921600;
 
 		default:
 			return SERIAL_BAUD_INVALID;
@@ -47,6 +354,9 @@ unsigned int serial_get_baud_int(const serial_baud_t baud) {
 		case SERIAL_BAUD_38400 : return 38400 ;
 		case SERIAL_BAUD_57600 : return 57600 ;
 		case SERIAL_BAUD_115200: return 115200;
+		case SERIAL_BAUD_230400: return 230400;
+		case SERIAL_BAUD_460800: return 460800;
+		case SERIAL_BAUD_921600: return 921600;
 
 		case SERIAL_BAUD_INVALID:
 		default:
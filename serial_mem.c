@@ -0,0 +1,621 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	in-memory transport, device is "mem:", "mem:ext" or "mem:ns".  The
+	far end is a model of the STM32 ROM bootloader on a VEX cortex
+	(high-density, 384K flash) that is fed straight from write() and
+	answers into a buffer, so the protocol layer can be exercised and
+	timed without hardware or a single system call.  "ext" is a v3.1
+	bootloader with extended erase (0x44) in place of the original
+	erase (0x43).  "ns" only has the no-stretch write, erase and write
+	unprotect (0x32, 0x45, 0x74), which answer BUSY before their ACK.
+
+	A GO to APPLET_LOAD with a pending mailbox runs the model of the
+	applet named in it (crc.c or loader.c), and comes back as crt0 does: status posted,
+	state done and the bootloader waiting for its autobaud byte.  The
+	loader keeps the line until it is sent QUIT, and its model takes
+	the stream a frame at a time where the real one scans a ring, and
+	expands ZWRITE data with lz4.c in place of its own copy.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "serial.h"
+#include "utils.h"
+#include "lz4.h"
+#include "stm32/applet.h"
+#include "stm32/loader_proto.h"
+
+#define MEM_ACK		0x79
+#define MEM_NACK	0x1F
+#define MEM_BUSY	0x76
+
+#define MEM_PID		0x414
+#define MEM_FL_START	0x08000000
+#define MEM_FL_SIZE	(384 * 1024)
+#define MEM_FL_PS	2048
+#define MEM_RAM_START	0x20000000
+#define MEM_RAM_SIZE	(64 * 1024)
+
+/* big enough for a loader frame, answers to a window of them wait in out */
+#define MEM_IN_SIZE	(LOADER_HEAD + LOADER_FRAME + LOADER_CRC)
+#define MEM_OUT_SIZE	(64 * 1024)
+
+typedef enum {
+	MEM_SYNC,	/* waiting for the autobaud 0x7F */
+	MEM_CMD,	/* command and its complement */
+	MEM_ADDR,	/* address for RM, WM or GO */
+	MEM_RM_LEN,
+	MEM_WM_DATA,
+	MEM_ER,
+	MEM_EE,
+	MEM_LOADER	/* stm32/loader.c has the line */
+} mem_state_t;
+
+typedef struct {
+	mem_state_t	state;
+	uint8_t		cmd;
+	char		extended;
+	char		nostretch;
+	uint8_t		*target;	/* memory the last address fell in */
+	uint32_t	offset, size;
+
+	/* the loader applet */
+	uint32_t	ld_max;
+	uint32_t	ld_done, ld_dropped;
+	uint8_t		ld_expect;
+	char		ld_nacked;
+	uint8_t		ld_page[LOADER_FRAME];
+
+	uint8_t		flash[MEM_FL_SIZE];
+	uint8_t		ram[MEM_RAM_SIZE];
+
+	uint8_t		in[MEM_IN_SIZE];
+	unsigned int	in_len;
+	uint8_t		out[MEM_OUT_SIZE];
+	unsigned int	out_head, out_tail;
+} mem_t;
+
+static void mem_put(mem_t *h, const uint8_t *data, unsigned int len) {
+	/* only the loader has more than one answer waiting */
+	if (h->out_tail == h->out_head)
+		h->out_tail = h->out_head = 0;
+	if (h->out_head + len > MEM_OUT_SIZE) {
+		memmove(h->out, &h->out[h->out_tail], h->out_head - h->out_tail);
+		h->out_head -= h->out_tail;
+		h->out_tail  = 0;
+	}
+	if (h->out_head + len > MEM_OUT_SIZE)
+		return;
+	memcpy(&h->out[h->out_head], data, len);
+	h->out_head += len;
+}
+
+static void mem_put_byte(mem_t *h, uint8_t byte) {
+	mem_put(h, &byte, 1);
+}
+
+static uint8_t mem_xor(const uint8_t *data, unsigned int len) {
+	uint8_t cs = 0;
+	while(len--) cs ^= *data++;
+	return cs;
+}
+
+static void mem_erase(mem_t *h, unsigned int page) {
+	if (page < MEM_FL_SIZE / MEM_FL_PS)
+		memset(&h->flash[page * MEM_FL_PS], 0xFF, MEM_FL_PS);
+}
+
+/* the final reply, no-stretch commands say they are busy first */
+static void mem_done(mem_t *h) {
+	if (h->cmd == 0x32 || h->cmd == 0x45 || h->cmd == 0x74)
+		mem_put_byte(h, MEM_BUSY);
+	mem_put_byte(h, MEM_ACK);
+}
+
+static void mem_command(mem_t *h, uint8_t cmd) {
+	const uint8_t get[] = {
+		MEM_ACK, 11, 0x22,
+		0x00, 0x01, 0x02, 0x11, 0x21, 0x31, 0x43, 0x63, 0x73, 0x82, 0x92,
+		MEM_ACK
+	};
+	const uint8_t get_ext[] = {
+		MEM_ACK, 11, 0x31,
+		0x00, 0x01, 0x02, 0x11, 0x21, 0x31, 0x44, 0x63, 0x73, 0x82, 0x92,
+		MEM_ACK
+	};
+	const uint8_t get_ns[] = {
+		MEM_ACK, 8, 0x31,
+		0x00, 0x01, 0x02, 0x11, 0x21, 0x32, 0x45, 0x74,
+		MEM_ACK
+	};
+	const uint8_t gv [] = {MEM_ACK, 0x22, 0x00, 0x00, MEM_ACK};
+	const uint8_t gid[] = {MEM_ACK, 1, MEM_PID >> 8, MEM_PID & 0xFF, MEM_ACK};
+
+	h->cmd = cmd;
+	switch(cmd) {
+		case 0x00:
+			     if (h->nostretch) mem_put(h, get_ns , sizeof(get_ns ));
+			else if (h->extended ) mem_put(h, get_ext, sizeof(get_ext));
+			else                   mem_put(h, get    , sizeof(get    ));
+			break;
+		case 0x01: mem_put(h, gv , sizeof(gv )); break;
+		case 0x02: mem_put(h, gid, sizeof(gid)); break;
+
+		case 0x11:
+		case 0x21:
+			mem_put_byte(h, MEM_ACK);
+			h->state = MEM_ADDR;
+			break;
+
+		case 0x31:
+		case 0x32:
+			if ((cmd == 0x32) != h->nostretch) {
+				mem_put_byte(h, MEM_NACK);
+				break;
+			}
+			mem_put_byte(h, MEM_ACK);
+			h->state = MEM_ADDR;
+			break;
+
+		case 0x43:
+		case 0x44:
+		case 0x45:
+			if ((cmd == 0x44) != (h->extended && !h->nostretch) ||
+			    (cmd == 0x45) != h->nostretch) {
+				mem_put_byte(h, MEM_NACK);
+				break;
+			}
+			mem_put_byte(h, MEM_ACK);
+			h->state = cmd == 0x43 ? MEM_ER : MEM_EE;
+			break;
+
+		/* nothing is protected, so there is nothing to do */
+		case 0x73:
+		case 0x74:
+			if ((cmd == 0x74) != h->nostretch) {
+				mem_put_byte(h, MEM_NACK);
+				break;
+			}
+			mem_put_byte(h, MEM_ACK);
+			mem_done(h);
+			break;
+
+		default:
+			mem_put_byte(h, MEM_NACK);
+			break;
+	}
+}
+
+static char mem_address(mem_t *h, uint32_t address) {
+	if (address >= MEM_FL_START && address < MEM_FL_START + MEM_FL_SIZE) {
+		h->target = h->flash;
+		h->offset = address - MEM_FL_START;
+		h->size   = MEM_FL_SIZE;
+		return 1;
+	}
+	if (address >= MEM_RAM_START && address < MEM_RAM_START + MEM_RAM_SIZE) {
+		h->target = h->ram;
+		h->offset = address - MEM_RAM_START;
+		h->size   = MEM_RAM_SIZE;
+		return 1;
+	}
+	return 0;
+}
+
+static uint32_t mem_get_u32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void mem_put_u32(uint8_t *p, uint32_t v) {
+	p[0] = v;
+	p[1] = v >>  8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+/* stm32/crc.c */
+static uint32_t mem_applet_crc(mem_t *h, uint8_t *mb) {
+	uint32_t address = mem_get_u32(&mb[4 * (APPLET_ARG + 0)]);
+	uint32_t size    = mem_get_u32(&mb[4 * (APPLET_ARG + 1)]);
+	uint32_t pages   = mem_get_u32(&mb[4 * (APPLET_ARG + 2)]);
+	uint32_t out     = mem_get_u32(&mb[4 * (APPLET_ARG + 3)]);
+	uint32_t n;
+
+	if (size == 0 || size % 4)
+		return APPLET_EARG;
+
+	/* the model only reaches its own flash and RAM */
+	if (address < MEM_FL_START || address - MEM_FL_START + (uint64_t)size * pages > MEM_FL_SIZE ||
+	    out < MEM_RAM_START || out - MEM_RAM_START + 4ULL * pages > MEM_RAM_SIZE)
+		return APPLET_EARG;
+
+	for(n = 0; n < pages; ++n)
+		mem_put_u32(&h->ram[out - MEM_RAM_START + 4 * n],
+			crc32_stm32(0xFFFFFFFF, &h->flash[address - MEM_FL_START + n * size], size));
+
+	mem_put_u32(&mb[4 * (APPLET_RET + 0)], pages);
+	return APPLET_OK;
+}
+
+/* stm32/loader.c, up to the READY it sends when it has the line */
+static uint32_t mem_applet_loader(mem_t *h, uint8_t *mb) {
+	uint32_t size = mem_get_u32(&mb[4 * (APPLET_ARG + 1)]);
+	uint32_t max  = mem_get_u32(&mb[4 * (APPLET_ARG + 2)]);
+	uint32_t page = mem_get_u32(&mb[4 * (APPLET_ARG + 3)]);
+	uint32_t baud = mem_get_u32(&mb[4 * (APPLET_ARG + 4)]);
+	const uint8_t ready[2] = {LOADER_READY, 0};
+
+	/* the model takes a frame whole, so it cannot be bigger than in */
+	if (max == 0 || max % 4 || max > LOADER_FRAME ||
+	    (size & (size - 1)) || size < 2 * (LOADER_HEAD + max + LOADER_CRC) || page == 0 || baud == 0)
+		return APPLET_EARG;
+
+	h->ld_max	= max;
+	h->ld_done	= 0;
+	h->ld_dropped	= 0;
+	h->ld_expect	= 0;
+	h->ld_nacked	= 0;
+	mem_put(h, ready, sizeof(ready));
+	return APPLET_OK;
+}
+
+/* back to the bootloader as crt0 does it */
+static void mem_applet_done(mem_t *h, uint32_t status) {
+	uint8_t *mb = &h->ram[APPLET_MAILBOX - MEM_RAM_START];
+
+	mem_put_u32(&mb[4 * APPLET_STATUS], status);
+	mem_put_u32(&mb[4 * APPLET_STATE ], APPLET_DONE);
+	h->state = MEM_SYNC;
+}
+
+/* what the applet in RAM would have done with its mailbox */
+static void mem_applet(mem_t *h, uint32_t address) {
+	uint8_t *mb = &h->ram[APPLET_MAILBOX - MEM_RAM_START];
+	uint32_t status;
+
+	/* whatever was started, the next thing it sees is a reset */
+	h->state = MEM_SYNC;
+	if (address != APPLET_LOAD || mem_get_u32(&mb[4 * APPLET_STATE]) != APPLET_PENDING)
+		return;
+
+	switch(mem_get_u32(&mb[4 * APPLET_ID])) {
+		case APPLET_ID_CRC   : status = mem_applet_crc(h, mb); break;
+		case APPLET_ID_LOADER:
+			status = mem_applet_loader(h, mb);
+			if (status == APPLET_OK) {
+				h->state = MEM_LOADER;
+				return;
+			}
+			break;
+		default              : status = APPLET_EID;            break;
+	}
+
+	mem_applet_done(h, status);
+}
+
+/* one frame of the loader stream, see stm32/loader_proto.h */
+static void mem_loader(mem_t *h) {
+	const uint8_t *in = h->in;
+	uint8_t *mb = &h->ram[APPLET_MAILBOX - MEM_RAM_START];
+	uint8_t reply[2];
+	uint32_t address, len, n, i;
+	char ok;
+
+	if (in[0] != LOADER_SYNC)
+		return;
+
+	len = mem_get_u32(&in[8]);
+	if (mem_xor(in, LOADER_HEAD) != 0 || len > h->ld_max || len % 4) {
+		h->ld_dropped++;
+		return;
+	}
+	n = LOADER_HEAD + (in[1] == LOADER_OP_WRITE || in[1] == LOADER_OP_ZWRITE ? len : 0);
+	if (crc32_stm32(0xFFFFFFFF, in, n) != mem_get_u32(&in[n])) {
+		h->ld_dropped++;
+		return;
+	}
+	address  = mem_get_u32(&in[4]);
+	reply[1] = in[2];
+
+	if (in[1] == LOADER_OP_QUIT) {
+		reply[0] = LOADER_ACK;
+		mem_put(h, reply, sizeof(reply));
+		mem_put_u32(&mb[4 * (APPLET_RET + 0)], h->ld_done);
+		mem_put_u32(&mb[4 * (APPLET_RET + 1)], h->ld_dropped);
+		mem_applet_done(h, APPLET_OK);
+		return;
+	}
+
+	if (in[1] == LOADER_OP_SYNC) {
+		reply[0] = LOADER_STATE;
+		reply[1] = h->ld_expect;
+		h->ld_nacked = 0;
+		mem_put(h, reply, sizeof(reply));
+		return;
+	}
+
+	if (in[2] != h->ld_expect ||
+	    (in[1] != LOADER_OP_WRITE && in[1] != LOADER_OP_ZWRITE && in[1] != LOADER_OP_READ)) {
+		reply[0] = LOADER_NACK;
+		reply[1] = h->ld_expect;
+		if (!h->ld_nacked)
+			mem_put(h, reply, sizeof(reply));
+		h->ld_nacked = 1;
+		h->ld_dropped++;
+		return;
+	}
+
+	if (in[1] == LOADER_OP_WRITE) {
+		memcpy(h->ld_page, &in[LOADER_HEAD], len);
+	} else if (in[1] == LOADER_OP_ZWRITE) {
+		n   = len < 4 ? 0 : mem_get_u32(&in[LOADER_HEAD]);
+		len = n == 0 || n > h->ld_max || n % 4 ? 0 :
+			lz4_decompress(&in[LOADER_HEAD + 4], len - 4, h->ld_page, n);
+		if (len == 0) {
+			reply[0] = LOADER_EDATA;
+			mem_put(h, reply, sizeof(reply));
+			h->ld_nacked = 0;
+			return;
+		}
+	}
+
+	/* outside the model's memory the real one would fault, say nothing */
+	if (!mem_address(h, address) || h->offset + len > h->size)
+		return;
+
+	if (in[1] != LOADER_OP_READ) {
+		for(i = 0; i < len; ++i)
+			if (h->target == h->flash)
+				h->target[h->offset + i] &= h->ld_page[i];
+			else
+				h->target[h->offset + i]  = h->ld_page[i];
+		ok = memcmp(&h->target[h->offset], h->ld_page, len) == 0;
+		reply[0] = ok ? LOADER_ACK : LOADER_EFLASH;
+		mem_put(h, reply, sizeof(reply));
+		/* the failed frame stays the one expected */
+		if (!ok) {
+			h->ld_nacked = 0;
+			return;
+		}
+	} else {
+		uint8_t crc[LOADER_CRC];
+
+		reply[0] = LOADER_ACK;
+		mem_put(h, reply, sizeof(reply));
+		mem_put(h, &h->target[h->offset], len);
+		mem_put_u32(crc, crc32_stm32(0xFFFFFFFF, &h->target[h->offset], len));
+		mem_put(h, crc, sizeof(crc));
+	}
+	h->ld_expect++;
+	h->ld_nacked = 0;
+	h->ld_done++;
+}
+
+/* bytes the current state needs before it can run */
+static unsigned int mem_need(const mem_t *h) {
+	unsigned int n;
+
+	switch(h->state) {
+		case MEM_SYNC   : return 1;
+		case MEM_CMD    : return h->in_len > 0 && h->in[0] == 0x7F ? 1 : 2;
+		case MEM_ADDR   : return 5;
+		case MEM_RM_LEN : return 2;
+		case MEM_WM_DATA: return h->in_len < 1 ? 1 : h->in[0] + 3;
+		case MEM_ER     :
+			if (h->in_len < 1) return 1;
+			return h->in[0] == 0xFF ? 2 : h->in[0] + 3;
+		case MEM_EE     :
+			if (h->in_len < 2) return 2;
+			n = (h->in[0] << 8) | h->in[1];
+			return n >= 0xFFF0 ? 3 : 2 * (n + 1) + 3;
+		case MEM_LOADER :
+			if (h->in[0] != LOADER_SYNC) return 1;
+			if (h->in_len < LOADER_HEAD) return LOADER_HEAD;
+			/* a bad header is dropped whole */
+			n = mem_get_u32(&h->in[8]);
+			if (mem_xor(h->in, LOADER_HEAD) != 0 || n > h->ld_max || n % 4) return LOADER_HEAD;
+			return LOADER_HEAD + (h->in[1] == LOADER_OP_WRITE || h->in[1] == LOADER_OP_ZWRITE ? n : 0) + LOADER_CRC;
+	}
+	return 1;
+}
+
+/* run the state machine over one complete unit of input */
+static void mem_step(mem_t *h) {
+	const uint8_t *in = h->in;
+	unsigned int i, n;
+	uint32_t address;
+
+	switch(h->state) {
+		case MEM_SYNC:
+			if (in[0] == 0x7F) {
+				mem_put_byte(h, MEM_ACK);
+				h->state = MEM_CMD;
+			}
+			break;
+
+		case MEM_CMD:
+			/* a repeated sync is refused straight away */
+			if (in[0] == 0x7F || (in[0] ^ in[1]) != 0xFF) {
+				mem_put_byte(h, MEM_NACK);
+				break;
+			}
+			mem_command(h, in[0]);
+			break;
+
+		case MEM_ADDR:
+			h->state = MEM_CMD;
+			address  = (in[0] << 24) | (in[1] << 16) | (in[2] << 8) | in[3];
+			if (mem_xor(in, 5) != 0 || !mem_address(h, address)) {
+				mem_put_byte(h, MEM_NACK);
+				break;
+			}
+			mem_put_byte(h, MEM_ACK);
+
+			     if (h->cmd == 0x21) mem_applet(h, address);
+			else if (h->cmd == 0x11) h->state = MEM_RM_LEN;
+			else                     h->state = MEM_WM_DATA;
+			break;
+
+		case MEM_RM_LEN:
+			h->state = MEM_CMD;
+			n = in[0] + 1;
+			if ((in[0] ^ in[1]) != 0xFF || h->offset + n > h->size) {
+				mem_put_byte(h, MEM_NACK);
+				break;
+			}
+			mem_put_byte(h, MEM_ACK);
+			mem_put(h, &h->target[h->offset], n);
+			break;
+
+		case MEM_WM_DATA:
+			h->state = MEM_CMD;
+			n = in[0] + 1;
+			if (mem_xor(in, n + 2) != 0 || h->offset + n > h->size) {
+				mem_put_byte(h, MEM_NACK);
+				break;
+			}
+			/* flash can only clear bits, RAM takes the data as is */
+			for(i = 0; i < n; ++i)
+				if (h->target == h->flash)
+					h->target[h->offset + i] &= in[1 + i];
+				else
+					h->target[h->offset + i]  = in[1 + i];
+			mem_done(h);
+			break;
+
+		case MEM_ER:
+			h->state = MEM_CMD;
+			if (in[0] == 0xFF) {
+				if (in[1] != 0x00) {
+					mem_put_byte(h, MEM_NACK);
+					break;
+				}
+				memset(h->flash, 0xFF, MEM_FL_SIZE);
+				mem_put_byte(h, MEM_ACK);
+				break;
+			}
+			n = in[0] + 1;
+			if (mem_xor(in, n + 2) != 0) {
+				mem_put_byte(h, MEM_NACK);
+				break;
+			}
+			for(i = 0; i < n; ++i)
+				mem_erase(h, in[1 + i]);
+			mem_put_byte(h, MEM_ACK);
+			break;
+
+		case MEM_EE:
+			h->state = MEM_CMD;
+			n = (in[0] << 8) | in[1];
+			if (n >= 0xFFF0) {
+				memset(h->flash, 0xFF, MEM_FL_SIZE);
+				mem_done(h);
+				break;
+			}
+			if (mem_xor(in, 2 * (n + 1) + 3) != 0) {
+				mem_put_byte(h, MEM_NACK);
+				break;
+			}
+			for(i = 0; i <= n; ++i)
+				mem_erase(h, (in[2 + 2 * i] << 8) | in[3 + 2 * i]);
+			mem_done(h);
+			break;
+
+		case MEM_LOADER:
+			mem_loader(h);
+			break;
+	}
+}
+
+void* mem_open(const char *device) {
+	mem_t *h = calloc(sizeof(mem_t), 1);
+	if (!h)
+		return NULL;
+
+	device += strlen(SERIAL_MEM.prefix);
+	h->extended  = strcmp(device, "ext") == 0;
+	h->nostretch = strcmp(device, "ns" ) == 0;
+	memset(h->flash, 0xFF, MEM_FL_SIZE);
+	return h;
+}
+
+void mem_close(void *port) {
+	free(port);
+}
+
+void mem_flush(void *port) {
+	mem_t *h = port;
+	h->out_head = h->out_tail = 0;
+}
+
+serial_err_t mem_set_line(void *port, unsigned int baud, serial_bits_t bits, serial_parity_t parity, serial_stopbit_t stopbit, unsigned int *speed) {
+	*speed = baud;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t mem_write(void *port, const void *buffer, unsigned int len) {
+	mem_t *h = port;
+	const uint8_t *pos = buffer;
+	unsigned int need;
+
+	while(len > 0) {
+		h->in[h->in_len++] = *pos++;
+		--len;
+
+		need = mem_need(h);
+		if (h->in_len >= need || h->in_len == MEM_IN_SIZE) {
+			mem_step(h);
+			h->in_len = 0;
+		}
+	}
+
+	return SERIAL_ERR_OK;
+}
+
+/* the reply is complete as soon as the write returns, nothing to wait for */
+int mem_read(void *port, void *buffer, unsigned int len, uint64_t deadline) {
+	mem_t *h = port;
+	unsigned int avail = h->out_head - h->out_tail;
+
+	if (len > avail)
+		len = avail;
+	memcpy(buffer, &h->out[h->out_tail], len);
+	h->out_tail += len;
+	return len;
+}
+
+serial_err_t mem_set_modem(void *port, int lines, int level) {
+	return SERIAL_ERR_OK;
+}
+
+serial_ops_t SERIAL_MEM = {
+	"mem",
+	"mem:",
+	mem_open,
+	mem_close,
+	mem_flush,
+	mem_set_line,
+	mem_write,
+	mem_read,
+	mem_set_modem,
+	NULL
+};
@@ -23,25 +23,102 @@
 #include <unistd.h>
 #include <termios.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <poll.h>
+#include <time.h>
+#include <errno.h>
 #include <sys/ioctl.h>
+#include <limits.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 
 #include "serial.h"
 
-struct serial {
+#if defined(__linux__) && defined(TCGETS2)
+/*
+	rates without a Bxxx constant are set through termios2 and BOTHER.
+	<asm/termbits.h> clashes with glibc's <termios.h>, so the generic
+	kernel layout is mirrored here.
+*/
+#define SERIAL_BOTHER
+#ifndef BOTHER
+#define BOTHER	0010000
+#endif
+#ifndef IBSHIFT
+#define IBSHIFT	16
+#endif
+
+struct termios2 {
+	tcflag_t	c_iflag;
+	tcflag_t	c_oflag;
+	tcflag_t	c_cflag;
+	tcflag_t	c_lflag;
+	cc_t		c_line;
+	cc_t		c_cc[19];
+	speed_t		c_ispeed;
+	speed_t		c_ospeed;
+};
+#endif
+
+typedef struct {
 	int			fd;
 	struct termios		oldtio;
 	struct termios		newtio;
 
-	char			configured;
-	serial_baud_t		baud;
-	serial_bits_t		bits;
-	serial_parity_t		parity;
-	serial_stopbit_t	stopbit;
-};
+	char			sysfs[PATH_MAX];	/* the tty's device directory, empty if none */
+	unsigned int		old_latency;		/* latency timer to put back, 0 if untouched */
+} tty_t;
+
+#ifdef __linux__
+/* find /sys/class/tty/<name>/device, following any /dev symlinks first */
+static void tty_find_sysfs(tty_t *h, const char *device) {
+	char real[PATH_MAX], path[PATH_MAX + 32];
+	const char *name;
+
+	h->sysfs[0] = 0;
+	if (!realpath(device, real))
+		return;
+	name = strrchr(real, '/');
+	name = name ? name + 1 : real;
+
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/device", name);
+	if (!realpath(path, h->sysfs))
+		h->sysfs[0] = 0;
+}
 
-serial_t* serial_open(const char *device) {
-	serial_t *h = calloc(sizeof(serial_t), 1);
+static char tty_sysfs_read(const char *dir, const char *file, unsigned int *value, int base) {
+	char path[PATH_MAX + 32], buf[32];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if (!(f = fopen(path, "r")))
+		return 0;
+	if (!fgets(buf, sizeof(buf), f)) {
+		fclose(f);
+		return 0;
+	}
+	fclose(f);
+	*value = strtoul(buf, NULL, base);
+	return 1;
+}
+
+static char tty_sysfs_write(const char *dir, const char *file, unsigned int value) {
+	char path[PATH_MAX + 32];
+	FILE *f;
+	char ok;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, file);
+	if (!(f = fopen(path, "w")))
+		return 0;
+	ok = fprintf(f, "%u", value) > 0;
+	return fclose(f) == 0 && ok;
+}
+#endif
+
+void* tty_open(const char *device) {
+	tty_t *h = calloc(sizeof(tty_t), 1);
 
 	h->fd = open(device, O_RDWR | O_NOCTTY | O_NDELAY);
 	if (h->fd < 0) {
@@ -53,32 +130,64 @@ serial_t* serial_open(const char *device) {
 	tcgetattr(h->fd, &h->oldtio);
 	tcgetattr(h->fd, &h->newtio);
 
+#ifdef __linux__
+	tty_find_sysfs(h, device);
+#endif
 	return h;
 }
 
-void serial_close(serial_t *h) {
+void tty_flush(void *port) {
+	tty_t *h = port;
+	assert(h && h->fd > -1);
+	tcflush(h->fd, TCIFLUSH);
+}
+
+void tty_close(void *port) {
+	tty_t *h = port;
 	assert(h && h->fd > -1);
 
-	serial_flush(h);
 	tcsetattr(h->fd, TCSANOW, &h->oldtio);
 	close(h->fd);
+#ifdef __linux__
+	if (h->old_latency)
+		tty_sysfs_write(h->sysfs, "latency_timer", h->old_latency);
+#endif
 	free(h);
 }
 
-void serial_flush(const serial_t *h) {
-	assert(h && h->fd > -1);
-	tcflush(h->fd, TCIFLUSH);
+#ifdef SERIAL_BOTHER
+/* program any rate the driver will take, and read back what it chose */
+static serial_err_t tty_set_bother(tty_t *h, unsigned int baud, unsigned int *speed) {
+	struct termios2 tio;
+
+	if (ioctl(h->fd, TCGETS2, &tio) != 0)
+		return SERIAL_ERR_SYSTEM;
+
+	tio.c_cflag &= ~(CBAUD | (CBAUD << IBSHIFT));
+	tio.c_cflag |= BOTHER | (BOTHER << IBSHIFT);
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+	if (ioctl(h->fd, TCSETS2, &tio) != 0)
+		return SERIAL_ERR_INVALID_BAUD;
+
+	if (ioctl(h->fd, TCGETS2, &tio) != 0)
+		return SERIAL_ERR_SYSTEM;
+	*speed = tio.c_ospeed;
+	return SERIAL_ERR_OK;
 }
+#endif
 
-serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bits_t bits, const serial_parity_t parity, const serial_stopbit_t stopbit) {
+serial_err_t tty_set_line(void *port, unsigned int baud, serial_bits_t bits, serial_parity_t parity, serial_stopbit_t stopbit, unsigned int *speed) {
+	tty_t *h = port;
 	assert(h && h->fd > -1);
 
 	speed_t		port_baud;
 	tcflag_t	port_bits;
 	tcflag_t	port_parity;
 	tcflag_t	port_stop;
+	char		custom = 0;
 
-	switch(baud) {
+	switch(serial_get_baud(baud)) {
 		case SERIAL_BAUD_1200  : port_baud = B1200  ; break;
 		case SERIAL_BAUD_1800  : port_baud = B1800  ; break;
 		case SERIAL_BAUD_2400  : port_baud = B2400  ; break;
@@ -88,10 +197,27 @@ serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bi
 		case SERIAL_BAUD_38400 : port_baud = B38400 ; break;
 		case SERIAL_BAUD_57600 : port_baud = B57600 ; break;
 		case SERIAL_BAUD_115200: port_baud = B115200; break;
+#ifdef B230400
+		case SERIAL_BAUD_230400: port_baud = B230400; break;
+#endif
+#ifdef B460800
+		case SERIAL_BAUD_460800: port_baud = B460800; break;
+#endif
+#ifdef B921600
+		case SERIAL_BAUD_921600: port_baud = B921600; break;
+#endif
 
-		case SERIAL_BAUD_INVALID:
 		default:
+#ifdef SERIAL_BOTHER
+			/* base settings go in at 38400, then the rate is replaced */
+			if (baud == 0)
+				return SERIAL_ERR_INVALID_BAUD;
+			port_baud = B38400;
+			custom    = 1;
+			break;
+#else
 			return SERIAL_ERR_INVALID_BAUD;
+#endif
 	}
 
 	switch(bits) {
@@ -121,15 +247,6 @@ serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bi
 			return SERIAL_ERR_INVALID_STOPBIT;
 	}
 
-	/* if the port is already configured, no need to do anything */
-	if (
-		h->configured        &&
-		h->baud	   == baud   &&
-		h->bits	   == bits   &&
-		h->parity  == parity &&
-		h->stopbit == stopbit
-	) return SERIAL_ERR_OK;
-
 	/* reset the settings */
 	cfmakeraw(&h->newtio);
 	h->newtio.c_cflag &= ~(CSIZE | CRTSCTS);
@@ -147,13 +264,11 @@ serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bi
 		CLOCAL		|
 		CREAD;
 
+	/* reads never block, waiting is done with poll() against a deadline */
 	h->newtio.c_cc[VMIN ] = 0;
-	//h->newtio.c_cc[VTIME] = 30;
-	// Shorten timeout to 500mS second
-    h->newtio.c_cc[VTIME] = 5;
+	h->newtio.c_cc[VTIME] = 0;
 
 	/* set the settings */
-	serial_flush(h);
 	if (tcsetattr(h->fd, TCSANOW, &h->newtio) != 0)
 		return SERIAL_ERR_SYSTEM;
 
@@ -167,22 +282,35 @@ serial_err_t serial_setup(serial_t *h, const serial_baud_t baud, const serial_bi
 		settings.c_lflag != h->newtio.c_lflag
 	)	return SERIAL_ERR_UNKNOWN;
 
-	h->configured = 1;
-	h->baud	      = baud;
-	h->bits	      = bits;
-	h->parity     = parity;
-	h->stopbit    = stopbit;
+	if (custom) {
+#ifdef SERIAL_BOTHER
+		serial_err_t err = tty_set_bother(h, baud, speed);
+		if (err != SERIAL_ERR_OK)
+			return err;
+#endif
+	} else {
+		if (cfgetospeed(&settings) != port_baud)
+			return SERIAL_ERR_INVALID_BAUD;
+		*speed = baud;
+	}
+
+	/* the UART only copes with a few percent of error */
+	if (*speed < baud - baud / 32 || *speed > baud + baud / 32)
+		return SERIAL_ERR_INVALID_BAUD;
+
 	return SERIAL_ERR_OK;
 }
 
-serial_err_t serial_write(const serial_t *h, const void *buffer, unsigned int len) {
-	assert(h && h->fd > -1 && h->configured);
+serial_err_t tty_write(void *port, const void *buffer, unsigned int len) {
+	tty_t *h = port;
+	assert(h && h->fd > -1);
 
 	ssize_t r;
 	uint8_t *pos = (uint8_t*)buffer;
 
 	while(len > 0) {
 		r = write(h->fd, pos, len);
+		serial_syscalls++;
 		if (r < 1) return SERIAL_ERR_SYSTEM;
 
 		len -= r;
@@ -192,42 +320,77 @@ serial_err_t serial_write(const serial_t *h, const void *buffer, unsigned int le
 	return SERIAL_ERR_OK;
 }
 
-serial_err_t serial_read(const serial_t *h, const void *buffer, unsigned int len) {
-	assert(h && h->fd > -1 && h->configured);
+uint64_t serial_time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-	ssize_t r;
-	uint8_t *pos = (uint8_t*)buffer;
+/* wait for input until the deadline, then take everything queued in one read */
+int tty_read(void *port, void *buffer, unsigned int len, uint64_t deadline) {
+	tty_t *h = port;
+	assert(h && h->fd > -1);
 
-	while(len > 0) {
-		r = read(h->fd, pos, len);
-		      if (r == 0) return SERIAL_ERR_NODATA;
-		else  if (r <  0) return SERIAL_ERR_SYSTEM;
+	struct pollfd pfd;
+	uint64_t now;
+	ssize_t r;
 
-		len -= r;
-		pos += r;
+	pfd.fd     = h->fd;
+	pfd.events = POLLIN;
+
+	for(;;) {
+		now = serial_time_us();
+		if (now >= deadline)
+			return 0;
+
+		/* round up so we never spin on a sub-millisecond remainder */
+		r = poll(&pfd, 1, (deadline - now + 999) / 1000);
+		serial_syscalls++;
+		if (r < 0 && errno != EINTR)
+			return -1;
+		if (r <= 0)
+			continue;
+
+		r = read(h->fd, buffer, len);
+		serial_syscalls++;
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+
+		/* readable but empty means the line went away */
+		return r > 0 ? r : -1;
 	}
-
-	return SERIAL_ERR_OK;
 }
 
-const char* serial_get_setup_str(const serial_t *h) {
-	static char str[11];
-	if (!h->configured)
-		snprintf(str, sizeof(str), "INVALID");
-	else
-		snprintf(str, sizeof(str), "%u %d%c%d",
-			serial_get_baud_int   (h->baud   ),
-			serial_get_bits_int   (h->bits   ),
-			serial_get_parity_str (h->parity ),
-			serial_get_stopbit_int(h->stopbit)
-		);
+/*
+	tcdrain() can block for as long as the driver likes, so poll the
+	output queue instead.  USB adapters only count what the driver
+	still holds, not what sits in the adapter's own FIFO.
+*/
+serial_err_t tty_drain(void *port, uint64_t deadline) {
+	tty_t *h = port;
+	assert(h && h->fd > -1);
 
-	return str;
+	int queued;
+
+	for(;;) {
+		if (ioctl(h->fd, TIOCOUTQ, &queued) != 0)
+			return SERIAL_ERR_SYSTEM;
+		serial_syscalls++;
+		if (queued == 0)
+			return SERIAL_ERR_OK;
+		if (serial_time_us() >= deadline)
+			return SERIAL_ERR_NODATA;
+		usleep(1000);
+	}
 }
 
-int serial_set_rts(serial_t *h, int level)
+serial_err_t tty_set_modem(void *port, int lines, int level)
 {
-    int status;
+    tty_t *h = port;
+    int status, bits = 0;
+
+    if (lines & SERIAL_MODEM_RTS) bits |= TIOCM_RTS;
+    if (lines & SERIAL_MODEM_DTR) bits |= TIOCM_DTR;
 
     if (ioctl(h->fd, TIOCMGET, &status) == -1) {
         perror("setRTS(): TIOCMGET");
@@ -235,9 +398,9 @@ int serial_set_rts(serial_t *h, int level)
         }
         
     if (level)
-        status |= TIOCM_RTS;
+        status |= bits;
     else
-        status &= ~TIOCM_RTS;
+        status &= ~bits;
         
     if (ioctl(h->fd, TIOCMSET, &status) == -1) {
         perror("setRTS(): TIOCMSET");
@@ -247,3 +410,79 @@ int serial_set_rts(serial_t *h, int level)
     return SERIAL_ERR_OK;
 }
 
+/* the USB device is the first parent of the interface with an idVendor */
+char tty_usb_id(void *port, uint16_t *vid, uint16_t *pid) {
+#ifdef __linux__
+	tty_t *h = port;
+	char dir[PATH_MAX], *slash;
+	unsigned int v, p;
+
+	snprintf(dir, sizeof(dir), "%s", h->sysfs);
+	while(dir[0]) {
+		if (tty_sysfs_read(dir, "idVendor" , &v, 16) &&
+		    tty_sysfs_read(dir, "idProduct", &p, 16)) {
+			*vid = v;
+			*pid = p;
+			return 1;
+		}
+
+		slash = strrchr(dir, '/');
+		if (!slash || slash == dir)
+			break;
+		*slash = 0;
+	}
+#endif
+	return 0;
+}
+
+serial_err_t tty_tune(void *port, const serial_profile_t *profile) {
+#ifdef __linux__
+	tty_t *h = port;
+	struct serial_struct ss;
+	unsigned int latency;
+	serial_err_t err = SERIAL_ERR_OK;
+
+	/* usb-serial drivers that buffer expose their timer next to the tty */
+	if (profile->latency_timer && h->sysfs[0] &&
+	    tty_sysfs_read(h->sysfs, "latency_timer", &latency, 10) &&
+	    latency != profile->latency_timer) {
+		if (tty_sysfs_write(h->sysfs, "latency_timer", profile->latency_timer))
+			h->old_latency = latency;
+		else
+			err = SERIAL_ERR_SYSTEM;
+	}
+
+	if (profile->low_latency) {
+		if (ioctl(h->fd, TIOCGSERIAL, &ss) == 0) {
+			ss.flags |= ASYNC_LOW_LATENCY;
+			if (ioctl(h->fd, TIOCSSERIAL, &ss) != 0)
+				err = SERIAL_ERR_SYSTEM;
+		}
+	}
+
+	return err;
+#else
+	return SERIAL_ERR_OK;
+#endif
+}
+
+/* for transports layered over the tty, see serial_uring.c */
+int tty_fd(void *port) {
+	return ((tty_t*)port)->fd;
+}
+
+serial_ops_t SERIAL_TTY = {
+	"tty",
+	NULL,
+	tty_open,
+	tty_close,
+	tty_flush,
+	tty_set_line,
+	tty_write,
+	tty_read,
+	tty_set_modem,
+	NULL,
+	tty_usb_id,
+	tty_tune,
+	tty_drain
+};
@@ -0,0 +1,514 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	network transports for a serial port on another machine.
+
+	"tcp:host:port" is a raw socket (ser2net raw mode), the far end owns
+	the line settings so set_line and set_modem just accept them.
+
+	"rfc2217:host:port" is telnet with the COM-PORT-OPTION, so baud,
+	parity, RTS and DTR follow serial_setup and serial_set_rts as they
+	would on a local tty.
+
+	Both turn Nagle off: a frame is written with one send() and the
+	bootloader will not answer until all of it has arrived, so holding
+	the tail back for an ACK costs a round trip per frame.
+*/
+
+#ifndef __WIN32__
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "serial.h"
+
+/* telnet, RFC 854 */
+#define TN_SE		240
+#define TN_SB		250
+#define TN_WILL		251
+#define TN_WONT		252
+#define TN_DO		253
+#define TN_DONT		254
+#define TN_IAC		255
+
+#define TN_OPT_BINARY	0
+#define TN_OPT_SGA	3
+#define TN_OPT_COMPORT	44
+
+/* COM-PORT-OPTION, RFC 2217, the server answers with cmd + 100 */
+#define CPO_SET_BAUDRATE	1
+#define CPO_SET_DATASIZE	2
+#define CPO_SET_PARITY		3
+#define CPO_SET_STOPSIZE	4
+#define CPO_SET_CONTROL		5
+#define CPO_PURGE_DATA		12
+#define CPO_REPLY		100
+
+#define CPO_PARITY_NONE		1
+#define CPO_PARITY_ODD		2
+#define CPO_PARITY_EVEN		3
+#define CPO_CONTROL_DTR_ON	8
+#define CPO_CONTROL_DTR_OFF	9
+#define CPO_CONTROL_RTS_ON	11
+#define CPO_CONTROL_RTS_OFF	12
+#define CPO_PURGE_RX		1
+
+/* how long set_line waits for the server to confirm the rate */
+#define RFC2217_TIMEOUT	1000000	/* us */
+
+typedef enum {
+	TN_DATA,
+	TN_CMD,		/* after IAC */
+	TN_OPT,		/* after IAC WILL/WONT/DO/DONT */
+	TN_SUB,		/* inside IAC SB */
+	TN_SUB_IAC	/* IAC inside IAC SB */
+} tn_state_t;
+
+typedef struct {
+	int		fd;
+	char		telnet;
+
+	/* telnet receive state, a sequence can straddle two reads */
+	tn_state_t	state;
+	uint8_t		verb;
+	uint8_t		sb[16];
+	unsigned int	sb_len;
+	uint32_t	reported_baud;
+} tcp_t;
+
+static int tcp_connect(const char *address) {
+	struct addrinfo hints, *res, *ai;
+	char host[256], *port;
+	int fd = -1, one = 1;
+
+	/* split "host:port" on the last colon */
+	snprintf(host, sizeof(host), "%s", address);
+	port = strrchr(host, ':');
+	if (!port || port == host) {
+		fprintf(stderr, "%s: expected host:port\n", address);
+		return -1;
+	}
+	*port++ = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &res) != 0)
+		return -1;
+
+	for(ai = res; ai; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		return -1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+static serial_err_t tcp_send(tcp_t *h, const uint8_t *pos, unsigned int len) {
+	ssize_t r;
+
+	while(len > 0) {
+		r = send(h->fd, pos, len, 0);
+		serial_syscalls++;
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 1) return SERIAL_ERR_SYSTEM;
+
+		len -= r;
+		pos += r;
+	}
+
+	return SERIAL_ERR_OK;
+}
+
+void* tcp_open(const char *device) {
+	tcp_t *h;
+	int fd;
+
+	fd = tcp_connect(device + strlen(SERIAL_TCP.prefix));
+	if (fd < 0)
+		return NULL;
+
+	h = calloc(sizeof(tcp_t), 1);
+	h->fd = fd;
+	return h;
+}
+
+void tcp_close(void *port) {
+	tcp_t *h = port;
+	assert(h && h->fd > -1);
+
+	close(h->fd);
+	free(h);
+}
+
+static unsigned int rfc2217_decode(tcp_t *h, uint8_t *buf, unsigned int len);
+
+/* drain whatever is already queued on the socket */
+static void tcp_drain(tcp_t *h) {
+	struct pollfd pfd;
+	uint8_t buf[256];
+	ssize_t r;
+
+	pfd.fd     = h->fd;
+	pfd.events = POLLIN;
+	while(poll(&pfd, 1, 0) > 0 && (r = recv(h->fd, buf, sizeof(buf), 0)) > 0)
+		/* the telnet layer still has to see its commands */
+		if (h->telnet)
+			rfc2217_decode(h, buf, r);
+}
+
+void tcp_flush(void *port) {
+	tcp_t *h = port;
+	assert(h && h->fd > -1);
+	tcp_drain(h);
+}
+
+serial_err_t tcp_set_line(void *port, unsigned int baud, serial_bits_t bits, serial_parity_t parity, serial_stopbit_t stopbit, unsigned int *speed) {
+	*speed = baud;
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t tcp_write(void *port, const void *buffer, unsigned int len) {
+	tcp_t *h = port;
+	assert(h && h->fd > -1);
+	return tcp_send(h, buffer, len);
+}
+
+/* wait for the socket until the deadline, 0 at the deadline, -1 on error */
+static int tcp_recv(tcp_t *h, uint8_t *buffer, unsigned int len, uint64_t deadline) {
+	struct pollfd pfd;
+	uint64_t now;
+	ssize_t r;
+
+	pfd.fd     = h->fd;
+	pfd.events = POLLIN;
+
+	for(;;) {
+		now = serial_time_us();
+		if (now >= deadline)
+			return 0;
+
+		r = poll(&pfd, 1, (deadline - now + 999) / 1000);
+		serial_syscalls++;
+		if (r < 0 && errno != EINTR)
+			return -1;
+		if (r <= 0)
+			continue;
+
+		r = recv(h->fd, buffer, len, 0);
+		serial_syscalls++;
+		if (r < 0 && errno == EINTR)
+			continue;
+
+#ifdef TCP_QUICKACK
+		/* ACK the reply now, the next frame should not wait on it */
+		if (r > 0) {
+			int one = 1;
+			setsockopt(h->fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+			serial_syscalls++;
+		}
+#endif
+
+		/* zero is the peer closing the connection */
+		return r > 0 ? r : -1;
+	}
+}
+
+int tcp_read(void *port, void *buffer, unsigned int len, uint64_t deadline) {
+	tcp_t *h = port;
+	assert(h && h->fd > -1);
+	return tcp_recv(h, buffer, len, deadline);
+}
+
+serial_err_t tcp_set_modem(void *port, int lines, int level) {
+	return SERIAL_ERR_OK;
+}
+
+serial_ops_t SERIAL_TCP = {
+	"tcp",
+	"tcp:",
+	tcp_open,
+	tcp_close,
+	tcp_flush,
+	tcp_set_line,
+	tcp_write,
+	tcp_read,
+	tcp_set_modem,
+	NULL
+};
+
+/*
+	RFC 2217
+*/
+
+static serial_err_t rfc2217_option(tcp_t *h, uint8_t verb, uint8_t option) {
+	const uint8_t buf[3] = {TN_IAC, verb, option};
+	return tcp_send(h, buf, sizeof(buf));
+}
+
+/* one COM-PORT-OPTION subnegotiation, values are sent MSB first */
+static serial_err_t rfc2217_command(tcp_t *h, uint8_t cmd, uint32_t value, unsigned int size) {
+	uint8_t buf[16];
+	unsigned int len = 0, i;
+	uint8_t b;
+
+	buf[len++] = TN_IAC;
+	buf[len++] = TN_SB;
+	buf[len++] = TN_OPT_COMPORT;
+	buf[len++] = cmd;
+	for(i = size; i > 0; --i) {
+		b = value >> (8 * (i - 1));
+		buf[len++] = b;
+		if (b == TN_IAC)
+			buf[len++] = TN_IAC;
+	}
+	buf[len++] = TN_IAC;
+	buf[len++] = TN_SE;
+	return tcp_send(h, buf, len);
+}
+
+static void rfc2217_subneg(tcp_t *h) {
+	const uint8_t *sb = h->sb;
+
+	if (h->sb_len >= 6 && sb[0] == TN_OPT_COMPORT && sb[1] == CPO_REPLY + CPO_SET_BAUDRATE)
+		h->reported_baud = (sb[2] << 24) | (sb[3] << 16) | (sb[4] << 8) | sb[5];
+}
+
+/* refuse anything the server offers beyond what was asked for */
+static void rfc2217_negotiate(tcp_t *h, uint8_t verb, uint8_t option) {
+	switch(verb) {
+		case TN_DO:
+			if (option != TN_OPT_BINARY && option != TN_OPT_COMPORT)
+				rfc2217_option(h, TN_WONT, option);
+			break;
+
+		case TN_WILL:
+			if (option != TN_OPT_BINARY && option != TN_OPT_SGA)
+				rfc2217_option(h, TN_DONT, option);
+			break;
+	}
+}
+
+/* strip the telnet layer in place, returns the data bytes left */
+static unsigned int rfc2217_decode(tcp_t *h, uint8_t *buf, unsigned int len) {
+	unsigned int i, out = 0;
+	uint8_t c;
+
+	for(i = 0; i < len; ++i) {
+		c = buf[i];
+		switch(h->state) {
+			case TN_DATA:
+				if (c == TN_IAC) h->state = TN_CMD;
+				else             buf[out++] = c;
+				break;
+
+			case TN_CMD:
+				h->state = TN_DATA;
+				     if (c == TN_IAC) buf[out++] = c;
+				else if (c == TN_SB ) { h->state = TN_SUB; h->sb_len = 0; }
+				else if (c >= TN_WILL) { h->state = TN_OPT; h->verb = c; }
+				break;
+
+			case TN_OPT:
+				h->state = TN_DATA;
+				rfc2217_negotiate(h, h->verb, c);
+				break;
+
+			case TN_SUB:
+				if (c == TN_IAC) h->state = TN_SUB_IAC;
+				else if (h->sb_len < sizeof(h->sb)) h->sb[h->sb_len++] = c;
+				break;
+
+			case TN_SUB_IAC:
+				if (c == TN_SE) {
+					h->state = TN_DATA;
+					rfc2217_subneg(h);
+					break;
+				}
+				h->state = TN_SUB;
+				if (h->sb_len < sizeof(h->sb)) h->sb[h->sb_len++] = c;
+				break;
+		}
+	}
+
+	return out;
+}
+
+void* rfc2217_open(const char *device) {
+	tcp_t *h;
+	int fd;
+
+	fd = tcp_connect(device + strlen(SERIAL_RFC2217.prefix));
+	if (fd < 0)
+		return NULL;
+
+	h = calloc(sizeof(tcp_t), 1);
+	h->fd     = fd;
+	h->telnet = 1;
+
+	/* 8 bit clean both ways, and the port control option */
+	if (rfc2217_option(h, TN_WILL, TN_OPT_BINARY ) != SERIAL_ERR_OK ||
+	    rfc2217_option(h, TN_DO  , TN_OPT_BINARY ) != SERIAL_ERR_OK ||
+	    rfc2217_option(h, TN_WILL, TN_OPT_COMPORT) != SERIAL_ERR_OK) {
+		tcp_close(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+int rfc2217_read(void *port, void *buffer, unsigned int len, uint64_t deadline) {
+	tcp_t *h = port;
+	int r;
+
+	assert(h && h->fd > -1);
+
+	/* a read that was all telnet commands is not data, keep waiting */
+	do {
+		r = tcp_recv(h, buffer, len, deadline);
+		if (r > 0)
+			r = rfc2217_decode(h, buffer, r);
+	} while(r == 0 && serial_time_us() < deadline);
+
+	return r;
+}
+
+void rfc2217_flush(void *port) {
+	tcp_t *h = port;
+
+	assert(h && h->fd > -1);
+
+	/* drop what the server holds as well as what is in flight */
+	rfc2217_command(h, CPO_PURGE_DATA, CPO_PURGE_RX, 1);
+	tcp_drain(h);
+}
+
+serial_err_t rfc2217_set_line(void *port, unsigned int baud, serial_bits_t bits, serial_parity_t parity, serial_stopbit_t stopbit, unsigned int *speed) {
+	tcp_t *h = port;
+	uint8_t port_parity, buf[256];
+	uint64_t deadline;
+
+	assert(h && h->fd > -1);
+
+	if (baud == 0)
+		return SERIAL_ERR_INVALID_BAUD;
+
+	switch(parity) {
+		case SERIAL_PARITY_NONE: port_parity = CPO_PARITY_NONE; break;
+		case SERIAL_PARITY_EVEN: port_parity = CPO_PARITY_EVEN; break;
+		case SERIAL_PARITY_ODD : port_parity = CPO_PARITY_ODD ; break;
+
+		default:
+			return SERIAL_ERR_INVALID_PARITY;
+	}
+
+	h->reported_baud = 0;
+	if (rfc2217_command(h, CPO_SET_BAUDRATE, baud                          , 4) != SERIAL_ERR_OK ||
+	    rfc2217_command(h, CPO_SET_DATASIZE, serial_get_bits_int(bits)     , 1) != SERIAL_ERR_OK ||
+	    rfc2217_command(h, CPO_SET_PARITY  , port_parity                   , 1) != SERIAL_ERR_OK ||
+	    rfc2217_command(h, CPO_SET_STOPSIZE, serial_get_stopbit_int(stopbit), 1) != SERIAL_ERR_OK)
+		return SERIAL_ERR_SYSTEM;
+
+	/*
+		wait for the server to report the rate it set, input is being
+		flushed anyway.  Servers that never answer get the benefit of
+		the doubt.
+	*/
+	deadline = serial_time_us() + RFC2217_TIMEOUT;
+	while(!h->reported_baud && rfc2217_read(h, buf, sizeof(buf), deadline) >= 0 && serial_time_us() < deadline);
+
+	*speed = h->reported_baud ? h->reported_baud : baud;
+	if (*speed < baud - baud / 32 || *speed > baud + baud / 32)
+		return SERIAL_ERR_INVALID_BAUD;
+	return SERIAL_ERR_OK;
+}
+
+/* escape IAC in the data and send the frame as a single segment */
+serial_err_t rfc2217_write(void *port, const void *buffer, unsigned int len) {
+	tcp_t *h = port;
+	const uint8_t *pos = buffer;
+	uint8_t buf[1024];
+	unsigned int out;
+	serial_err_t err;
+
+	assert(h && h->fd > -1);
+
+	while(len > 0) {
+		for(out = 0; len > 0 && out < sizeof(buf) - 1; --len) {
+			if (*pos == TN_IAC)
+				buf[out++] = TN_IAC;
+			buf[out++] = *pos++;
+		}
+
+		err = tcp_send(h, buf, out);
+		if (err != SERIAL_ERR_OK)
+			return err;
+	}
+
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t rfc2217_set_modem(void *port, int lines, int level) {
+	tcp_t *h = port;
+	assert(h && h->fd > -1);
+
+	if ((lines & SERIAL_MODEM_RTS) &&
+	    rfc2217_command(h, CPO_SET_CONTROL, level ? CPO_CONTROL_RTS_ON : CPO_CONTROL_RTS_OFF, 1) != SERIAL_ERR_OK)
+		return SERIAL_ERR_SYSTEM;
+	if ((lines & SERIAL_MODEM_DTR) &&
+	    rfc2217_command(h, CPO_SET_CONTROL, level ? CPO_CONTROL_DTR_ON : CPO_CONTROL_DTR_OFF, 1) != SERIAL_ERR_OK)
+		return SERIAL_ERR_SYSTEM;
+
+	return SERIAL_ERR_OK;
+}
+
+serial_ops_t SERIAL_RFC2217 = {
+	"rfc2217",
+	"rfc2217:",
+	rfc2217_open,
+	tcp_close,
+	rfc2217_flush,
+	rfc2217_set_line,
+	rfc2217_write,
+	rfc2217_read,
+	rfc2217_set_modem,
+	NULL
+};
+
+#endif
@@ -0,0 +1,420 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	io_uring transport for Linux, device is "uring:/dev/ttyUSB0", built
+	with "make IOURING=1".
+
+	The line itself is the tty transport, this only replaces the data
+	path.  A queued frame is held until the read for its reply, then the
+	write, the read and a timeout for the deadline go in as one linked
+	chain and one io_uring_enter both submits them and waits for all
+	three completions.  A stop-and-wait ACK costs one system call
+	instead of write, poll and read.
+
+	The tty is switched to VMIN=1 so the read itself waits for the
+	first byte, the linked timeout cancels it at the deadline.
+
+	Talks to the kernel directly so no liburing is needed.
+*/
+
+#ifdef SERIAL_IOURING
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "serial.h"
+
+#define URING_ENTRIES	8
+
+/* largest frame held back for the next read, bigger ones go straight out */
+#define URING_QUEUE_SIZE	4096
+
+/* from serial_posix.c */
+int tty_fd(void *port);
+
+typedef struct {
+	void			*tty;
+	int			fd;
+
+	int			ring_fd;
+	void			*sq_ptr, *cq_ptr;
+	size_t			sq_size, cq_size, sqes_size;
+	unsigned		*sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned		*cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+
+	struct __kernel_timespec ts;
+
+	uint8_t			queued[URING_QUEUE_SIZE];
+	unsigned int		queued_len;
+} uring_t;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(uring_t *h, unsigned submit, unsigned wait) {
+	int r;
+
+	do {
+		serial_syscalls++;
+		r = syscall(__NR_io_uring_enter, h->ring_fd, submit, wait, IORING_ENTER_GETEVENTS, NULL, 0);
+	} while(r < 0 && errno == EINTR);
+
+	return r;
+}
+
+static char uring_map(uring_t *h) {
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(p));
+	h->ring_fd = uring_setup(URING_ENTRIES, &p);
+	if (h->ring_fd < 0)
+		return 0;
+
+	h->sq_size   = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	h->cq_size   = p.cq_off.cqes  + p.cq_entries * sizeof(struct io_uring_cqe);
+	h->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	/* newer kernels share one mapping for both rings */
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (h->cq_size > h->sq_size)
+			h->sq_size = h->cq_size;
+		h->cq_size = h->sq_size;
+	}
+
+	h->sq_ptr = mmap(NULL, h->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, h->ring_fd, IORING_OFF_SQ_RING);
+	if (h->sq_ptr == MAP_FAILED)
+		return 0;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		h->cq_ptr = h->sq_ptr;
+	else {
+		h->cq_ptr = mmap(NULL, h->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, h->ring_fd, IORING_OFF_CQ_RING);
+		if (h->cq_ptr == MAP_FAILED)
+			return 0;
+	}
+
+	h->sqes = mmap(NULL, h->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, h->ring_fd, IORING_OFF_SQES);
+	if (h->sqes == MAP_FAILED)
+		return 0;
+
+	h->sq_head  = (unsigned*)((char*)h->sq_ptr + p.sq_off.head        );
+	h->sq_tail  = (unsigned*)((char*)h->sq_ptr + p.sq_off.tail        );
+	h->sq_mask  = (unsigned*)((char*)h->sq_ptr + p.sq_off.ring_mask   );
+	h->sq_array = (unsigned*)((char*)h->sq_ptr + p.sq_off.array       );
+	h->cq_head  = (unsigned*)((char*)h->cq_ptr + p.cq_off.head        );
+	h->cq_tail  = (unsigned*)((char*)h->cq_ptr + p.cq_off.tail        );
+	h->cq_mask  = (unsigned*)((char*)h->cq_ptr + p.cq_off.ring_mask   );
+	h->cqes     = (struct io_uring_cqe*)((char*)h->cq_ptr + p.cq_off.cqes);
+	return 1;
+}
+
+static void uring_unmap(uring_t *h) {
+	if (h->sqes && h->sqes != MAP_FAILED)
+		munmap(h->sqes, h->sqes_size);
+	if (h->cq_ptr && h->cq_ptr != MAP_FAILED && h->cq_ptr != h->sq_ptr)
+		munmap(h->cq_ptr, h->cq_size);
+	if (h->sq_ptr && h->sq_ptr != MAP_FAILED)
+		munmap(h->sq_ptr, h->sq_size);
+	if (h->ring_fd > 0)
+		close(h->ring_fd);
+}
+
+/* the next free SQE, user_data says which completion is which */
+static struct io_uring_sqe* uring_sqe(uring_t *h, uint8_t opcode, uint8_t flags, uint64_t user_data) {
+	unsigned tail = *h->sq_tail;
+	unsigned index = tail & *h->sq_mask;
+	struct io_uring_sqe *sqe = &h->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode    = opcode;
+	sqe->flags     = flags;
+	sqe->user_data = user_data;
+	h->sq_array[index] = index;
+
+	__atomic_store_n(h->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+/* take one completion, the caller has already waited for it */
+static char uring_cqe(uring_t *h, uint64_t *user_data, int *res) {
+	unsigned head = *h->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(h->cq_tail, __ATOMIC_ACQUIRE))
+		return 0;
+
+	cqe = &h->cqes[head & *h->cq_mask];
+	*user_data = cqe->user_data;
+	*res       = cqe->res;
+	__atomic_store_n(h->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+enum {
+	URING_WRITE = 1,
+	URING_READ,
+	URING_TIMEOUT
+};
+
+/* write with plain syscalls, used when nothing follows to link to */
+static serial_err_t uring_write_now(uring_t *h, const uint8_t *pos, unsigned int len) {
+	ssize_t r;
+
+	while(len > 0) {
+		r = write(h->fd, pos, len);
+		serial_syscalls++;
+		if (r < 0 && errno == EINTR) continue;
+		if (r < 1) return SERIAL_ERR_SYSTEM;
+
+		len -= r;
+		pos += r;
+	}
+
+	return SERIAL_ERR_OK;
+}
+
+/* anything other than a read sends the held frame first */
+static serial_err_t uring_release(uring_t *h) {
+	serial_err_t err = SERIAL_ERR_OK;
+
+	if (h->queued_len) {
+		err = uring_write_now(h, h->queued, h->queued_len);
+		h->queued_len = 0;
+	}
+	return err;
+}
+
+void* uring_open(const char *device) {
+	uring_t *h = calloc(sizeof(uring_t), 1);
+
+	h->tty = SERIAL_TTY.open(device + strlen(SERIAL_URING.prefix));
+	if (!h->tty) {
+		free(h);
+		return NULL;
+	}
+	h->fd = tty_fd(h->tty);
+
+	if (!uring_map(h)) {
+		perror("io_uring");
+		uring_unmap(h);
+		SERIAL_TTY.close(h->tty);
+		free(h);
+		return NULL;
+	}
+
+	return h;
+}
+
+void uring_close(void *port) {
+	uring_t *h = port;
+
+	uring_release(h);
+	uring_unmap(h);
+	SERIAL_TTY.close(h->tty);
+	free(h);
+}
+
+void uring_flush(void *port) {
+	uring_t *h = port;
+
+	uring_release(h);
+	SERIAL_TTY.flush(h->tty);
+}
+
+serial_err_t uring_set_line(void *port, unsigned int baud, serial_bits_t bits, serial_parity_t parity, serial_stopbit_t stopbit, unsigned int *speed) {
+	uring_t *h = port;
+	struct termios tio;
+	serial_err_t err;
+
+	uring_release(h);
+	err = SERIAL_TTY.set_line(h->tty, baud, bits, parity, stopbit, speed);
+	if (err != SERIAL_ERR_OK)
+		return err;
+
+	/* let the read block for the first byte, the linked timeout ends it */
+	if (tcgetattr(h->fd, &tio) != 0)
+		return SERIAL_ERR_SYSTEM;
+	tio.c_cc[VMIN ] = 1;
+	tio.c_cc[VTIME] = 0;
+	if (tcsetattr(h->fd, TCSANOW, &tio) != 0)
+		return SERIAL_ERR_SYSTEM;
+
+	return SERIAL_ERR_OK;
+}
+
+serial_err_t uring_write(void *port, const void *buffer, unsigned int len) {
+	uring_t *h = port;
+
+	if (uring_release(h) != SERIAL_ERR_OK)
+		return SERIAL_ERR_SYSTEM;
+	return uring_write_now(h, buffer, len);
+}
+
+serial_err_t uring_queue(void *port, const void *buffer, unsigned int len) {
+	uring_t *h = port;
+
+	if (h->queued_len + len > URING_QUEUE_SIZE) {
+		if (uring_release(h) != SERIAL_ERR_OK)
+			return SERIAL_ERR_SYSTEM;
+		if (len > URING_QUEUE_SIZE)
+			return uring_write_now(h, buffer, len);
+	}
+
+	memcpy(&h->queued[h->queued_len], buffer, len);
+	h->queued_len += len;
+	return SERIAL_ERR_OK;
+}
+
+int uring_read(void *port, void *buffer, unsigned int len, uint64_t deadline) {
+	uring_t *h = port;
+	struct io_uring_sqe *sqe;
+	unsigned int submit, queued, i;
+	uint64_t now, user_data;
+	int res, written, got;
+
+	for(;;) {
+		now = serial_time_us();
+		if (now >= deadline) {
+			/* the frame still has to go, even if its reply can't be waited for */
+			uring_release(h);
+			return 0;
+		}
+
+		submit  = 0;
+		queued  = h->queued_len;
+		written = -1;
+		got     = -ECANCELED;
+
+		if (queued) {
+			sqe = uring_sqe(h, IORING_OP_WRITE, IOSQE_IO_LINK, URING_WRITE);
+			sqe->fd   = h->fd;
+			sqe->addr = (uintptr_t)h->queued;
+			sqe->len  = queued;
+			sqe->off  = -1;
+			++submit;
+		}
+
+		sqe = uring_sqe(h, IORING_OP_READ, IOSQE_IO_LINK, URING_READ);
+		sqe->fd   = h->fd;
+		sqe->addr = (uintptr_t)buffer;
+		sqe->len  = len;
+		sqe->off  = -1;
+		++submit;
+
+		h->ts.tv_sec  = (deadline - now) / 1000000;
+		h->ts.tv_nsec = (deadline - now) % 1000000 * 1000;
+		sqe = uring_sqe(h, IORING_OP_LINK_TIMEOUT, 0, URING_TIMEOUT);
+		sqe->addr = (uintptr_t)&h->ts;
+		sqe->len  = 1;
+		++submit;
+
+		/* submit the chain and wait for every part of it */
+		if (uring_enter(h, submit, submit) < 0)
+			return -1;
+
+		for(i = 0; i < submit; ) {
+			if (!uring_cqe(h, &user_data, &res)) {
+				if (uring_enter(h, 0, submit - i) < 0)
+					return -1;
+				continue;
+			}
+			++i;
+			     if (user_data == URING_WRITE) written = res;
+			else if (user_data == URING_READ ) got     = res;
+		}
+
+		if (queued) {
+			h->queued_len = 0;
+			if (written < 0)
+				return -1;
+
+			/* a short write breaks the chain, finish it by hand and read again */
+			if ((unsigned int)written < queued) {
+				if (uring_write_now(h, h->queued + written, queued - written) != SERIAL_ERR_OK)
+					return -1;
+				continue;
+			}
+		}
+
+		if (got > 0)
+			return got;
+		if (got == 0)
+			return -1;
+		if (got != -ECANCELED && got != -EINTR && got != -EAGAIN)
+			return -1;
+
+		/* cancelled by the timeout, the loop ends it at the deadline */
+	}
+}
+
+serial_err_t uring_set_modem(void *port, int lines, int level) {
+	uring_t *h = port;
+
+	uring_release(h);
+	return SERIAL_TTY.set_modem(h->tty, lines, level);
+}
+
+char uring_usb_id(void *port, uint16_t *vid, uint16_t *pid) {
+	uring_t *h = port;
+	return SERIAL_TTY.usb_id(h->tty, vid, pid);
+}
+
+serial_err_t uring_tune(void *port, const serial_profile_t *profile) {
+	uring_t *h = port;
+	return SERIAL_TTY.tune(h->tty, profile);
+}
+
+serial_err_t uring_drain(void *port, uint64_t deadline) {
+	uring_t *h = port;
+	serial_err_t err = uring_release(h);
+
+	if (err != SERIAL_ERR_OK)
+		return err;
+	return SERIAL_TTY.drain(h->tty, deadline);
+}
+
+serial_ops_t SERIAL_URING = {
+	"uring",
+	"uring:",
+	uring_open,
+	uring_close,
+	uring_flush,
+	uring_set_line,
+	uring_write,
+	uring_read,
+	uring_set_modem,
+	uring_queue,
+	uring_usb_id,
+	uring_tune,
+	uring_drain
+};
+
+#endif
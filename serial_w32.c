@@ -29,21 +29,15 @@
 
 #include "serial.h"
 
-struct serial {
+typedef struct {
 	HANDLE fd;
 	DCB oldtio;
 	DCB newtio;
+} w32_t;
 
-	char			configured;
-	serial_baud_t		baud;
-	serial_bits_t		bits;
-	serial_parity_t		parity;
-	serial_stopbit_t	stopbit;
-};
-
-serial_t* serial_open(const char *device) 
+void* w32_open(const char *device) 
 {
-	serial_t *h = calloc(sizeof(serial_t), 1);
+	w32_t *h = calloc(sizeof(w32_t), 1);
 
 	//COMMTIMEOUTS timeouts = {MAXDWORD, MAXDWORD, 3000, 0, 0};
     // shorter timeout
@@ -69,8 +63,10 @@ serial_t* serial_open(const char *device)
 	if (devName != device)
 		free(devName);
 	
-	if(h->fd == INVALID_HANDLE_VALUE) 
+	if(h->fd == INVALID_HANDLE_VALUE) {
+		free(h);
 		return NULL;
+	}
 
 	SetupComm(h->fd, 4096, 4096); /* Set input and output buffer size */
 
@@ -86,46 +82,38 @@ serial_t* serial_open(const char *device)
 	return h;
 }
 
-void serial_close(serial_t *h) 
+void w32_flush(void *port) 
 {
+	w32_t *h = port;
+	assert(h && (h->fd != INVALID_HANDLE_VALUE));
+	/* We shouldn't need to flush in non-overlapping (blocking) mode */
+	PurgeComm(h->fd, PURGE_RXABORT | PURGE_RXCLEAR | PURGE_TXABORT | PURGE_TXCLEAR);
+}
+
+void w32_close(void *port) 
+{
+	w32_t *h = port;
 	assert(h && h->fd != INVALID_HANDLE_VALUE);
 
-	serial_flush(h);
 	SetCommState(h->fd, &h->oldtio);
 	CloseHandle(h->fd);
 	free(h);
 }
 
-void serial_flush(const serial_t *h) 
-{
-	assert(h && (h->fd != INVALID_HANDLE_VALUE));
-	/* We shouldn't need to flush in non-overlapping (blocking) mode */
-	PurgeComm(h->fd, PURGE_RXABORT | PURGE_RXCLEAR | PURGE_TXABORT | PURGE_TXCLEAR);
-}
-
-serial_err_t serial_setup(serial_t *h, 
-			  const serial_baud_t baud, 
-			  const serial_bits_t bits, 
-			  const serial_parity_t parity, 
-			  const serial_stopbit_t stopbit) 
+serial_err_t w32_set_line(void *port, 
+			  unsigned int baud, 
+			  serial_bits_t bits, 
+			  serial_parity_t parity, 
+			  serial_stopbit_t stopbit,
+			  unsigned int *speed) 
 {
+	w32_t *h = port;
 	assert(h && h->fd != INVALID_HANDLE_VALUE);
 
-	switch(baud) {
-		case SERIAL_BAUD_1200  : h->newtio.BaudRate = CBR_1200  ; break;
-		//case SERIAL_BAUD_1800  : h->newtio.BaudRate = CBR_1800  ; break;
-		case SERIAL_BAUD_2400  : h->newtio.BaudRate = CBR_2400  ; break;
-		case SERIAL_BAUD_4800  : h->newtio.BaudRate = CBR_4800  ; break;
-		case SERIAL_BAUD_9600  : h->newtio.BaudRate = CBR_9600  ; break;
-		case SERIAL_BAUD_19200 : h->newtio.BaudRate = CBR_19200 ; break;
-		case SERIAL_BAUD_38400 : h->newtio.BaudRate = CBR_38400 ; break;
-		case SERIAL_BAUD_57600 : h->newtio.BaudRate = CBR_57600 ; break;
-		case SERIAL_BAUD_115200: h->newtio.BaudRate = CBR_115200; break;
-
-		case SERIAL_BAUD_INVALID:
-		default:
-			return SERIAL_ERR_INVALID_BAUD;
-	}
+	/* the DCB takes the rate as a plain integer, CBR_xxx are just names */
+	if (baud == 0)
+		return SERIAL_ERR_INVALID_BAUD;
+	h->newtio.BaudRate = baud;
 
 	switch(bits) {
 		case SERIAL_BITS_5: h->newtio.ByteSize = 5; break;
@@ -154,15 +142,6 @@ serial_err_t serial_setup(serial_t *h,
 			return SERIAL_ERR_INVALID_STOPBIT;
 	}
 
-	/* if the port is already configured, no need to do anything */
-	if (
-		h->configured        &&
-		h->baud	   == baud   &&
-		h->bits	   == bits   &&
-		h->parity  == parity &&
-		h->stopbit == stopbit
-	) return SERIAL_ERR_OK;
-
 	/* reset the settings */
 	h->newtio.fOutxCtsFlow = FALSE;
 	h->newtio.fOutxDsrFlow = FALSE;
@@ -172,26 +151,32 @@ serial_err_t serial_setup(serial_t *h,
 	h->newtio.fAbortOnError = 0;
 
 	/* set the settings */
-	serial_flush(h);
 	if (!SetCommState(h->fd, &h->newtio))
 		return SERIAL_ERR_SYSTEM;
 
-	h->configured = 1;
-	h->baud	      = baud;
-	h->bits	      = bits;
-	h->parity     = parity;
-	h->stopbit    = stopbit;
+	/* confirm the rate the driver settled on */
+	{
+		DCB settings;
+		if (!GetCommState(h->fd, &settings))
+			return SERIAL_ERR_SYSTEM;
+		*speed = settings.BaudRate;
+	}
+	if (*speed < baud - baud / 32 || *speed > baud + baud / 32)
+		return SERIAL_ERR_INVALID_BAUD;
+
 	return SERIAL_ERR_OK;
 }
 
-serial_err_t serial_write(const serial_t *h, const void *buffer, unsigned int len) 
+serial_err_t w32_write(void *port, const void *buffer, unsigned int len) 
 {
-	assert(h && (h->fd != INVALID_HANDLE_VALUE) && h->configured);
+	w32_t *h = port;
+	assert(h && (h->fd != INVALID_HANDLE_VALUE));
 
 	DWORD r;
 	uint8_t *pos = (uint8_t*)buffer;
 
 	while(len > 0) {
+		serial_syscalls++;
 		if(!WriteFile(h->fd, pos, len, &r, NULL))
 			return SERIAL_ERR_SYSTEM;
 		if (r < 1) return SERIAL_ERR_SYSTEM;
@@ -203,47 +188,52 @@ serial_err_t serial_write(const serial_t *h, const void *buffer, unsigned int le
 	return SERIAL_ERR_OK;
 }
 
-serial_err_t serial_read(const serial_t *h, const void *buffer, unsigned int len) 
+uint64_t serial_time_us(void)
 {
-	assert(h && (h->fd != INVALID_HANDLE_VALUE) && h->configured);
-
-	DWORD r;
-	uint8_t *pos = (uint8_t*)buffer;
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+
+	if (freq.QuadPart == 0)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 +
+		(uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+}
 
-	while(len > 0) {
-		ReadFile(h->fd, pos, len, &r, NULL);
-		      if (r == 0) return SERIAL_ERR_NODATA;
-		else  if (r <  0) return SERIAL_ERR_SYSTEM;
+int w32_read(void *port, void *buffer, unsigned int len, uint64_t deadline) 
+{
+	w32_t *h = port;
+	assert(h && (h->fd != INVALID_HANDLE_VALUE));
 
-		len -= r;
-		pos += r;
+	COMMTIMEOUTS timeouts = {MAXDWORD, MAXDWORD, 0, 0, 0};
+	DWORD r;
+	uint64_t now;
+
+	for(;;) {
+		now = serial_time_us();
+		if (now >= deadline)
+			return 0;
+
+		/* return as soon as anything arrives, or when the deadline passes */
+		timeouts.ReadTotalTimeoutConstant = (DWORD)((deadline - now + 999) / 1000);
+		SetCommTimeouts(h->fd, &timeouts);
+
+		serial_syscalls += 2;
+		if (!ReadFile(h->fd, buffer, len, &r, NULL))
+			return -1;
+		if (r > 0)
+			return r;
 	}
-
-	return SERIAL_ERR_OK;
 }
 
-const char* serial_get_setup_str(const serial_t *h) 
+serial_err_t w32_set_modem(void *port, int lines, int level)
 {
-	static char str[11];
-	if (!h->configured)
-		snprintf(str, sizeof(str), "INVALID");
-	else
-		snprintf(str, sizeof(str), "%u %d%c%d",
-			serial_get_baud_int   (h->baud   ),
-			serial_get_bits_int   (h->bits   ),
-			serial_get_parity_str (h->parity ),
-			serial_get_stopbit_int(h->stopbit)
-		);
-
-	return str;
-}
+    w32_t *h = port;
 
-int serial_set_rts(serial_t *h, int level)
-{
-    if (level)
-        h->newtio.fRtsControl = RTS_CONTROL_ENABLE;
-    else
-        h->newtio.fRtsControl = RTS_CONTROL_DISABLE;
+    if (lines & SERIAL_MODEM_RTS)
+        h->newtio.fRtsControl = level ? RTS_CONTROL_ENABLE : RTS_CONTROL_DISABLE;
+    if (lines & SERIAL_MODEM_DTR)
+        h->newtio.fDtrControl = level ? DTR_CONTROL_ENABLE : DTR_CONTROL_DISABLE;
         
 	if (!SetCommState(h->fd, &h->newtio))
 		return SERIAL_ERR_SYSTEM;
@@ -251,3 +241,36 @@ int serial_set_rts(serial_t *h, int level)
     return SERIAL_ERR_OK;
 }
 
+/* FlushFileBuffers() waits without a timeout, so poll the output queue */
+serial_err_t w32_drain(void *port, uint64_t deadline)
+{
+	w32_t *h = port;
+	COMSTAT stat;
+	DWORD errors;
+
+	for(;;) {
+		if (!ClearCommError(h->fd, &errors, &stat))
+			return SERIAL_ERR_SYSTEM;
+		if (stat.cbOutQue == 0)
+			return SERIAL_ERR_OK;
+		if (serial_time_us() >= deadline)
+			return SERIAL_ERR_NODATA;
+		Sleep(1);
+	}
+}
+
+serial_ops_t SERIAL_TTY = {
+	"tty",
+	NULL,
+	w32_open,
+	w32_close,
+	w32_flush,
+	w32_set_line,
+	w32_write,
+	w32_read,
+	w32_set_modem,
+	NULL,
+	NULL,
+	NULL,
+	w32_drain
+};
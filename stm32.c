@@ -20,28 +20,124 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "stm32.h"
 #include "utils.h"
 
 #define STM32_ACK	0x79
 #define STM32_NACK	0x1F
+#define STM32_BUSY	0x76	/* no-stretch commands, still working */
 #define STM32_CMD_INIT	0x7F
 #define STM32_CMD_GET	0x00	/* get the version and command supported */
+#define STM32_CMD_GVR	0x01	/* get version and read protection status */
+#define STM32_CMD_GID	0x02	/* get the device ID */
 
+/* BUSY replies accepted for one no-stretch command */
+#define STM32_BUSY_MAX	1000
+
+/* longest a CRC applet run may take, for up to STM32_CRC_PAGES pages, in us */
+#define STM32_CRC_TIMEOUT	2000000
+#define STM32_CRC_PAGES		1024
+
+/* pages sent in one erase command, a count byte of 0xFF is a mass erase to the original one */
+#define STM32_ER_CHUNK		256
+#define STM32_ER_CHUNK_LEGACY	255
+
+/* reply deadlines, in us */
+#define STM32_TIMEOUT			500000	/* fixed reads, and any class before its first sample */
+#define STM32_TIMEOUT_GRANULARITY	  2000
+#define STM32_BYTE_BITS			11	/* start, 8 data, parity, stop */
+
+/* recovery after a NACK or a missed reply */
+#define STM32_BACKOFF_MAX	500000	/* us, longest quiet wait before a resync */
+#define STM32_RESYNC_TRIES	8	/* probes before giving up on the device */
+#define STM32_DRAIN_MAX		1024	/* bytes discarded before the line counts as babbling */
+
+/*
+	largest frame, an extended erase of a full chunk: two byte count,
+	two bytes per page and checksum.  A write is only 1 + 256 + 3 + 1.
+*/
+#define STM32_FRAME_MAX	(2 + 2 * STM32_ER_CHUNK + 1)
+
+/*
+	what the bootloader offers: the opcodes its GET reply listed, and
+	the command picked from stm32_impls for each operation
+*/
 struct stm32_cmd {
-	uint8_t get;
-	uint8_t gvr;
-	uint8_t gid;
-	uint8_t rm;
-	uint8_t go;
-	uint8_t wm;
-	uint8_t er; /* this may be extended erase */
-//      uint8_t ee;
-	uint8_t wp;
-	uint8_t uw;
-	uint8_t rp;
-	uint8_t ur;
+	uint8_t			set[256 / 8];
+	const stm32_impl_t	*impl[STM32_CAP_COUNT];
+};
+
+/*
+	every command known for each operation, best first.  Extended erase
+	takes more pages per command and reaches past page 255.  The
+	no-stretch variants move the same bytes but have to be polled
+	through their BUSY replies, so over a UART they only win when the
+	stretching command is missing.
+*/
+const stm32_impl_t stm32_impls[] = {
+	{STM32_CAP_READ   , 0x11, 0x00, STM32_IMPL_DEFAULT                       , "read"                      },
+	{STM32_CAP_WRITE  , 0x31, 0x00, STM32_IMPL_DEFAULT                       , "write"                     },
+	{STM32_CAP_WRITE  , 0x32, 0x00, STM32_IMPL_NOSTRETCH                     , "no-stretch write"          },
+	{STM32_CAP_ERASE  , 0x44, 0x30, STM32_IMPL_EXTENDED                      , "extended erase"            },
+	{STM32_CAP_ERASE  , 0x45, 0x00, STM32_IMPL_EXTENDED | STM32_IMPL_NOSTRETCH, "no-stretch erase"          },
+	{STM32_CAP_ERASE  , 0x43, 0x00, STM32_IMPL_DEFAULT                       , "erase"                     },
+	{STM32_CAP_GO     , 0x21, 0x00, STM32_IMPL_DEFAULT                       , "go"                        },
+	{STM32_CAP_WUNPROT, 0x73, 0x00, STM32_IMPL_DEFAULT                       , "write unprotect"           },
+	{STM32_CAP_WUNPROT, 0x74, 0x00, STM32_IMPL_NOSTRETCH                     , "no-stretch write unprotect"},
+	{0}
+};
+
+/*
+	each protocol frame is assembled here and handed to the serial
+	layer in one write, rather than a write per byte
+*/
+struct stm32_frame {
+	uint8_t		data[STM32_FRAME_MAX];
+	unsigned int	len;
+	uint8_t		cs;
+	unsigned long	sent;
+};
+
+/*
+	per command class turnaround, the time the device and the adapter
+	add on top of moving the bytes over the wire.  Kept as a smoothed
+	mean and deviation in the same way TCP estimates its RTT.
+*/
+struct stm32_timeout {
+	uint32_t	srtt  [STM32_OP_COUNT];
+	uint32_t	rttvar[STM32_OP_COUNT];
+	unsigned long	samples[STM32_OP_COUNT];
+};
+
+/*
+	frame level recovery.  A failed transaction is sent again from its
+	command byte after the bootloader is back in its command state;
+	limit is the number of times that happens for one transaction.
+*/
+struct stm32_retry {
+	unsigned int	limit;
+	uint32_t	backoff;	/* us, doubles for each retry of a transaction */
+	unsigned long	retried;
+	unsigned long	resyncs;
+};
+
+/* first deadline and bounds per class, in us (erase page is per page) */
+const struct {
+	uint32_t initial, floor, ceiling;
+} stm32_timeout_seed[STM32_OP_COUNT] = {
+	/* GET     */ {STM32_TIMEOUT,    50000,   2000000},
+	/* RM      */ {STM32_TIMEOUT,    50000,   2000000},
+	/* WM      */ {STM32_TIMEOUT,    50000,   2000000},
+	/* ER page */ {        80000,    50000,    500000},
+	/* ER mass */ {     30000000, 30000000, 120000000},
+	/* GO      */ {STM32_TIMEOUT,    50000,   2000000},
+};
+
+/* the image in RAM, so an applet is only uploaded once */
+struct stm32_resident {
+	const stm32_applet_t	*applet;
 };
 
 /* device table */
@@ -58,65 +154,359 @@ const stm32_dev_t devices[] = {
 };
 
 /* internal functions */
-uint8_t stm32_gen_cs(const uint32_t v);
-void    stm32_send_byte(const stm32_t *stm, uint8_t byte);
-uint8_t stm32_read_byte(const stm32_t *stm);
-char    stm32_send_command(const stm32_t *stm, const uint8_t cmd);
+char    stm32_send_byte(const stm32_t *stm, uint8_t byte);
+char    stm32_send_command(const stm32_t *stm, const uint8_t cmd, const stm32_op_t op);
+uint32_t stm32_timeout(const stm32_t *stm, stm32_op_t op, unsigned int bytes, unsigned int units);
+void    stm32_timeout_sample(const stm32_t *stm, stm32_op_t op, uint32_t elapsed, unsigned int bytes, unsigned int units);
+void    stm32_timeout_backoff(const stm32_t *stm, stm32_op_t op);
+char    stm32_read_reply(const stm32_t *stm, stm32_op_t op, uint8_t data[], unsigned int len, unsigned int units);
+char    stm32_wait_ack(const stm32_t *stm, stm32_op_t op, unsigned int units);
+char    stm32_wait_done(const stm32_t *stm, stm32_cap_t cap, stm32_op_t op, unsigned int units);
+const stm32_impl_t* stm32_pick(const stm32_t *stm, stm32_cap_t cap);
+void    stm32_frame_begin(const stm32_t *stm);
+void    stm32_frame_put(const stm32_t *stm, const uint8_t *data, unsigned int len);
+void    stm32_frame_put_byte(const stm32_t *stm, uint8_t byte);
+void    stm32_frame_put_addr(const stm32_t *stm, uint32_t address);
+void    stm32_frame_put_cs(const stm32_t *stm);
+char    stm32_frame_send(const stm32_t *stm);
+char    stm32_erase_pages(const stm32_t *stm, unsigned int spage, unsigned int pages);
+unsigned int stm32_drain(const stm32_t *stm, uint32_t quiet);
+char    stm32_resync(const stm32_t *stm, uint32_t quiet);
+char    stm32_recover(const stm32_t *stm, unsigned int attempt);
+char    stm32_read_frame(const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len);
+char    stm32_write_frame(const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len);
+char    stm32_applet_wait(const stm32_t *stm, uint32_t timeout);
 
 /* stm32 programs */
 extern unsigned int	stmreset_length;
 extern unsigned char	stmreset_binary[];
+extern unsigned int	crc_length;
+extern unsigned char	crc_binary[];
+extern unsigned int	loader_length;
+extern unsigned char	loader_binary[];
+
+/* resets the device, so it never comes back to the mailbox */
+const stm32_applet_t stm32_applet_reset = {"reset", 0, stmreset_binary, &stmreset_length};
+const stm32_applet_t stm32_applet_crc   = {"crc", APPLET_ID_CRC, crc_binary, &crc_length};
+const stm32_applet_t stm32_applet_loader = {"loader", APPLET_ID_LOADER, loader_binary, &loader_length};
+
+char stm32_send_byte(const stm32_t *stm, uint8_t byte) {
+	if (serial_write(stm->serial, &byte, 1) != SERIAL_ERR_OK) {
+		perror("send_byte");
+		return 0;
+	}
+	return 1;
+}
 
-uint8_t stm32_gen_cs(const uint32_t v) {
-	return  ((v & 0xFF000000) >> 24) ^
-		((v & 0x00FF0000) >> 16) ^
-		((v & 0x0000FF00) >>  8) ^
-		((v & 0x000000FF) >>  0);
+/* time to clock the given number of bytes over the wire */
+uint32_t stm32_wire_time(const stm32_t *stm, unsigned int bytes) {
+	unsigned int baud = serial_get_speed(stm->serial);
+	if (baud == 0)
+		return 0;
+	return (uint64_t)bytes * STM32_BYTE_BITS * 1000000 / baud;
 }
 
-void stm32_send_byte(const stm32_t *stm, uint8_t byte) {	
-	serial_err_t err;
-	err = serial_write(stm->serial, &byte, 1);
-	if (err != SERIAL_ERR_OK) {
-		perror("send_byte");
-		assert(0);
+/* how long to wait for an exchange of this class moving this many bytes */
+uint32_t stm32_timeout(const stm32_t *stm, stm32_op_t op, unsigned int bytes, unsigned int units) {
+	const stm32_timeout_t *t = stm->timeout;
+	uint32_t rto;
+
+	if (t->samples[op] == 0) {
+		rto = stm32_timeout_seed[op].initial;
+	} else {
+		rto = 4 * t->rttvar[op];
+		if (rto < STM32_TIMEOUT_GRANULARITY)
+			rto = STM32_TIMEOUT_GRANULARITY;
+		rto += t->srtt[op];
+	}
+
+	if (rto < stm32_timeout_seed[op].floor  ) rto = stm32_timeout_seed[op].floor;
+	if (rto > stm32_timeout_seed[op].ceiling) rto = stm32_timeout_seed[op].ceiling;
+
+	return stm32_wire_time(stm, bytes) + rto * (units ? units : 1);
+}
+
+void stm32_timeout_sample(const stm32_t *stm, stm32_op_t op, uint32_t elapsed, unsigned int bytes, unsigned int units) {
+	stm32_timeout_t *t = stm->timeout;
+	uint32_t wire = stm32_wire_time(stm, bytes);
+	uint32_t r    = elapsed > wire ? elapsed - wire : 0;
+	uint32_t err;
+
+	if (units > 1)
+		r /= units;
+
+	if (t->samples[op]++ == 0) {
+		t->srtt  [op] = r;
+		t->rttvar[op] = r / 2;
+		return;
+	}
+
+	err = r > t->srtt[op] ? r - t->srtt[op] : t->srtt[op] - r;
+	t->rttvar[op] = (3 * t->rttvar[op] + err) / 4;
+	t->srtt  [op] = (7 * t->srtt  [op] + r  ) / 8;
+}
+
+/* a missed deadline widens the next one for that class */
+void stm32_timeout_backoff(const stm32_t *stm, stm32_op_t op) {
+	stm32_timeout_t *t = stm->timeout;
+	if (t->samples[op] != 0)
+		t->rttvar[op] = t->rttvar[op] * 2 + STM32_TIMEOUT_GRANULARITY;
+}
+
+uint32_t stm32_get_turnaround(const stm32_t *stm, stm32_op_t op) {
+	return stm->timeout->samples[op] ? stm->timeout->srtt[op] : 0;
+}
+
+/*
+	what one more write frame costs on top of its data, in bytes of wire
+	time: command, address and the length and checksum with their ACKs,
+	and a turnaround for each of the three
+*/
+unsigned int stm32_frame_cost(const stm32_t *stm) {
+	uint64_t turns = 2 * stm32_get_turnaround(stm, STM32_OP_GET) + stm32_get_turnaround(stm, STM32_OP_WM);
+	return 2 + 1 + 5 + 1 + 2 + 1 + turns * serial_get_speed(stm->serial) / (STM32_BYTE_BITS * 1000000);
+}
+
+/* wait for the reply to the frame just sent, and learn from how long it took */
+char stm32_read_reply(const stm32_t *stm, stm32_op_t op, uint8_t data[], unsigned int len, unsigned int units) {
+	uint64_t start = serial_time_us();
+	unsigned int bytes = stm->frame->len + len;
+
+	if (serial_read_deadline(stm->serial, data, len, start + stm32_timeout(stm, op, bytes, units)) != SERIAL_ERR_OK) {
+		stm32_timeout_backoff(stm, op);
+		return 0;
 	}
+
+	stm32_timeout_sample(stm, op, serial_time_us() - start, bytes, units);
+	return 1;
 }
 
-uint8_t stm32_read_byte(const stm32_t *stm) {
+char stm32_wait_ack(const stm32_t *stm, stm32_op_t op, unsigned int units) {
 	uint8_t byte;
-	serial_err_t err;
-	err = serial_read(stm->serial, &byte, 1);
-	if (err != SERIAL_ERR_OK) {
-		perror("read_byte");
-		assert(0);
+	if (!stm32_read_reply(stm, op, &byte, 1, units)) {
+		fprintf(stderr, "Timeout waiting for ACK from device\n");
+		return 0;
+	}
+	return byte == STM32_ACK;
+}
+
+/*
+	the final reply to the command picked for cap.  A no-stretch
+	command sends BUSY while it works, and each BUSY restarts the wait.
+*/
+char stm32_wait_done(const stm32_t *stm, stm32_cap_t cap, stm32_op_t op, unsigned int units) {
+	unsigned int polls;
+	uint8_t byte;
+
+	if (!(stm->cmd->impl[cap]->flags & STM32_IMPL_NOSTRETCH))
+		return stm32_wait_ack(stm, op, units);
+
+	for(polls = 0; polls < STM32_BUSY_MAX; ++polls) {
+		if (!stm32_read_reply(stm, op, &byte, 1, units)) {
+			fprintf(stderr, "Timeout waiting for ACK from device\n");
+			return 0;
+		}
+		if (byte != STM32_BUSY)
+			return byte == STM32_ACK;
+
+		/* the frame is out, later polls only wait on the device */
+		stm32_frame_begin(stm);
 	}
-	return byte;
+
+	fprintf(stderr, "Device stayed busy\n");
+	return 0;
+}
+
+void stm32_frame_begin(const stm32_t *stm) {
+	stm->frame->len = 0;
+	stm->frame->cs  = 0;
+}
+
+void stm32_frame_put(const stm32_t *stm, const uint8_t *data, unsigned int len) {
+	stm32_frame_t *f = stm->frame;
+	assert(f->len + len <= STM32_FRAME_MAX);
+
+	while(len-- > 0) {
+		f->cs ^= *data;
+		f->data[f->len++] = *data++;
+	}
+}
+
+void stm32_frame_put_byte(const stm32_t *stm, uint8_t byte) {
+	stm32_frame_put(stm, &byte, 1);
+}
+
+/* addresses always go out MSB first, whatever the host byte order */
+void stm32_frame_put_addr(const stm32_t *stm, uint32_t address) {
+	uint8_t b[4];
+	b[0] = address >> 24;
+	b[1] = address >> 16;
+	b[2] = address >>  8;
+	b[3] = address;
+	stm32_frame_put(stm, b, 4);
+}
+
+/* append the XOR of everything put so far */
+void stm32_frame_put_cs(const stm32_t *stm) {
+	stm32_frame_put_byte(stm, stm->frame->cs);
 }
 
-char stm32_send_command(const stm32_t *stm, const uint8_t cmd) {
-	stm32_send_byte(stm, cmd);
-	stm32_send_byte(stm, cmd ^ 0xFF);
-	if (stm32_read_byte(stm) != STM32_ACK) {
+char stm32_frame_send(const stm32_t *stm) {
+	stm32_frame_t *f = stm->frame;
+	/* every frame is answered, so let the transport pair it with the read */
+	if (serial_queue(stm->serial, f->data, f->len) != SERIAL_ERR_OK) {
+		perror("send_frame");
+		return 0;
+	}
+	f->sent++;
+	return 1;
+}
+
+unsigned long stm32_get_frames(const stm32_t *stm) {
+	return stm->frame->sent;
+}
+
+char stm32_send_command(const stm32_t *stm, const uint8_t cmd, const stm32_op_t op) {
+	stm32_frame_begin(stm);
+	stm32_frame_put_byte(stm, cmd);
+	stm32_frame_put_byte(stm, cmd ^ 0xFF);
+	if (!stm32_frame_send(stm))
+		return 0;
+	if (!stm32_wait_ack(stm, op, 1)) {
 		fprintf(stderr, "Error sending command 0x%02x to device\n", cmd);
 		return 0;
 	}
 	return 1;
 }
 
-stm32_t* stm32_init(const serial_t *serial, const char init) {
-	uint8_t      len;
+/* throw away whatever arrives until the line has been quiet this long */
+unsigned int stm32_drain(const stm32_t *stm, uint32_t quiet) {
+	unsigned int dropped = 0;
+	uint8_t byte;
+
+	serial_flush(stm->serial);
+	while(dropped < STM32_DRAIN_MAX &&
+	      serial_read_deadline(stm->serial, &byte, 1, serial_time_us() + quiet) == SERIAL_ERR_OK)
+		++dropped;
+	return dropped;
+}
+
+/*
+	get the bootloader back to its command state after a NACK or a
+	missed reply, when it may be part way through a frame.  Probe with
+	GET: from the command state it is answered with an ACK.  Otherwise
+	the probe bytes go into the pending frame, and the bootloader waits
+	for more or answers the frame.  A silent device is fed 0xFF, which
+	every frame accepts without harm: it completes a write with 0xFF
+	data and is never a valid erase count.  A NACK may mean a byte is
+	left over from a pair, and one more 0xFF pairs it off.
+*/
+char stm32_resync(const stm32_t *stm, uint32_t quiet) {
+	static const uint8_t get[2] = {STM32_CMD_GET, STM32_CMD_GET ^ 0xFF};
+	uint8_t fill[STM32_FRAME_MAX];
+	uint8_t byte;
+	unsigned int i;
+
+	stm->retry->resyncs++;
+	memset(fill, 0xFF, sizeof(fill));
+	for(i = 0; i < STM32_RESYNC_TRIES; ++i) {
+		stm32_drain(stm, quiet);
+		if (serial_write(stm->serial, get, sizeof(get)) != SERIAL_ERR_OK)
+			return 0;
+
+		if (serial_read_deadline(stm->serial, &byte, 1,
+		    serial_time_us() + stm32_timeout(stm, STM32_OP_GET, sizeof(get) + 1, 1)) != SERIAL_ERR_OK) {
+			if (serial_write(stm->serial, fill, sizeof(fill)) != SERIAL_ERR_OK)
+				return 0;
+			quiet += stm32_wire_time(stm, sizeof(fill));
+			continue;
+		}
+
+		if (byte == STM32_ACK) {
+			/* the rest of the GET reply */
+			stm32_drain(stm, quiet);
+			return 1;
+		}
+
+		if (serial_write(stm->serial, fill, 1) != SERIAL_ERR_OK)
+			return 0;
+	}
+
+	fprintf(stderr, "Lost sync with the bootloader\n");
+	return 0;
+}
+
+/* called after attempt number attempt failed, true if it is worth another */
+char stm32_recover(const stm32_t *stm, unsigned int attempt) {
+	stm32_retry_t *r = stm->retry;
+	uint32_t quiet;
+
+	if (attempt >= r->limit)
+		return 0;
+
+	quiet = r->backoff << (attempt < 16 ? attempt : 16);
+	if (quiet > STM32_BACKOFF_MAX)
+		quiet = STM32_BACKOFF_MAX;
+
+	r->retried++;
+	return stm32_resync(stm, quiet);
+}
+
+void stm32_set_retry(const stm32_t *stm, unsigned int limit, uint32_t backoff) {
+	stm->retry->limit   = limit;
+	stm->retry->backoff = backoff;
+}
+
+unsigned long stm32_get_retried(const stm32_t *stm) {
+	return stm->retry->retried;
+}
+
+unsigned long stm32_get_resyncs(const stm32_t *stm) {
+	return stm->retry->resyncs;
+}
+
+/* the best command for cap that this bootloader offers, or the default */
+const stm32_impl_t* stm32_pick(const stm32_t *stm, stm32_cap_t cap) {
+	const stm32_impl_t *impl, *fallback = NULL;
+
+	for(impl = stm32_impls; impl->name; ++impl) {
+		if (impl->cap != cap)
+			continue;
+		if (impl->flags & STM32_IMPL_DEFAULT)
+			fallback = impl;
+		if ((stm->cmd->set[impl->opcode / 8] & (1 << impl->opcode % 8)) &&
+		    stm->bl_version >= impl->bl_min)
+			return impl;
+	}
+	return fallback;
+}
+
+const stm32_impl_t* stm32_get_impl(const stm32_t *stm, stm32_cap_t cap) {
+	return stm->cmd->impl[cap];
+}
+
+stm32_t* stm32_init(serial_t *serial, const char init) {
+	unsigned int len, i;
 	stm32_t     *stm;
 	uint8_t      byte;
+	uint8_t      buf[258];
 	serial_err_t err;
+	stm32_cap_t  cap;
 
 	stm      = calloc(sizeof(stm32_t), 1);
 	stm->cmd = calloc(sizeof(stm32_cmd_t), 1);
+	stm->frame = calloc(sizeof(stm32_frame_t), 1);
+	stm->timeout = calloc(sizeof(stm32_timeout_t), 1);
+	stm->retry = calloc(sizeof(stm32_retry_t), 1);
+	stm->resident = calloc(sizeof(stm32_resident_t), 1);
 	stm->serial = serial;
 
 	if (init) {
         int   retry = 3;
-		stm32_send_byte(stm, STM32_CMD_INIT);
+		if (!stm32_send_byte(stm, STM32_CMD_INIT)) {
+			stm32_close(stm);
+			return NULL;
+		}
 		// There is a bug (?) in the PL2303 driver
 		// that stops the first transmit character from being sent
 		// If the serial port has even been opened and closed at least
@@ -127,7 +517,10 @@ stm32_t* stm32_init(const serial_t *serial, const char init) {
 
     	if (err != SERIAL_ERR_OK && (--retry > 0) ) {
 		    // Try again
-		    stm32_send_byte(stm, STM32_CMD_INIT);
+		    if (!stm32_send_byte(stm, STM32_CMD_INIT)) {
+			    stm32_close(stm);
+			    return NULL;
+		    }
 		
 		    err = serial_read(stm->serial, &byte, 1);
 		    
@@ -142,59 +535,58 @@ stm32_t* stm32_init(const serial_t *serial, const char init) {
 	}
 
 	/* get the bootloader information */
-	if (!stm32_send_command(stm, STM32_CMD_GET)) return 0;
-	len              = stm32_read_byte(stm) + 1;
-	stm->bl_version  = stm32_read_byte(stm); --len;
-	stm->cmd->get    = stm32_read_byte(stm); --len;
-	stm->cmd->gvr    = stm32_read_byte(stm); --len;
-	stm->cmd->gid    = stm32_read_byte(stm); --len;
-	stm->cmd->rm     = stm32_read_byte(stm); --len;
-	stm->cmd->go     = stm32_read_byte(stm); --len;
-	stm->cmd->wm     = stm32_read_byte(stm); --len;
-	stm->cmd->er     = stm32_read_byte(stm); --len;
-	stm->cmd->wp     = stm32_read_byte(stm); --len;
-	stm->cmd->uw     = stm32_read_byte(stm); --len;
-	stm->cmd->rp     = stm32_read_byte(stm); --len;
-	stm->cmd->ur     = stm32_read_byte(stm); --len;
-	if (len > 0) {
-		fprintf(stderr, "Seems this bootloader returns more then we understand in the GET command, we will skip the unknown bytes\n");
-		while(len-- > 0) stm32_read_byte(stm);
+	if (!stm32_send_command(stm, STM32_CMD_GET, STM32_OP_GET) ||
+	    !stm32_read_reply(stm, STM32_OP_GET, buf, 1, 1)) {
+		stm32_close(stm);
+		return NULL;
 	}
-	if (stm32_read_byte(stm) != STM32_ACK) {
+
+	/* version and command bytes, then the ACK */
+	len = buf[0] + 1;
+	if (!stm32_read_reply(stm, STM32_OP_GET, buf, len + 1, 1) || buf[len] != STM32_ACK) {
 		stm32_close(stm);
 		return NULL;
 	}
-	
-	/* get the version and read protection status  */
-	if (!stm32_send_command(stm, stm->cmd->gvr)) {
+	if (len < 2) {
 		stm32_close(stm);
+		fprintf(stderr, "Bootloader GET reply is too short\n");
 		return NULL;
 	}
 
-	stm->version = stm32_read_byte(stm);
-	stm->option1 = stm32_read_byte(stm);
-	stm->option2 = stm32_read_byte(stm);
-	if (stm32_read_byte(stm) != STM32_ACK) {
+	/* the commands come as a list, newer bootloaders add to it */
+	stm->bl_version = buf[0];
+	for(i = 1; i < len; ++i)
+		stm->cmd->set[buf[i] / 8] |= 1 << buf[i] % 8;
+	for(cap = 0; cap < STM32_CAP_COUNT; ++cap)
+		stm->cmd->impl[cap] = stm32_pick(stm, cap);
+
+	/* get the version and read protection status  */
+	if (!stm32_send_command(stm, STM32_CMD_GVR, STM32_OP_GET) ||
+	    !stm32_read_reply(stm, STM32_OP_GET, buf, 4, 1) || buf[3] != STM32_ACK) {
 		stm32_close(stm);
 		return NULL;
 	}
+	stm->version = buf[0];
+	stm->option1 = buf[1];
+	stm->option2 = buf[2];
 
 	/* get the device ID */
-	if (!stm32_send_command(stm, stm->cmd->gid)) {
+	if (!stm32_send_command(stm, STM32_CMD_GID, STM32_OP_GET) ||
+	    !stm32_read_reply(stm, STM32_OP_GET, buf, 1, 1)) {
 		stm32_close(stm);
 		return NULL;
 	}
-	len = stm32_read_byte(stm) + 1;
+	len = buf[0] + 1;
 	if (len != 2) {
 		stm32_close(stm);
 		fprintf(stderr, "More then two bytes sent in the PID, unknown/unsupported device\n");
 		return NULL;
 	}
-	stm->pid = (stm32_read_byte(stm) << 8) | stm32_read_byte(stm);
-	if (stm32_read_byte(stm) != STM32_ACK) {
+	if (!stm32_read_reply(stm, STM32_OP_GET, buf, 3, 1) || buf[2] != STM32_ACK) {
 		stm32_close(stm);
 		return NULL;
 	}
+	stm->pid = (buf[0] << 8) | buf[1];
 
 	stm->dev = devices;
 	while(stm->dev->id != 0x00 && stm->dev->id != stm->pid)
@@ -203,109 +595,195 @@ stm32_t* stm32_init(const serial_t *serial, const char init) {
 	return stm;
 }
 
+/* ask GET and GID again, the replies must match what stm32_init was told */
+char stm32_probe(const stm32_t *stm) {
+	unsigned int len, i;
+	uint8_t      buf[258];
+
+	if (!stm32_send_command(stm, STM32_CMD_GET, STM32_OP_GET) ||
+	    !stm32_read_reply(stm, STM32_OP_GET, buf, 1, 1))
+		return 0;
+	len = buf[0] + 1;
+	if (len < 2 ||
+	    !stm32_read_reply(stm, STM32_OP_GET, buf, len + 1, 1) || buf[len] != STM32_ACK ||
+	    buf[0] != stm->bl_version)
+		return 0;
+	for(i = 1; i < len; ++i)
+		if (!(stm->cmd->set[buf[i] / 8] & 1 << buf[i] % 8))
+			return 0;
+
+	if (!stm32_send_command(stm, STM32_CMD_GID, STM32_OP_GET) ||
+	    !stm32_read_reply(stm, STM32_OP_GET, buf, 1, 1) || buf[0] != 1 ||
+	    !stm32_read_reply(stm, STM32_OP_GET, buf, 3, 1) || buf[2] != STM32_ACK)
+		return 0;
+	return ((buf[0] << 8) | buf[1]) == stm->pid;
+}
+
 void stm32_close(stm32_t *stm) {
 	if (stm) free(stm->cmd);
+	if (stm) free(stm->frame);
+	if (stm) free(stm->timeout);
+	if (stm) free(stm->retry);
+	if (stm) free(stm->resident);
 	free(stm);
 }
 
 char stm32_read_memory(const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len) {
-	uint8_t cs;
-	unsigned int i;
+	unsigned int attempt;
 	assert(len > 0 && len < 257);
 
 	/* must be 32bit aligned */
 	assert(address % 4 == 0);
 
-	address = be_u32      (address);
-	cs      = stm32_gen_cs(address);
-
-	if (!stm32_send_command(stm, stm->cmd->rm)) return 0;
-	assert(serial_write(stm->serial, &address, 4) == SERIAL_ERR_OK);
-	stm32_send_byte(stm, cs);
-	if (stm32_read_byte(stm) != STM32_ACK) return 0;
+	for(attempt = 0; !stm32_read_frame(stm, address, data, len); ++attempt)
+		if (!stm32_recover(stm, attempt))
+			return 0;
+	return 1;
+}
 
-	i = len - 1;
-	stm32_send_byte(stm, i);
-	stm32_send_byte(stm, i ^ 0xFF);
-	if (stm32_read_byte(stm) != STM32_ACK) return 0;
+char stm32_read_frame(const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len) {
+	if (!stm32_send_command(stm, stm->cmd->impl[STM32_CAP_READ]->opcode, STM32_OP_GET)) return 0;
 
-	assert(serial_read(stm->serial, data, len) == SERIAL_ERR_OK);
-	return 1;
+	/* send the address and checksum */
+	stm32_frame_begin(stm);
+	stm32_frame_put_addr(stm, address);
+	stm32_frame_put_cs(stm);
+	if (!stm32_frame_send(stm)) return 0;
+	if (!stm32_wait_ack(stm, STM32_OP_GET, 1)) return 0;
+
+	/* send the length and its complement */
+	stm32_frame_begin(stm);
+	stm32_frame_put_byte(stm, len - 1);
+	stm32_frame_put_byte(stm, (len - 1) ^ 0xFF);
+	if (!stm32_frame_send(stm)) return 0;
+	if (!stm32_wait_ack(stm, STM32_OP_GET, 1)) return 0;
+
+	return stm32_read_reply(stm, STM32_OP_RM, data, len, 1);
 }
 
 char stm32_write_memory(const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len) {
-	uint8_t cs;
-	unsigned int i;
-	int c, extra;
+	const stm32_applet_t *resident = stm->resident->applet;
+	unsigned int attempt;
 	assert(len > 0 && len < 257);
 
 	/* must be 32bit aligned */
 	assert(address % 4 == 0);
 
-	address = be_u32      (address);
-	cs      = stm32_gen_cs(address);
+	/* anything written over the applet means it has to be sent again */
+	if (resident && address < APPLET_LOAD + *resident->length && address + len > APPLET_LOAD)
+		stm->resident->applet = NULL;
 
-	/* send the address and checksum */
-	if (!stm32_send_command(stm, stm->cmd->wm)) return 0;
-	assert(serial_write(stm->serial, &address, 4) == SERIAL_ERR_OK);
-	stm32_send_byte(stm, cs);
-	if (stm32_read_byte(stm) != STM32_ACK) return 0;
-
-	/* setup the cs and send the length */
-	extra = len % 4;
-	cs = len - 1 + extra;
-	stm32_send_byte(stm, cs);
-
-	/* write the data and build the checksum */
-	for(i = 0; i < len; ++i)
-		cs ^= data[i];
-
-	assert(serial_write(stm->serial, data, len) == SERIAL_ERR_OK);
-
-	/* write the alignment padding */
-	for(c = 0; c < extra; ++c) {
-		stm32_send_byte(stm, 0xFF);
-		cs ^= 0xFF;
-	}
+	for(attempt = 0; !stm32_write_frame(stm, address, data, len); ++attempt)
+		if (!stm32_recover(stm, attempt))
+			return 0;
+	return 1;
+}
 
-	/* send the checksum */
-	stm32_send_byte(stm, cs);
-	return stm32_read_byte(stm) == STM32_ACK;
+char stm32_write_frame(const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len) {
+	static const uint8_t pad[3] = {0xFF, 0xFF, 0xFF};
+	unsigned int extra;
+
+	if (!stm32_send_command(stm, stm->cmd->impl[STM32_CAP_WRITE]->opcode, STM32_OP_GET)) return 0;
+
+	/* send the address and checksum */
+	stm32_frame_begin(stm);
+	stm32_frame_put_addr(stm, address);
+	stm32_frame_put_cs(stm);
+	if (!stm32_frame_send(stm)) return 0;
+	if (!stm32_wait_ack(stm, STM32_OP_GET, 1)) return 0;
+
+	/* length, data, alignment padding and checksum go out as one frame */
+	extra = (4 - len % 4) % 4;
+	stm32_frame_begin(stm);
+	stm32_frame_put_byte(stm, len - 1 + extra);
+	stm32_frame_put(stm, data, len);
+	stm32_frame_put(stm, pad, extra);
+	stm32_frame_put_cs(stm);
+	if (!stm32_frame_send(stm)) return 0;
+	return stm32_wait_done(stm, STM32_CAP_WRITE, STM32_OP_WM, 1);
 }
 
 char stm32_wunprot_memory(const stm32_t *stm) {
-	if (!stm32_send_command(stm, stm->cmd->uw)) return 0;
-	if (!stm32_send_command(stm, 0x8C        )) return 0;
-	return 1;
+	if (!stm32_send_command(stm, stm->cmd->impl[STM32_CAP_WUNPROT]->opcode, STM32_OP_GET)) return 0;
+	return stm32_wait_done(stm, STM32_CAP_WUNPROT, STM32_OP_GET, 1);
 }
 
-char stm32_erase_memory(const stm32_t *stm, uint8_t pages) {
-	if (!stm32_send_command(stm, stm->cmd->er)) return 0;
-	if (pages == 0xFF) {
-		return stm32_send_command(stm, 0xFF);
-	} else {
-		uint8_t cs = 0;
-		uint8_t pg_num;
-		stm32_send_byte(stm, pages);
-		cs ^= pages;
-		for (pg_num = 0; pg_num <= pages; pg_num++) {
-			stm32_send_byte(stm, pg_num);
-			cs ^= pg_num;
+/* one erase command for up to STM32_ER_CHUNK pages starting at spage */
+char stm32_erase_pages(const stm32_t *stm, unsigned int spage, unsigned int pages) {
+	const stm32_impl_t *er = stm->cmd->impl[STM32_CAP_ERASE];
+	unsigned int pg_num;
+
+	if (!stm32_send_command(stm, er->opcode, STM32_OP_GET)) return 0;
+
+	stm32_frame_begin(stm);
+	if (er->flags & STM32_IMPL_EXTENDED) {
+		stm32_frame_put_byte(stm, (pages - 1) >> 8);
+		stm32_frame_put_byte(stm, (pages - 1) & 0xFF);
+		for (pg_num = spage; pg_num < spage + pages; pg_num++) {
+			stm32_frame_put_byte(stm, pg_num >> 8);
+			stm32_frame_put_byte(stm, pg_num & 0xFF);
 		}
-		stm32_send_byte(stm, cs);
-		return stm32_read_byte(stm) == STM32_ACK;
+	} else {
+		stm32_frame_put_byte(stm, pages - 1);
+		for (pg_num = spage; pg_num < spage + pages; pg_num++)
+			stm32_frame_put_byte(stm, pg_num);
 	}
+	stm32_frame_put_cs(stm);
+	if (!stm32_frame_send(stm)) return 0;
+	return stm32_wait_done(stm, STM32_CAP_ERASE, STM32_OP_ER_PAGE, pages);
+}
+
+char stm32_erase_memory(const stm32_t *stm, unsigned int spage, unsigned int pages) {
+	const stm32_impl_t *er = stm->cmd->impl[STM32_CAP_ERASE];
+	unsigned int n, chunk, attempt;
+
+	/* all of a 256 page flash is the mass erase the original command can't otherwise send */
+	if (!(er->flags & STM32_IMPL_EXTENDED) && spage == 0 && pages == 0x100 &&
+	    (stm->dev->fl_end - stm->dev->fl_start) / stm->dev->fl_ps == 0x100)
+		pages = STM32_MASS_ERASE;
+
+	if (pages == STM32_MASS_ERASE) {
+		if (!stm32_send_command(stm, er->opcode, STM32_OP_GET)) return 0;
+		/* 0xFF 0x00 for erase, 0xFFFF and its checksum for extended erase */
+		stm32_frame_begin(stm);
+		stm32_frame_put_byte(stm, 0xFF);
+		if (er->flags & STM32_IMPL_EXTENDED) {
+			stm32_frame_put_byte(stm, 0xFF);
+			stm32_frame_put_cs(stm);
+		} else
+			stm32_frame_put_byte(stm, 0x00);
+		if (!stm32_frame_send(stm)) return 0;
+		return stm32_wait_done(stm, STM32_CAP_ERASE, STM32_OP_ER_MASS, 1);
+	}
+
+	/* the original erase command only has a byte for the page number */
+	if (!(er->flags & STM32_IMPL_EXTENDED) && spage + pages > 0x100) {
+		fprintf(stderr, "Pages past 255 need the extended erase command, which this bootloader lacks\n");
+		return 0;
+	}
+
+	chunk = er->flags & STM32_IMPL_EXTENDED ? STM32_ER_CHUNK : STM32_ER_CHUNK_LEGACY;
+	while(pages > 0) {
+		n = pages > chunk ? chunk : pages;
+		for(attempt = 0; !stm32_erase_pages(stm, spage, n); ++attempt)
+			if (!stm32_recover(stm, attempt))
+				return 0;
+		spage += n;
+		pages -= n;
+	}
+	return 1;
 }
 
 char stm32_go(const stm32_t *stm, uint32_t address) {
-	uint8_t cs;
+	/* whatever runs now may use the RAM the applet was in */
+	stm->resident->applet = NULL;
 
-	address = be_u32      (address);
-	cs      = stm32_gen_cs(address);
+	if (!stm32_send_command(stm, stm->cmd->impl[STM32_CAP_GO]->opcode, STM32_OP_GO)) return 0;
 
-	if (!stm32_send_command(stm, stm->cmd->go)) return 0;
-	serial_write(stm->serial, &address, 4);
-	serial_write(stm->serial, &cs     , 1);
+	stm32_frame_begin(stm);
+	stm32_frame_put_addr(stm, address);
+	stm32_frame_put_cs(stm);
+	if (!stm32_frame_send(stm)) return 0;
 
     return 1;
 	// seems ACK is often not sent
@@ -318,13 +796,28 @@ char stm32_reset_device(const stm32_t *stm) {
 		upload the stmreset program into ram and run it, which
 		resets the device for us
 	*/
+	return stm32_applet_load(stm, &stm32_applet_reset) &&
+	       stm32_go(stm, APPLET_LOAD);
+}
+
+/* upload the applet to APPLET_LOAD, unless it is there already */
+char stm32_applet_load(const stm32_t *stm, const stm32_applet_t *applet) {
+	uint32_t length		= *applet->length;
+	const unsigned char* pos = applet->image;
+	uint32_t address	= APPLET_LOAD;
+
+	if (stm->resident->applet == applet)
+		return 1;
+
+	if (stm->dev->ram_start > APPLET_LOAD || stm->dev->ram_end < APPLET_STACK) {
+		fprintf(stderr, "The %s applet does not fit in the RAM this device leaves free\n", applet->name);
+		return 0;
+	}
+	assert(APPLET_LOAD + length <= APPLET_MAILBOX);
 
-	uint32_t length		= stmreset_length;
-	unsigned char* pos	= stmreset_binary;
-	uint32_t address	= stm->dev->ram_start;
 	while(length > 0) {
 		uint32_t w = length > 256 ? 256 : length;
-		if (!stm32_write_memory(stm, address, pos, w))
+		if (!stm32_write_memory(stm, address, (uint8_t*)pos, w))
 			return 0;
 
 		address	+= w;
@@ -332,6 +825,147 @@ char stm32_reset_device(const stm32_t *stm) {
 		length	-= w;
 	}
 
-	return stm32_go(stm, stm->dev->ram_start);
+	stm->resident->applet = applet;
+	return 1;
+}
+
+/*
+	the applet has the CPU until it jumps back into the bootloader,
+	which then waits for a fresh 0x7F to autobaud on.  Keep offering
+	one until it is answered: ACK from a bootloader that has just
+	started, NACK from one that never stopped.
+*/
+char stm32_applet_wait(const stm32_t *stm, uint32_t timeout) {
+	uint64_t end = serial_time_us() + timeout;
+	uint8_t byte;
+
+	/* the ACK to GO, when there is one */
+	stm32_drain(stm, stm32_timeout(stm, STM32_OP_GO, 0, 1));
+
+	do {
+		if (!stm32_send_byte(stm, STM32_CMD_INIT))
+			return 0;
+		if (serial_read_deadline(stm->serial, &byte, 1,
+		    serial_time_us() + stm32_timeout(stm, STM32_OP_GET, 1, 1)) == SERIAL_ERR_OK &&
+		    (byte == STM32_ACK || byte == STM32_NACK))
+			return 1;
+	} while(serial_time_us() < end);
+
+	fprintf(stderr, "Timeout waiting for the applet to return to the bootloader\n");
+	return 0;
+}
+
+/*
+	write the mailbox for an applet run on the arguments in mb and
+	start it.  The applet has the USART until it returns to the
+	bootloader, stm32_applet_finish() waits for that.
+*/
+char stm32_applet_start(const stm32_t *stm, const stm32_applet_t *applet, const stm32_mailbox_t *mb) {
+	uint32_t words[APPLET_WORDS];
+	uint8_t  buf[APPLET_WORDS * 4];
+	unsigned int i;
+
+	if (!stm32_applet_load(stm, applet))
+		return 0;
+
+	memset(words, 0, sizeof(words));
+	words[APPLET_STATE] = APPLET_PENDING;
+	words[APPLET_ID   ] = applet->id;
+	words[APPLET_BOOT ] = stm->dev->mem_start;
+	memcpy(&words[APPLET_ARG], mb->arg, sizeof(mb->arg));
+
+	/* the target is little endian, whatever the host is */
+	for(i = 0; i < APPLET_WORDS; ++i) {
+		buf[4 * i    ] = words[i];
+		buf[4 * i + 1] = words[i] >>  8;
+		buf[4 * i + 2] = words[i] >> 16;
+		buf[4 * i + 3] = words[i] >> 24;
+	}
+
+	return stm32_write_memory(stm, APPLET_MAILBOX, buf, sizeof(buf)) &&
+	       stm32_go(stm, APPLET_LOAD);
+}
+
+/*
+	give the started applet timeout us to get back to the bootloader
+	and read its results into mb.  True when it ran to the end, what
+	it made of the job is in mb->status.
+*/
+char stm32_applet_finish(const stm32_t *stm, const stm32_applet_t *applet, stm32_mailbox_t *mb, uint32_t timeout) {
+	uint32_t words[APPLET_WORDS];
+	uint8_t  buf[APPLET_WORDS * 4];
+	unsigned int i;
+
+	if (!stm32_applet_wait(stm, timeout) ||
+	    !stm32_read_memory(stm, APPLET_MAILBOX, buf, sizeof(buf)))
+		return 0;
+
+	for(i = 0; i < APPLET_WORDS; ++i)
+		words[i] = buf[4 * i] | (buf[4 * i + 1] << 8) | (buf[4 * i + 2] << 16) | ((uint32_t)buf[4 * i + 3] << 24);
+
+	if (words[APPLET_STATE] != APPLET_DONE) {
+		fprintf(stderr, "The %s applet did not finish\n", applet->name);
+		return 0;
+	}
+
+	/* it ran, so the image is still there */
+	stm->resident->applet = applet;
+	memcpy(mb->ret, &words[APPLET_RET], sizeof(mb->ret));
+	mb->status = words[APPLET_STATUS];
+	return 1;
 }
 
+/* run the applet on the arguments in mb, see stm32_applet_finish() */
+char stm32_applet_run(const stm32_t *stm, const stm32_applet_t *applet, stm32_mailbox_t *mb, uint32_t timeout) {
+	return stm32_applet_start (stm, applet, mb) &&
+	       stm32_applet_finish(stm, applet, mb, timeout);
+}
+
+/*
+	CRC-32 of each of pages pages of size bytes from address on, as
+	crc32_stm32() works it out from 0xFFFFFFFF.  The CRC applet leaves
+	them in APPLET_BUFFER, from where they are read back four bytes a
+	page, so 192 pages cost three read frames instead of 1536.
+*/
+char stm32_crc_pages(const stm32_t *stm, uint32_t address, unsigned int size, unsigned int pages, uint32_t crcs[]) {
+	stm32_mailbox_t mb;
+	uint8_t buf[256];
+	unsigned int room, n, i, j, len;
+
+	room = stm->dev->ram_end > APPLET_BUFFER ? (stm->dev->ram_end - APPLET_BUFFER) / 4 : 0;
+	if (room > STM32_CRC_PAGES)
+		room = STM32_CRC_PAGES;
+	if (room == 0) {
+		fprintf(stderr, "No RAM left for the page CRCs on this device\n");
+		return 0;
+	}
+
+	while(pages > 0) {
+		n = pages > room ? room : pages;
+
+		memset(&mb, 0, sizeof(mb));
+		mb.arg[0] = address;
+		mb.arg[1] = size;
+		mb.arg[2] = n;
+		mb.arg[3] = APPLET_BUFFER;
+		if (!stm32_applet_run(stm, &stm32_applet_crc, &mb, STM32_CRC_TIMEOUT))
+			return 0;
+		if (mb.status != APPLET_OK || mb.ret[0] != n) {
+			fprintf(stderr, "The crc applet failed, status %u\n", mb.status);
+			return 0;
+		}
+
+		for(i = 0; i < n; i += len / 4) {
+			len = 4 * (n - i) > sizeof(buf) ? sizeof(buf) : 4 * (n - i);
+			if (!stm32_read_memory(stm, APPLET_BUFFER + 4 * i, buf, len))
+				return 0;
+			for(j = 0; j < len; j += 4)
+				crcs[i + j / 4] = buf[j] | (buf[j + 1] << 8) | (buf[j + 2] << 16) | ((uint32_t)buf[j + 3] << 24);
+		}
+
+		address += n * size;
+		crcs    += n;
+		pages   -= n;
+	}
+	return 1;
+}
@@ -23,18 +23,88 @@
 
 #include <stdint.h>
 #include "serial.h"
+#include "stm32/applet.h"
 
 typedef struct stm32		stm32_t;
 typedef struct stm32_cmd	stm32_cmd_t;
 typedef struct stm32_dev	stm32_dev_t;
+typedef struct stm32_frame	stm32_frame_t;
+typedef struct stm32_timeout	stm32_timeout_t;
+typedef struct stm32_retry	stm32_retry_t;
+typedef struct stm32_impl	stm32_impl_t;
+typedef struct stm32_applet	stm32_applet_t;
+typedef struct stm32_resident	stm32_resident_t;
+typedef struct stm32_mailbox	stm32_mailbox_t;
+
+/* page count for stm32_erase_memory that erases the whole flash */
+#define STM32_MASS_ERASE	0xFFFFFFFF
+
+/* command classes, each keeps its own turnaround estimate */
+typedef enum {
+	STM32_OP_GET,		/* also every plain ACK */
+	STM32_OP_RM,
+	STM32_OP_WM,
+	STM32_OP_ER_PAGE,	/* per page erased */
+	STM32_OP_ER_MASS,
+	STM32_OP_GO,
+
+	STM32_OP_COUNT
+} stm32_op_t;
+
+/* operations with more than one bootloader command to choose from */
+typedef enum {
+	STM32_CAP_READ,
+	STM32_CAP_WRITE,
+	STM32_CAP_ERASE,
+	STM32_CAP_GO,
+	STM32_CAP_WUNPROT,
+
+	STM32_CAP_COUNT
+} stm32_cap_t;
+
+/* stm32_impl flags */
+#define STM32_IMPL_DEFAULT	0x01	/* used when the GET list offers nothing better */
+#define STM32_IMPL_EXTENDED	0x02	/* two byte page count and page numbers */
+#define STM32_IMPL_NOSTRETCH	0x04	/* answers BUSY until the operation is done */
+
+/* one bootloader command that can carry out an operation */
+struct stm32_impl {
+	stm32_cap_t	cap;
+	uint8_t		opcode;
+	uint8_t		bl_min;		/* oldest bootloader version that has it */
+	uint8_t		flags;
+	const char	*name;
+};
+
+/* a program built in stm32/ to run from RAM, see stm32/applet.h */
+struct stm32_applet {
+	const char		*name;
+	uint32_t		id;		/* checked by the applet against APPLET_ID */
+	const unsigned char	*image;
+	const unsigned int	*length;
+};
+
+/* the streaming flash loader, see loader.h */
+extern const stm32_applet_t stm32_applet_loader;
+
+/* parameters for one applet run and what it handed back */
+struct stm32_mailbox {
+	uint32_t	arg[APPLET_ARGS];
+	uint32_t	ret[APPLET_RETS];
+	uint32_t	status;
+};
 
 struct stm32 {
-	const serial_t		*serial;
+	serial_t		*serial;
 	uint8_t			bl_version;
 	uint8_t			version;
 	uint8_t			option1, option2;
 	uint16_t		pid;
 	stm32_cmd_t		*cmd;
+	stm32_frame_t		*frame;
+	stm32_timeout_t		*timeout;
+	stm32_retry_t		*retry;
+	stm32_resident_t	*resident;
 	const stm32_dev_t	*dev;
 };
 
@@ -49,14 +119,28 @@ struct stm32_dev {
 	uint32_t	mem_start, mem_end;
 };
 
-stm32_t* stm32_init      (const serial_t *serial, const char init);
+stm32_t* stm32_init      (serial_t *serial, const char init);
 void stm32_close         (stm32_t *stm);
+char stm32_probe         (const stm32_t *stm);
 char stm32_read_memory   (const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len);
 char stm32_write_memory  (const stm32_t *stm, uint32_t address, uint8_t data[], unsigned int len);
 char stm32_wunprot_memory(const stm32_t *stm);
-char stm32_erase_memory  (const stm32_t *stm, uint8_t pages);
+char stm32_erase_memory  (const stm32_t *stm, unsigned int spage, unsigned int pages);
 char stm32_go            (const stm32_t *stm, uint32_t address);
 char stm32_reset_device  (const stm32_t *stm);
+unsigned long stm32_get_frames(const stm32_t *stm);
+uint32_t stm32_get_turnaround(const stm32_t *stm, stm32_op_t op);
+unsigned int stm32_frame_cost(const stm32_t *stm);
+uint32_t stm32_wire_time (const stm32_t *stm, unsigned int bytes);
+void stm32_set_retry     (const stm32_t *stm, unsigned int limit, uint32_t backoff);
+unsigned long stm32_get_retried(const stm32_t *stm);
+unsigned long stm32_get_resyncs(const stm32_t *stm);
+const stm32_impl_t* stm32_get_impl(const stm32_t *stm, stm32_cap_t cap);
+char stm32_applet_load   (const stm32_t *stm, const stm32_applet_t *applet);
+char stm32_applet_start  (const stm32_t *stm, const stm32_applet_t *applet, const stm32_mailbox_t *mb);
+char stm32_applet_finish (const stm32_t *stm, const stm32_applet_t *applet, stm32_mailbox_t *mb, uint32_t timeout);
+char stm32_applet_run    (const stm32_t *stm, const stm32_applet_t *applet, stm32_mailbox_t *mb, uint32_t timeout);
+char stm32_crc_pages     (const stm32_t *stm, uint32_t address, unsigned int size, unsigned int pages, uint32_t crcs[]);
 
 #endif
 
@@ -0,0 +1,69 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_APPLET
+#define _H_APPLET
+
+/*
+	shared by the host (stm32.c) and the programs in this directory,
+	and included from crt0.S, so only plain defines.
+
+	An applet is linked by linker.ld to run from APPLET_LOAD and is
+	started with the bootloader GO command.  It finds its parameters
+	in the mailbox, a block of APPLET_WORDS little endian words that
+	linker.ld keeps out of the code region.  When main() returns, crt0
+	stores its result in APPLET_STATUS, sets APPLET_STATE to
+	APPLET_DONE and jumps through the reset vector of the system memory
+	at APPLET_BOOT, so the host can sync with the bootloader again and
+	read the mailbox back.
+*/
+
+#define APPLET_LOAD	0x20000200
+#define APPLET_MAILBOX	0x200021C0	/* the top 64 bytes of the code region */
+#define APPLET_STACK	0x20006200	/* top of the data, bss and stack region */
+#define APPLET_BUFFER	APPLET_STACK	/* free RAM past the stack, for bulk results */
+
+/* word offsets into the mailbox */
+#define APPLET_STATE	0
+#define APPLET_ID	1	/* which applet the host meant to run */
+#define APPLET_BOOT	2	/* system memory base, where to return to */
+#define APPLET_STATUS	3
+#define APPLET_ARG	4	/* APPLET_ARGS words set by the host */
+#define APPLET_RET	10	/* APPLET_RETS words set by the applet */
+#define APPLET_WORDS	16
+
+#define APPLET_ARGS	(APPLET_RET - APPLET_ARG)
+#define APPLET_RETS	(APPLET_WORDS - APPLET_RET)
+
+/* APPLET_STATE */
+#define APPLET_PENDING	0x444E4550	/* "PEND", written with the parameters */
+#define APPLET_DONE	0x454E4F44	/* "DONE" */
+
+/* APPLET_STATUS, applets add their own from APPLET_EAPPLET up */
+#define APPLET_OK	0
+#define APPLET_EID	1	/* APPLET_ID is not this applet */
+#define APPLET_EARG	2	/* a parameter is out of range */
+#define APPLET_EAPPLET	0x10
+
+/* APPLET_ID, one per program */
+#define APPLET_ID_CRC	0x31435243	/* "CRC1", crc.c */
+#define APPLET_ID_LOADER	0x3152444C	/* "LDR1", loader.c */
+
+#endif
@@ -0,0 +1,36 @@
+#!/bin/sh
+# bin_to_c.sh name: wrap name.bin as name_length and name_binary[] in name_binary.c
+
+NAME=$1
+BIN=$NAME.bin
+OUT=${NAME}_binary.c
+
+[ -f "$BIN" ] || { echo "$0: $BIN not found" >&2; exit 1; }
+
+{
+	cat <<HEADER
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+const unsigned int ${NAME}_length = $(wc -c < "$BIN" | tr -d ' ');
+const unsigned char ${NAME}_binary[] = {
+HEADER
+	od -An -v -tx1 "$BIN" | tr -s ' \n' '\n\n' | sed -n 's/^\(..\)$/0x\1/p' |
+		paste -sd, - | fold -w 80 | sed 's/,$//;s/$/,/;$s/,$/};/'
+} > "$OUT"
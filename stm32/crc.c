@@ -0,0 +1,64 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	CRC-32 of each of a run of flash pages, with the CRC unit.
+
+	arg 0	address of the first page
+	arg 1	page size in bytes, a multiple of 4
+	arg 2	page count
+	arg 3	where to store one CRC word per page
+	ret 0	pages done
+*/
+
+#include <stdint.h>
+#include "applet.h"
+
+#define RCC_AHBENR		(*(volatile uint32_t *)0x40021014)
+#define RCC_AHBENR_CRCEN	(1 << 6)
+
+#define CRC_DR			(*(volatile uint32_t *)0x40023000)
+#define CRC_CR			(*(volatile uint32_t *)0x40023008)
+#define CRC_CR_RESET		1
+
+uint32_t main(volatile uint32_t *mb) {
+	const uint32_t *page	= (const uint32_t *)mb[APPLET_ARG + 0];
+	uint32_t words		= mb[APPLET_ARG + 1] / 4;
+	uint32_t pages		= mb[APPLET_ARG + 2];
+	uint32_t *out		= (uint32_t *)mb[APPLET_ARG + 3];
+	uint32_t i, n;
+
+	if (mb[APPLET_ID] != APPLET_ID_CRC)
+		return APPLET_EID;
+	if (words == 0 || mb[APPLET_ARG + 1] % 4)
+		return APPLET_EARG;
+
+	RCC_AHBENR |= RCC_AHBENR_CRCEN;
+
+	/* the reset loads 0xFFFFFFFF, each word written is folded in MSB first */
+	for(n = 0; n < pages; ++n) {
+		CRC_CR = CRC_CR_RESET;
+		for(i = 0; i < words; ++i)
+			CRC_DR = *page++;
+		*out++ = CRC_DR;
+	}
+
+	mb[APPLET_RET + 0] = n;
+	return APPLET_OK;
+}
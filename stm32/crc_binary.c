@@ -0,0 +1,56 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+const unsigned int crc_length = 552;
+const unsigned char crc_binary[] = {
+0x00,0x62,0x00,0x20,0x33,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x00,0x00,0x00,0x00,
+0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x00,0x00,0x00,0x00,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x70,0x47,0x15,0x49,0x13,0x4a,0x15,0x4b,0x5b,0x1a,0x05,0xd0,0x12,0xf8,0x01,0x4b,
+0x01,0xf8,0x01,0x4b,0x5b,0x1e,0xf9,0xdc,0x11,0x49,0x12,0x4b,0x5b,0x1a,0x05,0xd0,
+0x4f,0xf0,0x00,0x02,0x01,0xf8,0x01,0x2b,0x5b,0x1e,0xfb,0xdc,0x07,0x48,0x00,0xf0,
+0x1b,0xf8,0x06,0x49,0xc8,0x60,0x06,0x48,0x08,0x60,0x88,0x68,0x20,0xb1,0x01,0x68,
+0x81,0xf3,0x08,0x88,0x41,0x68,0x08,0x47,0xfe,0xe7,0x00,0xbf,0xc0,0x21,0x00,0x20,
+0x44,0x4f,0x4e,0x45,0x18,0x04,0x00,0x20,0x00,0x22,0x00,0x20,0x00,0x22,0x00,0x20,
+0x00,0x22,0x00,0x20,0x00,0x22,0x00,0x20,0xf0,0xb5,0x01,0x69,0x42,0x69,0xd0,0xf8,
+0x18,0xe0,0xc3,0x69,0x46,0x68,0x45,0xf2,0x43,0x25,0xc3,0xf2,0x43,0x15,0xae,0x42,
+0x1c,0xbf,0x01,0x20,0xf0,0xbd,0x04,0x2a,0x02,0xd3,0x46,0x69,0xb6,0x07,0x01,0xd0,
+0x02,0x20,0xf0,0xbd,0x41,0xf2,0x14,0x06,0xc4,0xf2,0x02,0x06,0x35,0x68,0xbe,0xf1,
+0x00,0x0f,0x45,0xf0,0x40,0x05,0x35,0x60,0x19,0xd0,0x4f,0xea,0x92,0x0c,0x43,0xf2,
+0x00,0x02,0xc4,0xf2,0x02,0x02,0x01,0x24,0x00,0x25,0xbc,0xf1,0x01,0x0f,0x98,0xbf,
+0xa4,0x46,0x00,0xbf,0x66,0x46,0x94,0x60,0x51,0xf8,0x04,0x7b,0x01,0x3e,0x17,0x60,
+0xfa,0xd1,0x16,0x68,0x01,0x35,0x75,0x45,0x43,0xf8,0x04,0x6b,0xf2,0xd1,0xc0,0xf8,
+0x28,0xe0,0x00,0x20,0xf0,0xbd,0xd4,0xd4,0xe8,0xfd,0xff,0x7f,0x01,0x00,0x00,0x00,
+0xf6,0xff,0xff,0x7f,0x01,0x00,0x00,0x00};
@@ -0,0 +1,420 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+	Flash loader, sets USART1 up again at the rate the bootloader
+	autobauded to (GO leaves the bootloader's peripherals at their reset
+	values) and speaks the stream in loader_proto.h until the host sends
+	QUIT.  DMA channel 5
+	keeps copying received bytes into a ring, so the next frames come
+	in while the current one is checked and programmed, from a page
+	buffer the data is copied or expanded into first.
+
+	arg 0	ring address
+	arg 1	ring size, a power of 2 with room for two frames
+	arg 2	data bytes in a frame at most, a multiple of 4
+	arg 3	page buffer address, as many bytes
+	arg 4	baud rate
+	ret 0	WRITE, ZWRITE and READ frames done
+	ret 1	frames dropped
+*/
+
+#include <stdint.h>
+#include "applet.h"
+#include "loader_proto.h"
+
+#define RCC_CR			(*(volatile uint32_t *)0x40021000)
+#define RCC_CFGR		(*(volatile uint32_t *)0x40021004)
+#define RCC_AHBENR		(*(volatile uint32_t *)0x40021014)
+#define RCC_APB2ENR		(*(volatile uint32_t *)0x40021018)
+#define RCC_CR_HSION		(1 << 0)
+#define RCC_CR_HSIRDY		(1 << 1)
+#define RCC_CFGR_SW		(3 << 0)
+#define RCC_CFGR_SWS		(3 << 2)
+#define RCC_CFGR_SWS_HSE	(1 << 2)
+#define RCC_CFGR_SWS_PLL	(2 << 2)
+#define RCC_CFGR_PLLSRC		(1 << 16)
+#define RCC_AHBENR_DMA1EN	(1 << 0)
+#define RCC_AHBENR_CRCEN	(1 << 6)
+#define RCC_APB2ENR_IOPAEN	(1 << 2)
+#define RCC_APB2ENR_USART1EN	(1 << 14)
+#define HSI_CLOCK		8000000
+
+#define GPIOA_CRH		(*(volatile uint32_t *)0x40010804)
+
+#define CRC_DR			(*(volatile uint32_t *)0x40023000)
+#define CRC_CR			(*(volatile uint32_t *)0x40023008)
+#define CRC_CR_RESET		1
+
+#define USART1_SR		(*(volatile uint32_t *)0x40013800)
+#define USART1_DR		(*(volatile uint32_t *)0x40013804)
+#define USART1_BRR		(*(volatile uint32_t *)0x40013808)
+#define USART1_CR1		(*(volatile uint32_t *)0x4001380C)
+#define USART1_CR2		(*(volatile uint32_t *)0x40013810)
+#define USART1_CR3		(*(volatile uint32_t *)0x40013814)
+#define USART_SR_TC		(1 << 6)
+#define USART_SR_TXE		(1 << 7)
+#define USART_CR1_RE		(1 << 2)
+#define USART_CR1_TE		(1 << 3)
+#define USART_CR1_PCE		(1 << 10)
+#define USART_CR1_M		(1 << 12)
+#define USART_CR1_UE		(1 << 13)
+#define USART_CR3_DMAR		(1 << 6)
+
+/* channel 5 serves USART1_RX */
+#define DMA1_CCR5		(*(volatile uint32_t *)0x40020058)
+#define DMA1_CNDTR5		(*(volatile uint32_t *)0x4002005C)
+#define DMA1_CPAR5		(*(volatile uint32_t *)0x40020060)
+#define DMA1_CMAR5		(*(volatile uint32_t *)0x40020064)
+#define DMA_CCR_EN		(1 << 0)
+#define DMA_CCR_CIRC		(1 << 5)
+#define DMA_CCR_MINC		(1 << 7)
+
+#define FLASH_KEYR		(*(volatile uint32_t *)0x40022004)
+#define FLASH_SR		(*(volatile uint32_t *)0x4002200C)
+#define FLASH_CR		(*(volatile uint32_t *)0x40022010)
+#define FLASH_KEY1		0x45670123
+#define FLASH_KEY2		0xCDEF89AB
+#define FLASH_SR_BSY		(1 << 0)
+#define FLASH_SR_PGERR		(1 << 2)
+#define FLASH_SR_WRPRTERR	(1 << 4)
+#define FLASH_SR_EOP		(1 << 5)
+#define FLASH_CR_PG		(1 << 0)
+#define FLASH_CR_LOCK		(1 << 7)
+
+static const volatile uint8_t *ring;
+static uint32_t size, mask, tail;
+static uint8_t *page;
+
+/* bytes the DMA has stored past tail, the host never lets it lap us */
+static uint32_t ring_count(void) {
+	return (size - DMA1_CNDTR5 - tail) & mask;
+}
+
+static void ring_wait(uint32_t bytes) {
+	while(ring_count() < bytes)
+		;
+}
+
+static uint32_t ring_byte(uint32_t at) {
+	return ring[(tail + at) & mask];
+}
+
+static uint32_t ring_word(uint32_t at) {
+	return ring_byte(at) | ring_byte(at + 1) << 8 | ring_byte(at + 2) << 16 | ring_byte(at + 3) << 24;
+}
+
+/* CRC of len bytes from tail on, len a multiple of 4 */
+static uint32_t ring_crc(uint32_t len) {
+	uint32_t i;
+
+	CRC_CR = CRC_CR_RESET;
+	for(i = 0; i < len; i += 4)
+		CRC_DR = ring_word(i);
+	return CRC_DR;
+}
+
+/*
+	the APB2 clock.  The HSI and the PLL on HSI / 2 are worked out from
+	RCC; a clock from HSE, whose frequency the loader cannot know, is
+	switched to the HSI first.
+*/
+static uint32_t apb2_clock(void) {
+	static const uint8_t hpre[8] = {1, 2, 3, 4, 6, 7, 8, 9};
+	uint32_t cfgr = RCC_CFGR;
+	uint32_t clock = HSI_CLOCK;
+	uint32_t mul;
+
+	if ((cfgr & RCC_CFGR_SWS) == RCC_CFGR_SWS_HSE ||
+	    ((cfgr & RCC_CFGR_SWS) == RCC_CFGR_SWS_PLL && (cfgr & RCC_CFGR_PLLSRC))) {
+		RCC_CR |= RCC_CR_HSION;
+		while(!(RCC_CR & RCC_CR_HSIRDY))
+			;
+		RCC_CFGR &= ~RCC_CFGR_SW;
+		while(RCC_CFGR & RCC_CFGR_SWS)
+			;
+		cfgr = RCC_CFGR;
+	}
+
+	if ((cfgr & RCC_CFGR_SWS) == RCC_CFGR_SWS_PLL) {
+		mul = ((cfgr >> 18) & 15) + 2;
+		clock = HSI_CLOCK / 2 * (mul > 16 ? 16 : mul);
+	}
+	/* AHB then APB2 prescaler */
+	if (cfgr & (8 << 4))
+		clock >>= hpre[(cfgr >> 4) & 7];
+	if (cfgr & (4 << 11))
+		clock >>= ((cfgr >> 11) & 3) + 1;
+	return clock;
+}
+
+/* USART1 on PA9/PA10 as the bootloader has it, 8 data bits, even parity, 1 stop bit */
+static void usart_start(uint32_t baud) {
+	/* the ACK to GO may still be going out */
+	if (USART1_CR1 & USART_CR1_UE)
+		while(!(USART1_SR & USART_SR_TC))
+			;
+
+	RCC_APB2ENR |= RCC_APB2ENR_IOPAEN | RCC_APB2ENR_USART1EN;
+	/* PA9 alternate function push-pull at 50MHz, PA10 floating input */
+	GPIOA_CRH = (GPIOA_CRH & ~0xFF0) | 0x4B0;
+
+	USART1_CR1 = 0;
+	USART1_CR2 = 0;
+	USART1_CR3 = 0;
+	USART1_BRR = (apb2_clock() + baud / 2) / baud;
+	USART1_CR1 = USART_CR1_UE | USART_CR1_M | USART_CR1_PCE | USART_CR1_TE | USART_CR1_RE;
+}
+
+static void send_byte(uint32_t byte) {
+	while(!(USART1_SR & USART_SR_TXE))
+		;
+	USART1_DR = byte;
+}
+
+static void send_word(uint32_t word) {
+	send_byte(word & 0xFF);
+	send_byte((word >> 8) & 0xFF);
+	send_byte((word >> 16) & 0xFF);
+	send_byte(word >> 24);
+}
+
+static void send_reply(uint32_t status, uint32_t seq) {
+	send_byte(status);
+	send_byte(seq);
+}
+
+/* len bytes from address and their CRC */
+static void send_data(const volatile uint8_t *src, uint32_t len) {
+	uint32_t i, word;
+
+	CRC_CR = CRC_CR_RESET;
+	for(i = 0; i < len; i += 4) {
+		word = src[i] | src[i + 1] << 8 | src[i + 2] << 16 | (uint32_t)src[i + 3] << 24;
+		CRC_DR = word;
+		send_word(word);
+	}
+	send_word(CRC_DR);
+}
+
+/* the data of the WRITE frame at tail into the page buffer */
+static uint32_t unpack_copy(uint32_t len) {
+	uint32_t i;
+
+	for(i = 0; i < len; ++i)
+		page[i] = ring_byte(LOADER_HEAD + i);
+	return len;
+}
+
+/* LZ4 length bytes after a nibble of 15, in past end when they run off it */
+static uint32_t unpack_length(uint32_t *in, uint32_t end) {
+	uint32_t n = 0, b;
+
+	do {
+		if (*in >= end) {
+			*in = end + 1;
+			return 0;
+		}
+		b = ring_byte((*in)++);
+		n += b;
+	} while(b == 255);
+	return n;
+}
+
+/*
+	expand the data of the ZWRITE frame at tail into the page buffer,
+	returns the bytes expanded or 0 when the block does not come out at
+	the length it gives
+*/
+static uint32_t unpack_lz4(uint32_t len, uint32_t max) {
+	uint32_t raw	= ring_word(LOADER_HEAD);
+	uint32_t in	= LOADER_HEAD + 4;
+	uint32_t end	= LOADER_HEAD + len;
+	uint32_t out	= 0;
+	uint32_t token, n, offset;
+
+	if (len < 4 || raw == 0 || raw > max || raw % 4)
+		return 0;
+
+	while(in < end) {
+		token = ring_byte(in++);
+
+		n = token >> 4;
+		if (n == 15)
+			n += unpack_length(&in, end);
+		if (in > end || n > raw - out || n > end - in)
+			return 0;
+		while(n--)
+			page[out++] = ring_byte(in++);
+		/* the last sequence has no match, the padding follows it */
+		if (out == raw)
+			break;
+
+		if (end - in < 2)
+			return 0;
+		offset = ring_byte(in) | ring_byte(in + 1) << 8;
+		in += 2;
+		n = token & 15;
+		if (n == 15)
+			n += unpack_length(&in, end);
+		n += 4;
+		if (in > end || offset == 0 || offset > out || n > raw - out)
+			return 0;
+		for(; n; --n, ++out)
+			page[out] = page[out - offset];
+	}
+	return out == raw ? raw : 0;
+}
+
+/* program the page buffer, true when all of it reads back */
+static int program(volatile uint16_t *dst, uint32_t len) {
+	uint32_t i, half;
+	int ok = 1;
+
+	FLASH_SR = FLASH_SR_PGERR | FLASH_SR_WRPRTERR | FLASH_SR_EOP;
+	FLASH_CR = FLASH_CR_PG;
+	for(i = 0; i < len; i += 2, ++dst) {
+		half = page[i] | page[i + 1] << 8;
+		/* erased flash reads 0xFFFF already */
+		if (half != 0xFFFF) {
+			*dst = half;
+			while(FLASH_SR & FLASH_SR_BSY)
+				;
+		}
+		if (*dst != half)
+			ok = 0;
+	}
+	FLASH_CR = 0;
+	return ok;
+}
+
+uint32_t main(volatile uint32_t *mb) {
+	uint32_t max		= mb[APPLET_ARG + 2];
+	uint32_t baud		= mb[APPLET_ARG + 4];
+	uint32_t done		= 0;
+	uint32_t dropped	= 0;
+	uint32_t expect		= 0;
+	int nacked		= 0;
+	uint32_t op, seq, address, len, total, check, i, n, status;
+
+	ring	= (const volatile uint8_t *)mb[APPLET_ARG + 0];
+	size	= mb[APPLET_ARG + 1];
+	mask	= size - 1;
+	tail	= 0;
+	page	= (uint8_t *)mb[APPLET_ARG + 3];
+
+	if (mb[APPLET_ID] != APPLET_ID_LOADER)
+		return APPLET_EID;
+	if (max == 0 || max % 4 || (size & mask) || size < 2 * (LOADER_HEAD + max + LOADER_CRC) || page == 0 || baud == 0)
+		return APPLET_EARG;
+
+	usart_start(baud);
+
+	RCC_AHBENR |= RCC_AHBENR_DMA1EN | RCC_AHBENR_CRCEN;
+	DMA1_CCR5	= 0;
+	DMA1_CPAR5	= (uint32_t)&USART1_DR;
+	DMA1_CMAR5	= (uint32_t)ring;
+	DMA1_CNDTR5	= size;
+	DMA1_CCR5	= DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_EN;
+	USART1_CR3	|= USART_CR3_DMAR;
+
+	if (FLASH_CR & FLASH_CR_LOCK) {
+		FLASH_KEYR = FLASH_KEY1;
+		FLASH_KEYR = FLASH_KEY2;
+	}
+
+	send_reply(LOADER_READY, 0);
+
+	for(;;) {
+		/* hunt for a header, one byte at a time after a bad one */
+		ring_wait(1);
+		if (ring_byte(0) != LOADER_SYNC) {
+			tail = (tail + 1) & mask;
+			continue;
+		}
+
+		ring_wait(LOADER_HEAD);
+		for(check = 0, i = 0; i < LOADER_HEAD; ++i)
+			check ^= ring_byte(i);
+		op	= ring_byte(1);
+		seq	= ring_byte(2);
+		address	= ring_word(4);
+		len	= ring_word(8);
+		if (check != 0 || len > max || len % 4) {
+			tail = (tail + 1) & mask;
+			++dropped;
+			continue;
+		}
+
+		total = LOADER_HEAD + (op == LOADER_OP_WRITE || op == LOADER_OP_ZWRITE ? len : 0);
+		ring_wait(total + LOADER_CRC);
+		if (ring_crc(total) != ring_word(total)) {
+			tail = (tail + 1) & mask;
+			++dropped;
+			continue;
+		}
+
+		if (op == LOADER_OP_QUIT) {
+			send_reply(LOADER_ACK, seq);
+			break;
+		}
+
+		if (op == LOADER_OP_SYNC) {
+			send_reply(LOADER_STATE, expect);
+			nacked = 0;
+		} else if (seq != expect || (op != LOADER_OP_WRITE && op != LOADER_OP_ZWRITE && op != LOADER_OP_READ)) {
+			/* go back to the frame that was lost, once */
+			if (!nacked)
+				send_reply(LOADER_NACK, expect);
+			nacked = 1;
+			++dropped;
+		} else {
+			if (op == LOADER_OP_READ) {
+				status = LOADER_ACK;
+				send_reply(status, seq);
+				send_data((const volatile uint8_t *)address, len);
+			} else {
+				n = op == LOADER_OP_WRITE ? unpack_copy(len) : unpack_lz4(len, max);
+				if (n == 0)
+					status = LOADER_EDATA;
+				else
+					status = program((volatile uint16_t *)address, n) ? LOADER_ACK : LOADER_EFLASH;
+				send_reply(status, seq);
+			}
+			/* a frame that failed stays the one expected, SYNC never counts it done */
+			if (status == LOADER_ACK) {
+				expect = (expect + 1) & 0xFF;
+				++done;
+			}
+			nacked = 0;
+		}
+		tail = (tail + total + LOADER_CRC) & mask;
+	}
+
+	/* let the last reply out before the bootloader has the USART again */
+	while(!(USART1_SR & USART_SR_TC))
+		;
+	USART1_CR3	&= ~USART_CR3_DMAR;
+	DMA1_CCR5	= 0;
+	FLASH_CR	= FLASH_CR_LOCK;
+
+	mb[APPLET_RET + 0] = done;
+	mb[APPLET_RET + 1] = dropped;
+	return APPLET_OK;
+}
@@ -0,0 +1,169 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+const unsigned int loader_length = 2356;
+const unsigned char loader_binary[] = {
+0x00,0x62,0x00,0x20,0x33,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x00,0x00,0x00,0x00,
+0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x00,0x00,0x00,0x00,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,0x30,0x03,0x00,0x20,
+0x70,0x47,0x15,0x49,0x13,0x4a,0x15,0x4b,0x5b,0x1a,0x05,0xd0,0x12,0xf8,0x01,0x4b,
+0x01,0xf8,0x01,0x4b,0x5b,0x1e,0xf9,0xdc,0x11,0x49,0x12,0x4b,0x5b,0x1a,0x05,0xd0,
+0x4f,0xf0,0x00,0x02,0x01,0xf8,0x01,0x2b,0x5b,0x1e,0xfb,0xdc,0x07,0x48,0x00,0xf0,
+0x1b,0xf8,0x06,0x49,0xc8,0x60,0x06,0x48,0x08,0x60,0x88,0x68,0x20,0xb1,0x01,0x68,
+0x81,0xf3,0x08,0x88,0x41,0x68,0x08,0x47,0xfe,0xe7,0x00,0xbf,0xc0,0x21,0x00,0x20,
+0x44,0x4f,0x4e,0x45,0x24,0x0b,0x00,0x20,0x00,0x22,0x00,0x20,0x00,0x22,0x00,0x20,
+0x00,0x22,0x00,0x20,0x00,0x22,0x00,0x20,0x2d,0xe9,0xf0,0x4f,0x93,0xb0,0x04,0x46,
+0x00,0x20,0x11,0x90,0xd4,0xf8,0x18,0xc0,0x22,0x6a,0x21,0x69,0x44,0xf2,0x4c,0x46,
+0x0e,0x91,0x63,0x69,0xc3,0xf2,0x52,0x16,0x58,0x1e,0x0f,0x93,0x10,0x90,0xe7,0x69,
+0x12,0x97,0x60,0x68,0xb0,0x42,0x40,0xf0,0x64,0x83,0xbc,0xf1,0x00,0x0f,0x4f,0xf0,
+0x02,0x00,0x00,0xf0,0x5f,0x83,0x1c,0xf0,0x03,0x06,0x40,0xf0,0x5b,0x83,0x4f,0xf0,
+0x55,0x36,0x06,0xea,0x53,0x06,0x9e,0x1b,0x4f,0xf0,0x33,0x35,0x05,0xea,0x96,0x05,
+0x26,0xf0,0xcc,0x36,0x2e,0x44,0x06,0xeb,0x16,0x16,0x26,0xf0,0xf0,0x36,0x4f,0xf0,
+0x01,0x35,0x6e,0x43,0x36,0x0e,0x01,0x2e,0x00,0xf2,0x44,0x83,0x0c,0xf1,0x10,0x00,
+0xb3,0xeb,0x40,0x0f,0x4f,0xf0,0x02,0x00,0xc0,0xf0,0x3c,0x83,0x00,0x2f,0x00,0xf0,
+0x39,0x83,0x00,0x2a,0x00,0xf0,0x36,0x83,0x43,0xf6,0x00,0x05,0xc4,0xf2,0x01,0x05,
+0xe8,0x68,0x80,0x04,0x03,0xd5,0x00,0xbf,0x28,0x68,0x40,0x06,0xfc,0xd5,0x41,0xf2,
+0x00,0x00,0xc4,0xf2,0x02,0x00,0x83,0x69,0x44,0xf2,0x04,0x07,0x3b,0x43,0x83,0x61,
+0x40,0xf6,0x04,0x03,0xc4,0xf2,0x01,0x03,0x1f,0x68,0x4b,0x26,0x66,0xf3,0x0b,0x17,
+0x1f,0x60,0x00,0x23,0xeb,0x60,0x2b,0x61,0x6b,0x61,0x43,0x68,0x03,0xf0,0x0c,0x07,
+0x04,0x2f,0x03,0xd0,0x08,0x2f,0x12,0xd1,0xdf,0x03,0x10,0xd5,0x03,0x68,0x43,0xf0,
+0x01,0x03,0x03,0x60,0x03,0x68,0x9b,0x07,0xfc,0xd5,0x43,0x68,0x23,0xf0,0x03,0x03,
+0x43,0x60,0x00,0xbf,0x43,0x68,0x13,0xf0,0x0c,0x0f,0xfb,0xd1,0x43,0x68,0x03,0xf0,
+0x0c,0x07,0x08,0x2f,0x41,0xf2,0x00,0x27,0xc0,0xf2,0x7a,0x07,0x09,0xd1,0xc3,0xf3,
+0x83,0x46,0x0e,0x2e,0x28,0xbf,0x0e,0x26,0x43,0xf6,0x09,0x55,0x6e,0x43,0x07,0xeb,
+0x06,0x27,0x1e,0x06,0x07,0xd5,0x40,0xf6,0x1c,0x35,0xc3,0xf3,0x02,0x16,0xc2,0xf2,
+0x00,0x05,0xae,0x5d,0xf7,0x40,0x9e,0x04,0xc3,0xf3,0xc1,0x23,0x01,0x33,0x03,0xea,
+0xe6,0x73,0x27,0xfa,0x03,0xf3,0x03,0xeb,0x52,0x03,0xb3,0xfb,0xf2,0xf2,0x43,0xf6,
+0x00,0x03,0xc4,0xf2,0x01,0x03,0x9a,0x60,0x43,0xf2,0x0c,0x42,0xda,0x60,0x42,0x69,
+0x58,0x27,0x42,0xf0,0x41,0x02,0xc4,0xf2,0x02,0x07,0x42,0x61,0x00,0x20,0x38,0x60,
+0x18,0x1d,0xb8,0x60,0xf9,0x60,0x0f,0x98,0x1a,0x46,0x78,0x60,0xa1,0x20,0x38,0x60,
+0x58,0x69,0x42,0xf2,0x04,0x03,0x40,0xf0,0x40,0x00,0xc4,0xf2,0x02,0x03,0x50,0x61,
+0xd8,0x68,0x00,0x06,0x0e,0xd5,0x40,0xf2,0x23,0x10,0x42,0xf2,0x04,0x03,0xc4,0xf2,
+0x67,0x50,0xc4,0xf2,0x02,0x03,0x18,0x60,0x48,0xf6,0xab,0x10,0xcc,0xf6,0xef,0x50,
+0x18,0x60,0x00,0xbf,0x10,0x68,0x00,0x06,0xfc,0xd5,0xa5,0x20,0xcd,0xf8,0x20,0xc0,
+0x00,0x94,0x50,0x60,0x10,0x68,0x00,0x06,0xfc,0xd5,0x00,0x20,0x50,0x60,0xdd,0xe9,
+0x0e,0x0a,0x43,0xf2,0x00,0x0b,0x02,0x90,0x00,0x20,0x04,0x90,0x00,0x20,0xdd,0xe9,
+0x10,0x89,0x12,0x9b,0x05,0x90,0x00,0x20,0xc4,0xf2,0x02,0x0b,0x0d,0x90,0x00,0x20,
+0x03,0x90,0x01,0x93,0x4a,0x46,0x00,0xbf,0x78,0x68,0x10,0x44,0xaa,0xeb,0x00,0x00,
+0x10,0xea,0x08,0x0f,0xf8,0xd0,0x08,0xea,0x02,0x00,0x08,0x5c,0x5a,0x28,0x05,0xd0,
+0x50,0x1c,0x00,0xea,0x08,0x02,0x11,0x92,0xee,0xe7,0x00,0xbf,0x78,0x68,0x10,0x44,
+0xaa,0xeb,0x00,0x00,0x00,0xea,0x08,0x00,0x0c,0x28,0xf7,0xd3,0x00,0x20,0x00,0x26,
+0x13,0x18,0x03,0xea,0x08,0x03,0xcb,0x5c,0x01,0x30,0x0c,0x28,0x86,0xea,0x03,0x06,
+0xf6,0xd1,0x50,0x1c,0x00,0xea,0x08,0x09,0x90,0x1c,0x00,0xea,0x08,0x00,0x11,0xf8,
+0x09,0xe0,0x08,0x5c,0x02,0xf1,0x0a,0x03,0x0c,0x90,0x10,0x1d,0x00,0xea,0x08,0x00,
+0x08,0x5c,0x02,0xf1,0x0b,0x05,0x0b,0x90,0x50,0x1d,0x00,0xea,0x08,0x00,0x08,0x5c,
+0x03,0xea,0x08,0x03,0x0a,0x90,0x90,0x1d,0x00,0xea,0x08,0x00,0x11,0xf8,0x00,0xc0,
+0xd0,0x1d,0x00,0xea,0x08,0x00,0x08,0x5c,0x05,0xea,0x08,0x05,0x09,0x90,0x02,0xf1,
+0x08,0x00,0x00,0xea,0x08,0x00,0x0c,0x5c,0x02,0xf1,0x09,0x00,0x00,0xea,0x08,0x00,
+0x08,0x5c,0xcb,0x5c,0x4d,0x5d,0x00,0x2e,0x63,0xd1,0x44,0xea,0x00,0x20,0x40,0xea,
+0x03,0x40,0x40,0xea,0x05,0x63,0x08,0x98,0x83,0x42,0x5a,0xd8,0x14,0xf0,0x03,0x00,
+0x57,0xd1,0x03,0xf1,0x0c,0x00,0x05,0x46,0x07,0x93,0xbe,0xf1,0x5a,0x0f,0x18,0xbf,
+0x0c,0x25,0xbe,0xf1,0x57,0x0f,0x06,0x90,0x08,0xbf,0x05,0x46,0x05,0xf1,0x04,0x09,
+0x78,0x68,0x10,0x44,0xaa,0xeb,0x00,0x00,0x00,0xea,0x08,0x00,0x48,0x45,0xf7,0xd3,
+0x58,0x46,0x4f,0xf0,0x01,0x02,0xcb,0xf8,0x08,0x20,0xed,0xb1,0x11,0x9a,0x00,0x26,
+0x90,0x19,0x44,0x1c,0x00,0xea,0x08,0x03,0x04,0xea,0x08,0x04,0xcb,0x5c,0x0c,0x5d,
+0x04,0x36,0x43,0xea,0x04,0x23,0x84,0x1c,0x04,0xea,0x08,0x04,0x03,0x30,0x0c,0x5d,
+0x00,0xea,0x08,0x00,0x08,0x5c,0x43,0xea,0x04,0x43,0x43,0xea,0x00,0x60,0xae,0x42,
+0xcb,0xf8,0x00,0x00,0x58,0x46,0xe3,0xd3,0x00,0x68,0x11,0x9a,0x53,0x19,0x5d,0x1c,
+0x03,0xea,0x08,0x04,0x05,0xea,0x08,0x05,0x0c,0x5d,0x4d,0x5d,0x44,0xea,0x05,0x24,
+0x9d,0x1c,0x05,0xea,0x08,0x05,0x03,0x33,0x4d,0x5d,0x03,0xea,0x08,0x03,0xcb,0x5c,
+0x44,0xea,0x05,0x44,0x44,0xea,0x03,0x63,0x98,0x42,0x08,0xd0,0x50,0x1c,0x00,0xea,
+0x08,0x09,0x0d,0x98,0xcd,0xf8,0x44,0x90,0x01,0x30,0x0d,0x90,0x3a,0xe7,0x43,0xf6,
+0x00,0x03,0xbe,0xf1,0x53,0x0f,0xc4,0xf2,0x01,0x03,0x57,0xd0,0xbe,0xf1,0x51,0x0f,
+0x00,0xf0,0xb3,0x81,0x05,0x98,0x0c,0x9b,0x98,0x42,0x40,0xf0,0x92,0x80,0xdd,0xe9,
+0x0a,0x30,0xbe,0xf1,0x5a,0x0f,0x40,0xea,0x03,0x20,0x09,0x9b,0x40,0xea,0x0c,0x40,
+0x40,0xea,0x03,0x6c,0x18,0xbf,0xbe,0xf1,0x57,0x0f,0x4b,0xd1,0xbe,0xf1,0x57,0x0f,
+0x40,0xf0,0x96,0x80,0xdd,0xf8,0x1c,0xe0,0xbe,0xf1,0x00,0x0f,0x00,0xf0,0x6b,0x81,
+0x01,0x9e,0x02,0xf1,0x0c,0x00,0x00,0x22,0x83,0x18,0x03,0xea,0x08,0x03,0xcb,0x5c,
+0xb3,0x54,0x01,0x32,0x96,0x45,0xf7,0xd1,0x42,0xf2,0x04,0x05,0x34,0x46,0xc4,0xf2,
+0x02,0x05,0x34,0x20,0xa8,0x60,0x01,0x20,0x00,0x22,0xe8,0x60,0x42,0xf0,0x01,0x06,
+0xa3,0x5c,0xa6,0x5d,0x43,0xea,0x06,0x23,0x4f,0xf6,0xff,0x76,0xb3,0x42,0x04,0xd0,
+0xac,0xf8,0x00,0x30,0xae,0x68,0xf6,0x07,0xfc,0xd1,0x3c,0xf8,0x02,0x6b,0x02,0x32,
+0xb3,0x42,0x4f,0xf0,0x00,0x03,0x18,0xbf,0x18,0x46,0x72,0x45,0xe6,0xd3,0x00,0x22,
+0x79,0x24,0xea,0x60,0x00,0x28,0x08,0xbf,0xef,0x24,0x35,0xe1,0x18,0x68,0x00,0x06,
+0xfc,0xd5,0x5e,0x20,0x58,0x60,0x00,0xbf,0x18,0x68,0x00,0x06,0xfc,0xd5,0x05,0x98,
+0x58,0x60,0x40,0xe1,0x43,0xf6,0x00,0x02,0xbe,0xf1,0x52,0x0f,0xc4,0xf2,0x01,0x02,
+0x2f,0xd1,0x00,0xbf,0x10,0x68,0x00,0x06,0xfc,0xd5,0x79,0x20,0x50,0x60,0x00,0xbf,
+0x10,0x68,0x00,0x06,0xfc,0xd5,0x05,0x98,0x5d,0x46,0x50,0x60,0x07,0x99,0x01,0x20,
+0xcb,0xf8,0x08,0x00,0xb1,0xb1,0x00,0x24,0x0c,0xeb,0x04,0x00,0x1c,0xf8,0x04,0x10,
+0x42,0x78,0x66,0x46,0x41,0xea,0x02,0x21,0x82,0x78,0xc0,0x78,0x41,0xea,0x02,0x41,
+0x41,0xea,0x00,0x60,0x28,0x60,0x00,0xf0,0x4d,0xf9,0x07,0x99,0x04,0x34,0xb4,0x46,
+0x8c,0x42,0xe9,0xd3,0x28,0x68,0x00,0xf0,0x45,0xf9,0x02,0x99,0x05,0x9a,0x79,0x24,
+0x00,0xe1,0x04,0x98,0x78,0xb9,0x43,0xf6,0x00,0x02,0xc4,0xf2,0x01,0x02,0x00,0xbf,
+0x10,0x68,0x00,0x06,0xfc,0xd5,0x1f,0x20,0x50,0x60,0x00,0xbf,0x10,0x68,0x00,0x06,
+0xfc,0xd5,0x05,0x98,0x50,0x60,0x0d,0x98,0x01,0x30,0x0d,0x90,0x01,0x20,0xf3,0xe0,
+0x02,0xf1,0x0c,0x00,0x02,0xf1,0x0d,0x03,0x02,0xf1,0x0e,0x06,0x02,0xf1,0x0f,0x05,
+0x00,0xea,0x08,0x00,0x03,0xea,0x08,0x03,0x06,0xea,0x08,0x06,0x05,0xea,0x08,0x05,
+0x08,0x5c,0xcb,0x5c,0x8e,0x5d,0x4d,0x5d,0x07,0x9c,0x04,0x2c,0x4f,0xf0,0xed,0x04,
+0xc0,0xf0,0xc2,0x80,0x40,0xea,0x03,0x23,0x43,0xea,0x06,0x43,0x43,0xea,0x05,0x66,
+0x00,0x2e,0x00,0xf0,0xb9,0x80,0x08,0x9b,0x9e,0x42,0x00,0xf2,0xb5,0x80,0x10,0xf0,
+0x03,0x00,0x0c,0x96,0xcd,0xf8,0x24,0xc0,0x40,0xf0,0xae,0x80,0x06,0x98,0x11,0x28,
+0xc0,0xf0,0x9c,0x80,0x07,0x98,0x12,0x9c,0x0d,0x30,0x07,0x90,0x4f,0xf0,0x10,0x0e,
+0x00,0x25,0x0a,0x94,0x0e,0xeb,0x02,0x00,0x00,0xea,0x08,0x00,0x08,0x5c,0x4f,0xea,
+0x10,0x1c,0x0b,0x90,0xbc,0xf1,0x0f,0x0f,0x0e,0xf1,0x01,0x00,0x0e,0xd1,0xdd,0xf8,
+0x18,0xe0,0x00,0x23,0x70,0x45,0x0d,0xd2,0x16,0x18,0x06,0xea,0x08,0x06,0x8e,0x5d,
+0x44,0x1c,0x33,0x44,0xff,0x2e,0x20,0x46,0xf4,0xd0,0x05,0xe0,0xdd,0xf8,0x18,0xe0,
+0x05,0xe0,0x00,0xbf,0x07,0x9c,0x00,0x23,0x03,0xf1,0x0f,0x0c,0x20,0x46,0x86,0x45,
+0x4f,0xf0,0xed,0x04,0x78,0xd3,0x0c,0x9b,0x5b,0x1b,0x9c,0x45,0x74,0xd8,0xae,0xeb,
+0x00,0x03,0x9c,0x45,0x70,0xd8,0xbc,0xf1,0x00,0x0f,0x11,0xd0,0xdd,0xf8,0x30,0xe0,
+0x0a,0x9e,0x00,0xbf,0x44,0x1c,0x10,0x44,0x00,0xea,0x08,0x00,0x08,0x5c,0x6b,0x1c,
+0xbc,0xf1,0x01,0x0c,0x70,0x55,0x1d,0x46,0x20,0x46,0xf3,0xd1,0x04,0xe0,0x00,0xbf,
+0xdd,0xf8,0x30,0xe0,0x04,0x46,0x2b,0x46,0x9e,0x45,0x75,0xd0,0x06,0x98,0x00,0x1b,
+0x02,0x28,0x50,0xd3,0xa6,0x18,0x06,0xea,0x08,0x00,0x01,0x36,0x06,0xea,0x08,0x06,
+0x11,0xf8,0x00,0xc0,0x8d,0x5d,0x0b,0x98,0x04,0xf1,0x02,0x0e,0x00,0xf0,0x0f,0x06,
+0x0f,0x2e,0x15,0xd1,0x00,0x26,0x00,0xbf,0x06,0x98,0x86,0x45,0x0c,0xd2,0x02,0xeb,
+0x0e,0x04,0x04,0xea,0x08,0x04,0x08,0x5d,0x0e,0xf1,0x01,0x04,0x06,0x44,0xff,0x28,
+0xa6,0x46,0xf1,0xd0,0x02,0xe0,0x00,0xbf,0x07,0x9c,0x00,0x26,0x0f,0x36,0xa6,0x46,
+0x06,0x98,0xed,0x24,0x86,0x45,0x27,0xd8,0x4c,0xea,0x05,0x25,0x25,0xb3,0x9d,0x42,
+0x22,0xd8,0x30,0x1d,0x0c,0x9e,0xf6,0x1a,0xb0,0x42,0x1d,0xd8,0x40,0xb1,0x0a,0x9c,
+0x66,0x1b,0x00,0xbf,0xf5,0x5c,0x01,0x38,0xe5,0x54,0x03,0xf1,0x01,0x03,0xf9,0xd1,
+0x06,0x98,0x1d,0x46,0x86,0x45,0xff,0xf4,0x6d,0xaf,0x00,0xe0,0x00,0x23,0xdd,0xf8,
+0x30,0xe0,0x01,0x9c,0x42,0xf2,0x04,0x05,0xdd,0xf8,0x24,0xc0,0x73,0x45,0xc4,0xf2,
+0x02,0x05,0x3f,0xf4,0xa6,0xae,0xed,0x24,0x43,0xf6,0x00,0x02,0xc4,0xf2,0x01,0x02,
+0x10,0x68,0x00,0x06,0xfc,0xd5,0x54,0x60,0x10,0x68,0x00,0x06,0xfc,0xd5,0x05,0x98,
+0x50,0x60,0x02,0x46,0x50,0x1c,0x79,0x2c,0x08,0xbf,0xc2,0xb2,0x03,0x98,0x05,0x92,
+0x08,0xbf,0x01,0x30,0x03,0x90,0x00,0x20,0x04,0x90,0x11,0x98,0x48,0x44,0x00,0xea,
+0x08,0x09,0xcd,0xf8,0x44,0x90,0x85,0xe5,0x42,0xf2,0x04,0x05,0xdd,0xe9,0x09,0xc4,
+0x7d,0xe6,0x01,0x20,0x13,0xb0,0xbd,0xe8,0xf0,0x8f,0x43,0xf6,0x00,0x01,0xc4,0xf2,
+0x01,0x01,0x00,0xbf,0x08,0x68,0x00,0x06,0xfc,0xd5,0x79,0x20,0x48,0x60,0x00,0x9a,
+0x42,0xf2,0x04,0x03,0xc4,0xf2,0x02,0x03,0x08,0x68,0x00,0x06,0xfc,0xd5,0x0c,0x98,
+0x48,0x60,0x00,0xbf,0x08,0x68,0x40,0x06,0xfc,0xd5,0x48,0x69,0x20,0xf0,0x40,0x00,
+0x48,0x61,0x00,0x20,0x80,0x21,0x38,0x60,0xd9,0x60,0x03,0x99,0x91,0x62,0x0d,0x99,
+0xd1,0x62,0xd7,0xe7,0x43,0xf6,0x00,0x01,0xc4,0xf2,0x01,0x01,0x0a,0x68,0x12,0x06,
+0xfc,0xd5,0xc2,0xb2,0x4a,0x60,0x02,0x0a,0x0b,0x68,0x1b,0x06,0xfc,0xd5,0xd2,0xb2,
+0x4a,0x60,0x02,0x0c,0x0b,0x68,0x1b,0x06,0xfc,0xd5,0xd2,0xb2,0x4a,0x60,0x00,0xbf,
+0x0a,0x68,0x12,0x06,0xfc,0xd5,0x00,0x0e,0x48,0x60,0x70,0x47,0x01,0x02,0x03,0x04,
+0x06,0x07,0x08,0x09,0xdc,0xf6,0xff,0x7f,0x01,0x00,0x00,0x00,0xf0,0xff,0xff,0x7f,
+0x01,0x00,0x00,0x00};
@@ -0,0 +1,70 @@
+/*
+  stm32flash - Open Source ST STM32 flash program for *nix
+  Copyright (C) 2010 Geoffrey McRae <geoff@spacevs.com>
+
+  This program is free software; you can redistribute it and/or
+  modify it under the terms of the GNU General Public License
+  as published by the Free Software Foundation; either version 2
+  of the License, or (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+#ifndef _H_LOADER_PROTO
+#define _H_LOADER_PROTO
+
+/*
+	the stream the flash loader (loader.c here) speaks once it has the
+	USART, shared with the host side (../loader.c).
+
+	The host sends frames without waiting for each answer:
+
+	0	LOADER_SYNC
+	1	op
+	2	sequence number, counts the WRITE and READ frames
+	3	XOR of the other eleven header bytes
+	4	address, little endian
+	8	length, little endian, a multiple of 4 up to the frame size
+	12	length bytes of data, WRITE and ZWRITE only
+		crc32_stm32() of everything before it, little endian
+
+	and the loader answers each WRITE, ZWRITE and READ with a status
+	byte and the sequence number, READ data and its CRC following the
+	ACK.  ZWRITE data is the length it expands to, a multiple of 4 up
+	to the frame size, then an LZ4 block (lz4.h) padded to a word.  A
+	frame that fails its checks is dropped, the first good frame after
+	it with the wrong number gets one NACK carrying the number it
+	expects and the rest are dropped until that one comes.  A WRITE or
+	ZWRITE answered with an error is not counted: the loader still
+	expects its number, so SYNC never reports it done.
+*/
+
+#define LOADER_SYNC	0x5A
+#define LOADER_HEAD	12
+#define LOADER_CRC	4
+#define LOADER_FRAME	4096	/* data bytes in a frame at most */
+
+/* ops */
+#define LOADER_OP_WRITE	'W'	/* program erased flash */
+#define LOADER_OP_ZWRITE 'Z'	/* the same with the data compressed */
+#define LOADER_OP_READ	'R'
+#define LOADER_OP_SYNC	'S'	/* answered with LOADER_STATE, any number */
+#define LOADER_OP_QUIT	'Q'	/* answered with LOADER_ACK, then back to the bootloader */
+
+/* status bytes */
+#define LOADER_READY	0xA5	/* sent once, when the loader has the USART */
+#define LOADER_ACK	0x79
+#define LOADER_NACK	0x1F	/* with the number it expects */
+#define LOADER_STATE	0x5E	/* with the number it expects */
+#define LOADER_EFLASH	0xEF	/* the flash does not read back what was written */
+#define LOADER_EDATA	0xED	/* ZWRITE data does not expand to its length */
+
+#endif
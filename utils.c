@@ -35,3 +35,32 @@ uint32_t be_u32(const uint32_t v) {
 	return v;
 }
 
+/* CRC-32 as used by zlib and Ethernet, start with crc = 0 */
+uint32_t crc32(uint32_t crc, const uint8_t *data, unsigned int len) {
+	int i;
+
+	crc = ~crc;
+	while(len--) {
+		crc ^= *data++;
+		for(i = 0; i < 8; ++i)
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+	}
+	return ~crc;
+}
+
+/*
+	CRC-32 as the STM32 CRC unit works it out: polynomial 0x04C11DB7
+	MSB first, no reflection and no final XOR, fed one little endian
+	word at a time.  Start with crc = 0xFFFFFFFF, what a reset of the
+	unit loads.  len is a multiple of 4.
+*/
+uint32_t crc32_stm32(uint32_t crc, const uint8_t *data, unsigned int len) {
+	int i;
+
+	for(; len >= 4; len -= 4, data += 4) {
+		crc ^= data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24);
+		for(i = 0; i < 32; ++i)
+			crc = (crc << 1) ^ (0x04C11DB7 & -(crc >> 31));
+	}
+	return crc;
+}
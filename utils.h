@@ -25,5 +25,7 @@
 
 char     cpu_le();
 uint32_t be_u32(const uint32_t v);
+uint32_t crc32 (uint32_t crc, const uint8_t *data, unsigned int len);
+uint32_t crc32_stm32(uint32_t crc, const uint8_t *data, unsigned int len);
 
 #endif